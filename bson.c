@@ -15,6 +15,7 @@
  *  limitations under the License.
  */
 
+#include <errno.h>
 #include <php.h>
 #include <zend_exceptions.h>
 
@@ -25,9 +26,21 @@
 #  endif
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define MONGO_UTF8_SSE2 1
+#endif
+
+// 0x0101...01 and 0x8080...80, whatever the size of a long
+#define MONGO_LOW_BITS (~0UL / 0xFF)
+#define MONGO_HIGH_BITS (MONGO_LOW_BITS * 0x80)
+// non-zero if any byte of w is 0
+#define MONGO_HAS_ZERO_BYTE(w) (((w) - MONGO_LOW_BITS) & ~(w) & MONGO_HIGH_BITS)
+
 #include "php_mongo.h"
 #include "bson.h"
 #include "mongo_types.h"
+#include "util/json.h"
 
 extern zend_class_entry *mongo_ce_BinData,
   *mongo_ce_Code,
@@ -40,10 +53,16 @@ extern zend_class_entry *mongo_ce_BinData,
   *mongo_ce_Exception,
   *mongo_ce_CursorException,
   *mongo_ce_Int32,
-  *mongo_ce_Int64;
+  *mongo_ce_Int64,
+  *mongo_ce_RawBSON;
+
+extern int le_ptemplate;
 
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
 
+#define IS_RAW_BSON_P(z) (Z_TYPE_P(z) == IS_OBJECT && Z_OBJCE_P(z) == mongo_ce_RawBSON)
+#define RAW_BSON_P(z) zend_read_property(mongo_ce_RawBSON, z, "bson", strlen("bson"), NOISY TSRMLS_CC)
+
 static int get_limit(mongo_cursor *cursor);
 static int prep_obj_for_db(buffer *buf, HashTable *array TSRMLS_DC);
 #if ZEND_MODULE_API_NO >= 20090115
@@ -51,8 +70,49 @@ static int apply_func_args_wrapper(void **data TSRMLS_DC, int num_args, va_list
 #else
 static int apply_func_args_wrapper(void **data, int num_args, va_list args, zend_hash_key *key);
 #endif /* ZEND_MODULE_API_NO >= 20090115 */
-static int is_utf8(const char *s, int len);
 static int insert_helper(buffer *buf, zval *doc, int max TSRMLS_DC);
+static int size_of_element(char *name, zval **data, int prep TSRMLS_DC);
+static int size_of_index(long index);
+static int validate_document(char *data, int len, int depth);
+static int value_size(char type, char *data, char *end, int depth);
+static zval* raw_bson(zval *obj TSRMLS_DC);
+static int document_size(buffer *buf, zval *doc, int prep TSRMLS_DC);
+static int size_of_payload(int len TSRMLS_DC);
+static int document_to_bson(buffer *buf, zval *doc, int prep TSRMLS_DC);
+static int list_to_bson(buffer *buf, HashTable *hash, int *num TSRMLS_DC);
+static void rewind_buf(buffer *buf, int offset);
+static void serialize_payload(buffer *buf, char *data, int len);
+static char* decode_document(char *buf, HashTable *result, HashTable *filter, int include, mongo_key_cache *keys, int types TSRMLS_DC);
+static int list_length(char *buf);
+static char* decode_list(char *buf, HashTable *result, mongo_key_cache *keys, int types TSRMLS_DC);
+static int serialize_simple(buffer *buf, char *key, int key_len, zval *data, int long_type TSRMLS_DC);
+#if ZEND_MODULE_API_NO >= 20100525
+static mongo_shape* get_shape(zval *obj TSRMLS_DC);
+static int shaped_object_to_bson(buffer *buf, zval *obj TSRMLS_DC);
+static int size_of_shaped_object(zval *obj TSRMLS_DC);
+#endif /* ZEND_MODULE_API_NO >= 20100525 */
+
+// "0".."9999", so the keys of a list don't have to be printed digit by digit
+#define INDEX_KEYS 10000
+static char index_keys[INDEX_KEYS][5];
+
+// nesting of shaped objects before giving up on shapes, see get_shape
+#define MONGO_MAX_SHAPE_DEPTH 64
+
+// nesting php_mongo_validate_bson accepts
+#define MONGO_MAX_BSON_DEPTH 100
+// value_size depth that only checks a nested document's length
+#define DONT_VALIDATE -1
+
+// query templates kept in the persistent list per process (or thread), after
+// that they're compiled for each MongoQueryTemplate
+#define MONGO_MAX_TEMPLATES 1024
+#define MONGO_TEMPLATE_KEY "query template:"
+// the same, for shapes looked up by shape_hash
+#define MONGO_TEMPLATE_HASH_KEY "query shape:"
+
+// field names a mongo_key_cache remembers per document
+#define MONGO_MAX_CACHED_KEYS 1024
 
 
 static int prep_obj_for_db(buffer *buf, HashTable *array TSRMLS_DC) {
@@ -72,7 +132,7 @@ static int prep_obj_for_db(buffer *buf, HashTable *array TSRMLS_DC) {
     data = &newid;
   }
 
-  php_mongo_serialize_element("_id", data, buf, 0 TSRMLS_CC);
+  php_mongo_serialize_element("_id", strlen("_id"), data, buf, 0 TSRMLS_CC);
   if (EG(exception)) {
     return FAILURE;
   }
@@ -104,11 +164,15 @@ int zval_to_bson(buffer *buf, HashTable *hash, int prep TSRMLS_DC) {
       num++;
     }
 
+    // only lists have as many elements as the next free index
+    if (prep || zend_hash_num_elements(hash) != hash->nNextFreeElement ||
+        list_to_bson(buf, hash, &num TSRMLS_CC) == FAILURE) {
 #if ZEND_MODULE_API_NO >= 20090115
-    zend_hash_apply_with_arguments(hash TSRMLS_CC, (apply_func_args_t)apply_func_args_wrapper, 3, buf, prep, &num);
+      zend_hash_apply_with_arguments(hash TSRMLS_CC, (apply_func_args_t)apply_func_args_wrapper, 3, buf, prep, &num);
 #else
-    zend_hash_apply_with_arguments(hash, (apply_func_args_t)apply_func_args_wrapper, 4, buf, prep, &num TSRMLS_CC);
+      zend_hash_apply_with_arguments(hash, (apply_func_args_t)apply_func_args_wrapper, 4, buf, prep, &num TSRMLS_CC);
 #endif /* ZEND_MODULE_API_NO >= 20090115 */
+    }
   }
 
   php_mongo_serialize_null(buf);
@@ -116,6 +180,351 @@ int zval_to_bson(buffer *buf, HashTable *hash, int prep TSRMLS_DC) {
   return EG(exception) ? FAILURE : num;
 }
 
+void php_mongo_init_index_keys() {
+  int i;
+
+  for (i = 0; i < INDEX_KEYS; i++) {
+    snprintf(index_keys[i], sizeof(index_keys[i]), "%d", i);
+  }
+}
+
+/*
+ * Serializes a hash whose keys are 0, 1, 2, ... in order without going
+ * through zend_hash_apply: the keys come from index_keys and ints, doubles and
+ * strings are written right here.  Anything else goes through
+ * php_mongo_serialize_element as usual.
+ *
+ * If a key turns out to be out of order, whatever was written is dropped and
+ * FAILURE is returned so the caller can serialize the hash the slow way.
+ */
+static int list_to_bson(buffer *buf, HashTable *hash, int *num TSRMLS_DC) {
+  uint start = buf->pos - buf->start;
+  int long_type;
+  ulong i = 0;
+  Bucket *p;
+
+  // keys starting with the command character are rewritten, even numeric ones
+  if (MonGlo(encoder).cmd_char >= '0' && MonGlo(encoder).cmd_char <= '9') {
+    return FAILURE;
+  }
+
+  long_type = MonGlo(encoder).long_type;
+
+  // same recursion check zend_hash_apply does
+  if (hash->bApplyProtection && hash->nApplyCount++ >= 3) {
+    zend_error(E_ERROR, "Nesting level too deep - recursive dependency?");
+    return SUCCESS;
+  }
+
+  for (p = hash->pListHead; p; p = p->pListNext, i++) {
+    zval **data = (zval**)p->pData;
+    char digits[24], *key;
+    int key_len;
+
+    if (p->nKeyLength || p->h != i) {
+      rewind_buf(buf, start);
+      break;
+    }
+
+    if (i < INDEX_KEYS) {
+      key = index_keys[i];
+      key_len = i < 10 ? 1 : i < 100 ? 2 : i < 1000 ? 3 : 4;
+    }
+    else {
+      key = digits;
+      key_len = snprintf(digits, sizeof(digits), "%lu", i);
+    }
+
+    if (serialize_simple(buf, key, key_len, *data, long_type TSRMLS_CC) == FAILURE) {
+      php_mongo_serialize_element(key, key_len, data, buf, NO_PREP TSRMLS_CC);
+    }
+    if (EG(exception)) {
+      break;
+    }
+  }
+
+  if (hash->bApplyProtection) {
+    hash->nApplyCount--;
+  }
+
+  if (p && !EG(exception)) {
+    return FAILURE;
+  }
+
+  *num = i;
+  return SUCCESS;
+}
+
+/*
+ * Writes a null, bool, int, double or string element (type, key and value)
+ * without going through php_mongo_serialize_element.  key must already be a
+ * valid key, with the command character replaced.  Returns FAILURE, without
+ * writing anything, if data is of any other type.
+ */
+static int serialize_simple(buffer *buf, char *key, int key_len, zval *data, int long_type TSRMLS_DC) {
+  char type;
+
+  switch (Z_TYPE_P(data)) {
+  case IS_NULL:
+    type = BSON_NULL;
+    break;
+  case IS_BOOL:
+    type = BSON_BOOL;
+    break;
+  case IS_LONG:
+    type = long_type;
+    break;
+  case IS_DOUBLE:
+    type = BSON_DOUBLE;
+    break;
+  case IS_STRING:
+    if (!MonGlo(encoder).check_string(Z_STRVAL_P(data), Z_STRLEN_P(data))) {
+      zend_throw_exception_ex(mongo_ce_Exception, 12 TSRMLS_CC, "non-utf8 string: %s", Z_STRVAL_P(data));
+      return SUCCESS;
+    }
+    type = BSON_STRING;
+    break;
+  default:
+    return FAILURE;
+  }
+
+  // type, key and \0
+  if (BUF_REMAINING <= key_len + 2) {
+    resize_buf(buf, key_len + 2);
+  }
+  *buf->pos = type;
+  memcpy(buf->pos + 1, key, key_len + 1);
+  buf->pos += key_len + 2;
+
+  if (type == BSON_STRING) {
+    php_mongo_serialize_int(buf, Z_STRLEN_P(data)+1);
+    php_mongo_serialize_string(buf, Z_STRVAL_P(data), Z_STRLEN_P(data));
+  }
+  else if (type == BSON_DOUBLE) {
+    php_mongo_serialize_double(buf, Z_DVAL_P(data));
+  }
+  else if (type == BSON_BOOL) {
+    php_mongo_serialize_bool(buf, Z_BVAL_P(data));
+  }
+  else if (type == BSON_LONG || type == BSON_INT) {
+    MonGlo(encoder).serialize_long(buf, Z_LVAL_P(data));
+  }
+
+  return SUCCESS;
+}
+
+#if ZEND_MODULE_API_NO >= 20100525
+/*
+ * Objects whose class only declares public properties and that never had
+ * their property hash built (no dynamic properties, never var_dump'd, ...)
+ * keep their properties in properties_table, in the order the class declares
+ * them.  For those, the keys are checked and copied once per class (a
+ * "shape") and the values are read straight from the table.
+ *
+ * Shapes are kept until the end of the request, like user classes.
+ */
+static void shape_dtor(void *pData) {
+  mongo_shape *shape = *(mongo_shape**)pData;
+
+  if (shape->props) {
+    efree(shape->props);
+    efree(shape->keys);
+  }
+  efree(shape);
+}
+
+/*
+ * Private and protected properties have mangled names, which the slow path
+ * rejects as empty keys: leave those classes to it.
+ */
+static int has_only_public_properties(zend_class_entry *ce) {
+  HashPosition pointer;
+  zend_property_info *info;
+
+  for (; ce; ce = ce->parent) {
+    for (zend_hash_internal_pointer_reset_ex(&ce->properties_info, &pointer);
+         zend_hash_get_current_data_ex(&ce->properties_info, (void**)&info, &pointer) == SUCCESS;
+         zend_hash_move_forward_ex(&ce->properties_info, &pointer)) {
+      if (!(info->flags & ZEND_ACC_STATIC) && !(info->flags & ZEND_ACC_PUBLIC)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+static mongo_shape* create_shape(zend_class_entry *ce) {
+  mongo_shape *shape = (mongo_shape*)ecalloc(1, sizeof(mongo_shape));
+  HashPosition pointer;
+  zend_property_info *info;
+  int keys_len = 0;
+
+  if (!has_only_public_properties(ce)) {
+    shape->count = -1;
+    return shape;
+  }
+
+  shape->props = (mongo_shape_prop*)ecalloc(zend_hash_num_elements(&ce->properties_info) + 1, sizeof(mongo_shape_prop));
+
+  for (zend_hash_internal_pointer_reset_ex(&ce->properties_info, &pointer);
+       zend_hash_get_current_data_ex(&ce->properties_info, (void**)&info, &pointer) == SUCCESS;
+       zend_hash_move_forward_ex(&ce->properties_info, &pointer)) {
+    mongo_shape_prop *prop;
+
+    if ((info->flags & ZEND_ACC_STATIC) || info->offset < 0) {
+      continue;
+    }
+
+    prop = &shape->props[shape->count++];
+    prop->offset = info->offset;
+    prop->name = (char*)info->name;
+    prop->name_len = info->name_length;
+    keys_len += info->name_length + 1;
+  }
+
+  // all the keys, \0-terminated, one after the other
+  shape->keys = (char*)emalloc(keys_len + 1);
+  return shape;
+}
+
+static mongo_shape* get_shape(zval *obj TSRMLS_DC) {
+  zend_class_entry *ce = Z_OBJCE_P(obj);
+  mongo_shape *shape, **found;
+  zend_object *zobj;
+
+  if (ce->type != ZEND_USER_CLASS ||
+      Z_OBJ_HT_P(obj)->get_properties != zend_std_get_properties) {
+    return 0;
+  }
+
+  zobj = (zend_object*)zend_object_store_get_object(obj TSRMLS_CC);
+  if (zobj->properties) {
+    return 0;
+  }
+
+  if (!MonGlo(shapes)) {
+    ALLOC_HASHTABLE(MonGlo(shapes));
+    zend_hash_init(MonGlo(shapes), 8, NULL, shape_dtor, 0);
+  }
+
+  if (zend_hash_index_find(MonGlo(shapes), (ulong)ce, (void**)&found) == SUCCESS) {
+    shape = *found;
+  }
+  else {
+    shape = create_shape(ce);
+    zend_hash_index_update(MonGlo(shapes), (ulong)ce, &shape, sizeof(mongo_shape*), NULL);
+  }
+
+  if (shape->count < 0) {
+    return 0;
+  }
+
+  // the keys depend on mongo.cmd, which can change at any time
+  if (shape->cmd_char != MonGlo(cmd_char)[0]) {
+    char *key = shape->keys;
+    int i;
+
+    shape->cmd_char = MonGlo(cmd_char)[0];
+    for (i = 0; i < shape->count; i++) {
+      mongo_shape_prop *prop = &shape->props[i];
+
+      memcpy(key, prop->name, prop->name_len + 1);
+      if (key[0] == shape->cmd_char) {
+        key[0] = '$';
+      }
+      prop->key = key;
+      key += prop->name_len + 1;
+    }
+  }
+
+  return shape;
+}
+
+/*
+ * Serializes the fields of a shaped object, returns FAILURE if obj doesn't
+ * have a shape and has to go through zval_to_bson(Z_OBJPROP_P(obj)).
+ */
+static int shaped_object_to_bson(buffer *buf, zval *obj TSRMLS_DC) {
+  mongo_shape *shape;
+  zval **table;
+  uint start;
+  int i, long_type;
+
+  // a cycle of objects keeps going deeper: give it to the slow path, which
+  // stops it
+  if (MonGlo(shape_depth) >= MONGO_MAX_SHAPE_DEPTH || (shape = get_shape(obj TSRMLS_CC)) == 0) {
+    return FAILURE;
+  }
+
+  long_type = MonGlo(encoder).long_type;
+
+  if(BUF_REMAINING <= 5) {
+    resize_buf(buf, 5);
+  }
+  start = buf->pos - buf->start;
+  buf->pos += INT_32;
+
+  MonGlo(shape_depth)++;
+  table = ((zend_object*)zend_object_store_get_object(obj TSRMLS_CC))->properties_table;
+
+  for (i = 0; i < shape->count; i++) {
+    mongo_shape_prop *prop = &shape->props[i];
+
+    // unset
+    if (!table[prop->offset]) {
+      continue;
+    }
+
+    if (serialize_simple(buf, prop->key, prop->name_len, table[prop->offset], long_type TSRMLS_CC) == FAILURE) {
+      php_mongo_serialize_element(prop->name, prop->name_len, &table[prop->offset], buf, NO_PREP TSRMLS_CC);
+    }
+    if (EG(exception)) {
+      break;
+    }
+  }
+  MonGlo(shape_depth)--;
+
+  php_mongo_serialize_null(buf);
+  php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+  return SUCCESS;
+}
+
+/*
+ * php_mongo_bson_size for shaped objects, or -1 if obj doesn't have a shape.
+ */
+static int size_of_shaped_object(zval *obj TSRMLS_DC) {
+  mongo_shape *shape;
+  zval **table;
+  int i, size = INT_32 + BYTE_8;
+
+  if (MonGlo(shape_depth) >= MONGO_MAX_SHAPE_DEPTH || (shape = get_shape(obj TSRMLS_CC)) == 0) {
+    return -1;
+  }
+
+  MonGlo(shape_depth)++;
+  table = ((zend_object*)zend_object_store_get_object(obj TSRMLS_CC))->properties_table;
+
+  for (i = 0; i < shape->count; i++) {
+    if (table[shape->props[i].offset]) {
+      size += size_of_element(shape->props[i].name, &table[shape->props[i].offset], NO_PREP TSRMLS_CC);
+    }
+  }
+  MonGlo(shape_depth)--;
+
+  return size;
+}
+#endif /* ZEND_MODULE_API_NO >= 20100525 */
+
+void php_mongo_shapes_shutdown(TSRMLS_D) {
+  if (MonGlo(shapes)) {
+    zend_hash_destroy(MonGlo(shapes));
+    FREE_HASHTABLE(MonGlo(shapes));
+    MonGlo(shapes) = 0;
+  }
+  MonGlo(shape_depth) = 0;
+}
+
 #if ZEND_MODULE_API_NO >= 20090115
 static int apply_func_args_wrapper(void **data TSRMLS_DC, int num_args, va_list args, zend_hash_key *key)
 #else
@@ -131,7 +540,7 @@ static int apply_func_args_wrapper(void **data, int num_args, va_list args, zend
 #endif /* ZEND_MODULE_API_NO < 20090115 */
 
   if (key->nKeyLength) {
-    return php_mongo_serialize_element(key->arKey, (zval**)data, buf, prep TSRMLS_CC);
+    return php_mongo_serialize_element(key->arKey, key->nKeyLength-1, (zval**)data, buf, prep TSRMLS_CC);
   }
   else {
     long current = key->h;
@@ -164,13 +573,182 @@ static int apply_func_args_wrapper(void **data, int num_args, va_list args, zend
       name[pos--] = '-';
     }
 
-    return php_mongo_serialize_element(name+pos+1, (zval**)data, buf, prep TSRMLS_CC);
+    return php_mongo_serialize_element(name+pos+1, 28-pos, (zval**)data, buf, prep TSRMLS_CC);
+  }
+}
+
+/*
+ * Walks the hash the same way zval_to_bson does and returns the number of bytes
+ * it will write.  This is used to size the buffer once before serializing big
+ * documents, instead of growing it a little at a time as fields are appended.
+ *
+ * The result is only used to reserve memory: the serializers still check the
+ * space left, so an object that changes between the two passes (e.g., through
+ * a __get) costs a realloc, not a corrupt message.
+ */
+int php_mongo_bson_size(HashTable *hash, int prep TSRMLS_DC) {
+  HashPosition pointer;
+  zval **data;
+  // length and trailing \0
+  int size = INT_32 + BYTE_8;
+
+  if (zend_hash_num_elements(hash) == 0) {
+    return size;
+  }
+
+  // a recursive structure would never end here, stop it the way
+  // zend_hash_apply stops zval_to_bson
+  if (hash->bApplyProtection && hash->nApplyCount++ >= 3) {
+    zend_error(E_ERROR, "Nesting level too deep - recursive dependency?");
+    return size;
+  }
+
+  if (prep) {
+    // prep_obj_for_db serializes _id first (adding one if it isn't there) and
+    // size_of_element skips it later on
+    if (zend_hash_find(hash, "_id", 4, (void**)&data) == SUCCESS) {
+      size += size_of_element("_id", data, NO_PREP TSRMLS_CC);
+    }
+    else {
+      size += BYTE_8 + sizeof("_id") + OID_SIZE;
+    }
+  }
+
+  for (zend_hash_internal_pointer_reset_ex(hash, &pointer);
+       zend_hash_get_current_data_ex(hash, (void**)&data, &pointer) == SUCCESS;
+       zend_hash_move_forward_ex(hash, &pointer)) {
+    char *key;
+    uint key_len;
+    ulong index;
+
+    if (zend_hash_get_current_key_ex(hash, &key, &key_len, &index, NO_DUP, &pointer) == HASH_KEY_IS_STRING) {
+      size += size_of_element(key, data, prep TSRMLS_CC);
+    }
+    else {
+      // type, digits, \0 (the value doesn't depend on the name)
+      size += size_of_element("", data, prep TSRMLS_CC) + size_of_index((long)index);
+    }
+  }
+
+  if (hash->bApplyProtection) {
+    hash->nApplyCount--;
   }
+
+  return size;
+}
+
+/*
+ * Number of characters apply_func_args_wrapper uses to print an integer key.
+ */
+static int size_of_index(long index) {
+  int len = 1;
+
+  if (index < 0) {
+    index *= -1;
+    len++;
+  }
+
+  while (index >= 10) {
+    index /= 10;
+    len++;
+  }
+
+  return len;
+}
+
+/*
+ * Bytes a string or binary payload of len takes in the buffer being sized:
+ * none if the buffer will only reference it (see serialize_payload).
+ */
+static int size_of_payload(int len TSRMLS_DC) {
+  return MonGlo(size_ref_min) && len >= MonGlo(size_ref_min) ? 0 : len;
 }
 
-int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep TSRMLS_DC) {
-  int name_len = strlen(name);
+/*
+ * Mirrors php_mongo_serialize_element: type byte, key, \0 and value.
+ */
+static int size_of_element(char *name, zval **data, int prep TSRMLS_DC) {
+  int size;
+
+  if (prep && strcmp(name, "_id") == 0) {
+    return 0;
+  }
+
+  size = BYTE_8 + strlen(name) + 1;
+
+  switch (Z_TYPE_PP(data)) {
+  case IS_LONG:
+    size += MonGlo(encoder).long_type == BSON_LONG ? INT_64 : INT_32;
+    break;
+  case IS_DOUBLE:
+    size += DOUBLE_64;
+    break;
+  case IS_BOOL:
+    size += BYTE_8;
+    break;
+  case IS_STRING:
+    size += INT_32 + size_of_payload(Z_STRLEN_PP(data) TSRMLS_CC) + 1;
+    break;
+  case IS_ARRAY:
+    size += php_mongo_bson_size(Z_ARRVAL_PP(data), NO_PREP TSRMLS_CC);
+    break;
+  case IS_OBJECT: {
+    zend_class_entry *clazz = Z_OBJCE_PP(data);
+    zval *z;
+
+    if (clazz == mongo_ce_Id) {
+      mongo_id *id = (mongo_id*)zend_object_store_get_object(*data TSRMLS_CC);
+      size += id->initialized ? OID_SIZE : 0;
+    }
+    else if (clazz == mongo_ce_Date || clazz == mongo_ce_Timestamp || clazz == mongo_ce_Int64) {
+      size += INT_64;
+    }
+    else if (clazz == mongo_ce_Int32) {
+      size += INT_32;
+    }
+    else if (clazz == mongo_ce_RawBSON) {
+      z = RAW_BSON_P(*data);
+      // checked when it's serialized
+      size += Z_TYPE_P(z) == IS_STRING ? Z_STRLEN_P(z) : 0;
+    }
+    else if (clazz == mongo_ce_Regex) {
+      z = zend_read_property(mongo_ce_Regex, *data, "regex", 5, QUIET TSRMLS_CC);
+      size += (Z_TYPE_P(z) == IS_STRING ? size_of_payload(Z_STRLEN_P(z) TSRMLS_CC) : 0) + 1;
+      z = zend_read_property(mongo_ce_Regex, *data, "flags", 5, QUIET TSRMLS_CC);
+      size += (Z_TYPE_P(z) == IS_STRING ? size_of_payload(Z_STRLEN_P(z) TSRMLS_CC) : 0) + 1;
+    }
+    else if (clazz == mongo_ce_Code) {
+      z = zend_read_property(mongo_ce_Code, *data, "code", 4, QUIET TSRMLS_CC);
+      // total size, string size, string, \0
+      size += INT_32 + INT_32 + (Z_TYPE_P(z) == IS_STRING ? size_of_payload(Z_STRLEN_P(z) TSRMLS_CC) : 0) + 1;
+      z = zend_read_property(mongo_ce_Code, *data, "scope", 5, QUIET TSRMLS_CC);
+      if (!IS_SCALAR_P(z)) {
+        size += php_mongo_bson_size(HASH_P(z), NO_PREP TSRMLS_CC);
+      }
+    }
+    else if (clazz == mongo_ce_BinData) {
+      zval *ztype = zend_read_property(mongo_ce_BinData, *data, "type", 4, QUIET TSRMLS_CC);
+      z = zend_read_property(mongo_ce_BinData, *data, "bin", 3, QUIET TSRMLS_CC);
+      // length, subtype, (old-style length), bytes
+      size += INT_32 + BYTE_8 + (Z_LVAL_P(ztype) == 2 ? INT_32 : 0) +
+        (Z_TYPE_P(z) == IS_STRING ? size_of_payload(Z_STRLEN_P(z) TSRMLS_CC) : 0);
+    }
+    else if (clazz != mongo_ce_MinKey && clazz != mongo_ce_MaxKey) {
+      int shaped = -1;
+
+#if ZEND_MODULE_API_NO >= 20100525
+      shaped = size_of_shaped_object(*data TSRMLS_CC);
+#endif /* ZEND_MODULE_API_NO >= 20100525 */
+      size += shaped >= 0 ? shaped : php_mongo_bson_size(Z_OBJPROP_PP(data), NO_PREP TSRMLS_CC);
+    }
+    break;
+  }
+  }
+
+  return size;
+}
 
+int php_mongo_serialize_element(char *name, int name_len, zval **data, buffer *buf, int prep TSRMLS_DC) {
   if (prep && strcmp(name, "_id") == 0) {
     return ZEND_HASH_APPLY_KEEP;
   }
@@ -180,22 +758,12 @@ int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep T
     PHP_MONGO_SERIALIZE_KEY(BSON_NULL);
     break;
   case IS_LONG:
-    if (MonGlo(native_long)) {
-#if SIZEOF_LONG == 4
-      PHP_MONGO_SERIALIZE_KEY(BSON_INT);
-      php_mongo_serialize_int(buf, Z_LVAL_PP(data));
-#else
-# if SIZEOF_LONG == 8
-      PHP_MONGO_SERIALIZE_KEY(BSON_LONG);
-      php_mongo_serialize_long(buf, Z_LVAL_PP(data));
-# else
-#  error The PHP number size is neither 4 or 8 bytes; no clue what to do with that!
-# endif
+#if SIZEOF_LONG != 4 && SIZEOF_LONG != 8
+# error The PHP number size is neither 4 or 8 bytes; no clue what to do with that!
 #endif
-    } else {
-      PHP_MONGO_SERIALIZE_KEY(BSON_INT);
-      php_mongo_serialize_int(buf, Z_LVAL_PP(data));
-    }
+    // BSON_INT unless mongo.native_long is set on a 64-bit platform
+    PHP_MONGO_SERIALIZE_KEY(MonGlo(encoder).long_type);
+    MonGlo(encoder).serialize_long(buf, Z_LVAL_PP(data));
     break;
   case IS_DOUBLE:
     PHP_MONGO_SERIALIZE_KEY(BSON_DOUBLE);
@@ -209,7 +777,7 @@ int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep T
     PHP_MONGO_SERIALIZE_KEY(BSON_STRING);
 
     // if this is not a valid string, stop
-    if (MonGlo(utf8) && !is_utf8(Z_STRVAL_PP(data), Z_STRLEN_PP(data))) {
+    if (!MonGlo(encoder).check_string(Z_STRVAL_PP(data), Z_STRLEN_PP(data))) {
       zend_throw_exception_ex(mongo_ce_Exception, 12 TSRMLS_CC, "non-utf8 string: %s", Z_STRVAL_PP(data));
       return ZEND_HASH_APPLY_STOP;
     }
@@ -251,7 +819,7 @@ int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep T
 
       PHP_MONGO_SERIALIZE_KEY(BSON_OID);
       id = (mongo_id*)zend_object_store_get_object(*data TSRMLS_CC);
-      if (!id->id) {
+      if (!id->initialized) {
 	return ZEND_HASH_APPLY_KEEP;
       }
 
@@ -300,14 +868,27 @@ int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep T
       PHP_MONGO_SERIALIZE_KEY(BSON_LONG);
       php_mongo_serialize_int64(buf, *data TSRMLS_CC);
     }
+    // MongoRawBSON
+    else if (clazz == mongo_ce_RawBSON) {
+      zval *bson = raw_bson(*data TSRMLS_CC);
+
+      if (!bson) {
+        return ZEND_HASH_APPLY_STOP;
+      }
+      PHP_MONGO_SERIALIZE_KEY(BSON_OBJECT);
+      php_mongo_serialize_bytes(buf, Z_STRVAL_P(bson), Z_STRLEN_P(bson));
+    }
     // serialize a normal obj
     else {
-      HashTable *hash = Z_OBJPROP_PP(data);
-
       // go through the k/v pairs and serialize them
       PHP_MONGO_SERIALIZE_KEY(BSON_OBJECT);
 
-      zval_to_bson(buf, hash, NO_PREP TSRMLS_CC);
+#if ZEND_MODULE_API_NO >= 20100525
+      if (shaped_object_to_bson(buf, *data TSRMLS_CC) == FAILURE)
+#endif /* ZEND_MODULE_API_NO >= 20100525 */
+      {
+        zval_to_bson(buf, Z_OBJPROP_PP(data), NO_PREP TSRMLS_CC);
+      }
       if (EG(exception)) {
         return ZEND_HASH_APPLY_STOP;
       }
@@ -334,6 +915,119 @@ int resize_buf(buffer *buf, int size) {
   return total;
 }
 
+int reserve_buf(buffer *buf, int size) {
+  int used = buf->pos - buf->start;
+
+  // the serializers grow the buffer when size or fewer bytes are left, so keep
+  // one spare byte around
+  if (size < 0 || BUF_REMAINING > size) {
+    return buf->end - buf->start;
+  }
+
+  buf->start = (char*)erealloc(buf->start, used + size + 1);
+  buf->pos = buf->start + used;
+  buf->end = buf->pos + size + 1;
+  return buf->end - buf->start;
+}
+
+/*
+ * Every insert, update, delete, query and getmore builds its message in a
+ * buffer that only lives until the message is sent.  Rather than emallocing a
+ * fresh one (and growing it again) each time, one buffer is kept in the
+ * globals for the rest of the request and handed out again, emptied but as
+ * big as it has grown.  Buffers bigger than mongo.send_buffer_max are freed
+ * instead of being kept.
+ *
+ * Nested calls (a buffer is requested while the request's buffer is out) get
+ * a buffer of their own, which is freed on release.
+ */
+void php_mongo_buf_get(buffer *buf, int size TSRMLS_DC) {
+  if (MonGlo(send_buf_depth)++ == 0 && MonGlo(send_buf).start) {
+    *buf = MonGlo(send_buf);
+    buf->pos = buf->start;
+    MonGlo(send_buf).start = 0;
+    MonGlo(send_buf_reused)++;
+
+    reserve_buf(buf, size);
+  }
+  else {
+    CREATE_BUF((*buf), size);
+    MonGlo(send_buf_allocated)++;
+  }
+
+  // these buffers are sent right away, so big strings can stay where they are
+  buf->ref_min = MonGlo(zero_copy_threshold) > 0 ? MonGlo(zero_copy_threshold) : 0;
+}
+
+void php_mongo_buf_release(buffer *buf TSRMLS_DC) {
+  if (buf->refs) {
+    efree(buf->refs);
+    buf->refs = 0;
+  }
+  buf->ref_min = buf->ref_count = 0;
+
+  if (--MonGlo(send_buf_depth) == 0 && buf->end - buf->start <= MonGlo(send_buffer_max)) {
+    MonGlo(send_buf) = *buf;
+  }
+  else {
+    efree(buf->start);
+  }
+  buf->start = buf->pos = buf->end = 0;
+}
+
+/*
+ * Adds len bytes to the buffer.  If the buffer takes references and there are
+ * enough of them, they aren't copied: where they go is recorded and the
+ * sender writes them straight from data, which has to stay put until then.
+ */
+static void serialize_payload(buffer *buf, char *data, int len) {
+  mongo_buf_ref *ref;
+
+  if (!buf->ref_min || len < buf->ref_min) {
+    php_mongo_serialize_bytes(buf, data, len);
+    return;
+  }
+
+  if (buf->ref_count % 8 == 0) {
+    buf->refs = (mongo_buf_ref*)erealloc(buf->refs, (buf->ref_count + 8) * sizeof(mongo_buf_ref));
+  }
+
+  ref = &buf->refs[buf->ref_count++];
+  ref->offset = buf->pos - buf->start;
+  ref->data = data;
+  ref->len = len;
+}
+
+/*
+ * Drops everything after offset, references included.
+ */
+static void rewind_buf(buffer *buf, int offset) {
+  buf->pos = buf->start + offset;
+
+  while (buf->ref_count && buf->refs[buf->ref_count - 1].offset > offset) {
+    buf->ref_count--;
+  }
+}
+
+int php_mongo_buf_len(buffer *buf, char *from) {
+  int len = buf->pos - from, offset = from - buf->start, i;
+
+  // references at offset itself go before from
+  for (i = buf->ref_count - 1; i >= 0 && buf->refs[i].offset > offset; i--) {
+    len += buf->refs[i].len;
+  }
+
+  return len;
+}
+
+void php_mongo_buf_shutdown(TSRMLS_D) {
+  if (MonGlo(send_buf).start) {
+    efree(MonGlo(send_buf).start);
+    MonGlo(send_buf).start = 0;
+  }
+  MonGlo(send_buf_depth) = 0;
+}
+
 /*
  * create a bson date
  *
@@ -477,7 +1171,7 @@ void php_mongo_serialize_bin_data(buffer *buf, zval *bin TSRMLS_DC) {
   }
 
   // bindata
-  php_mongo_serialize_bytes(buf, Z_STRVAL_P(zbin), Z_STRLEN_P(zbin));
+  serialize_payload(buf, Z_STRVAL_P(zbin), Z_STRLEN_P(zbin));
 }
 
 /*
@@ -514,6 +1208,12 @@ void php_mongo_serialize_bytes(buffer *buf, char *str, int str_len) {
 }
 
 void php_mongo_serialize_string(buffer *buf, char *str, int str_len) {
+  if (buf->ref_min && str_len >= buf->ref_min) {
+    serialize_payload(buf, str, str_len);
+    php_mongo_serialize_null(buf);
+    return;
+  }
+
   if(BUF_REMAINING <= str_len+1) {
     resize_buf(buf, str_len+1);
   }
@@ -561,35 +1261,122 @@ void php_mongo_serialize_double(buffer *buf, double num) {
 }
 
 /*
+ * Copies a key into the buffer, checking it on the way, so the key is only
+ * read once.  str_len is the length PHP keeps for the key, but the copy still
+ * ends at the first \0 (keys used to be strlen'd, and BSON keys can't contain
+ * nulls anyway).
+ *
  * prep == true
  *    we are inserting, so keys can't have .s in them
+ *
+ * Each variant below calls this with constant flags, so the checks they turn
+ * off compile away.
  */
-void php_mongo_serialize_key(buffer *buf, char *str, int str_len, int prep TSRMLS_DC) {
-  if (str[0] == '\0' && !MonGlo(allow_empty_keys)) {
-    zend_throw_exception_ex(mongo_ce_Exception, 1 TSRMLS_CC, "zero-length keys are not allowed, did you use $ with double quotes?");
-    return;
-  }
+static inline void serialize_key(buffer *buf, char *str, int str_len, const int prep,
+                                 const int allow_empty, const int replace_cmd TSRMLS_DC) {
+  char *dest;
+  int i = 0;
 
   if(BUF_REMAINING <= str_len+1) {
     resize_buf(buf, str_len+1);
   }
+  dest = buf->pos;
 
-  if (prep && (strchr(str, '.') != 0)) {
-    zend_throw_exception_ex(mongo_ce_Exception, 2 TSRMLS_CC, "'.' not allowed in key: %s", str);
-    return;
+  // a word at a time until we reach one with a \0 or a '.' in it
+  while (i + (int)sizeof(unsigned long) <= str_len) {
+    unsigned long word;
+
+    memcpy(&word, str+i, sizeof(unsigned long));
+    if (MONGO_HAS_ZERO_BYTE(word) ||
+        (prep && MONGO_HAS_ZERO_BYTE(word ^ (MONGO_LOW_BITS * '.')))) {
+      break;
+    }
+    memcpy(dest+i, &word, sizeof(unsigned long));
+    i += sizeof(unsigned long);
   }
 
-  if (MonGlo(cmd_char) && strchr(str, MonGlo(cmd_char)[0]) == str) {
-    *(buf->pos) = '$';
-    memcpy(buf->pos+1, str+1, str_len-1);
+  for (; i < str_len && str[i] != '\0'; i++) {
+    if (prep && str[i] == '.') {
+      zend_throw_exception_ex(mongo_ce_Exception, 2 TSRMLS_CC, "'.' not allowed in key: %s", str);
+      return;
+    }
+    dest[i] = str[i];
   }
-  else {
-    memcpy(buf->pos, str, str_len);
+
+  if (!allow_empty && i == 0) {
+    zend_throw_exception_ex(mongo_ce_Exception, 1 TSRMLS_CC, "zero-length keys are not allowed, did you use $ with double quotes?");
+    return;
+  }
+
+  if (replace_cmd && i > 0 && str[0] == MonGlo(encoder).cmd_char) {
+    dest[0] = '$';
   }
 
   // add \0 at the end of the string
-  buf->pos[str_len] = 0;
-  buf->pos += str_len + 1;
+  dest[i] = 0;
+  buf->pos += i + 1;
+}
+
+#define MONGO_KEY_VARIANT(prep, allow_empty, replace_cmd)               \
+  static void serialize_key_##prep##allow_empty##replace_cmd(buffer *buf, char *str, int str_len TSRMLS_DC) { \
+    serialize_key(buf, str, str_len, prep, allow_empty, replace_cmd TSRMLS_CC); \
+  }
+
+MONGO_KEY_VARIANT(0, 0, 0)
+MONGO_KEY_VARIANT(0, 0, 1)
+MONGO_KEY_VARIANT(0, 1, 0)
+MONGO_KEY_VARIANT(0, 1, 1)
+MONGO_KEY_VARIANT(1, 0, 0)
+MONGO_KEY_VARIANT(1, 0, 1)
+MONGO_KEY_VARIANT(1, 1, 0)
+MONGO_KEY_VARIANT(1, 1, 1)
+
+// [prep][allow_empty][replace_cmd]
+static void (*key_variants[2][2][2])(buffer*, char*, int TSRMLS_DC) = {
+  {{serialize_key_000, serialize_key_001}, {serialize_key_010, serialize_key_011}},
+  {{serialize_key_100, serialize_key_101}, {serialize_key_110, serialize_key_111}}
+};
+
+void php_mongo_serialize_key(buffer *buf, char *str, int str_len, int prep TSRMLS_DC) {
+  MonGlo(encoder).serialize_key[prep ? 1 : 0](buf, str, str_len TSRMLS_CC);
+}
+
+static void serialize_long_as_int(buffer *buf, long num) {
+  php_mongo_serialize_int(buf, (int)num);
+}
+
+#if SIZEOF_LONG == 8
+static void serialize_long_as_long(buffer *buf, long num) {
+  php_mongo_serialize_long(buf, (int64_t)num);
+}
+#endif
+
+static int any_string(const char *s, int len) {
+  return 1;
+}
+
+void php_mongo_bind_encoder(zend_mongo_globals *g) {
+  int allow_empty = g->allow_empty_keys ? 1 : 0,
+    replace_cmd = g->cmd_char && g->cmd_char[0] != '$' ? 1 : 0;
+  mongo_encoder *encoder = &g->encoder;
+
+  encoder->serialize_key[NO_PREP] = key_variants[NO_PREP][allow_empty][replace_cmd];
+  encoder->serialize_key[PREP] = key_variants[PREP][allow_empty][replace_cmd];
+  encoder->cmd_char = replace_cmd ? g->cmd_char[0] : '$';
+
+#if SIZEOF_LONG == 8
+  if (g->native_long) {
+    encoder->long_type = BSON_LONG;
+    encoder->serialize_long = serialize_long_as_long;
+  }
+  else
+#endif
+  {
+    encoder->long_type = BSON_INT;
+    encoder->serialize_long = serialize_long_as_int;
+  }
+
+  encoder->check_string = g->utf8 ? php_mongo_is_utf8 : any_string;
 }
 
 /*
@@ -626,189 +1413,859 @@ void php_mongo_serialize_ns(buffer *buf, char *str TSRMLS_DC) {
  * in the first 4 bytes with the size.
  */
 int php_mongo_serialize_size(char *start, buffer *buf TSRMLS_DC) {
-  int total = MONGO_32((buf->pos - start));
-  if (buf->pos - start > 16000000) {
-    zend_throw_exception_ex(mongo_ce_Exception, 3 TSRMLS_CC, "insert too large: %d, max: 16000000", buf->pos - start);
+  int len = php_mongo_buf_len(buf, start), total = MONGO_32(len);
+  if (len > 16000000) {
+    zend_throw_exception_ex(mongo_ce_Exception, 3 TSRMLS_CC, "insert too large: %d, max: 16000000", len);
     return FAILURE;
   }
   memcpy(start, &total, INT_32);
   return SUCCESS;
 }
 
-static int insert_helper(buffer *buf, zval *doc, int max TSRMLS_DC) {
-  int start = buf->pos - buf->start;
-
-  int result = zval_to_bson(buf, HASH_P(doc), PREP TSRMLS_CC);
+/*
+ * Value sizes, for walking documents without decoding them.  Returns -1 if the
+ * value of the given type doesn't fit before end or is malformed.  Embedded
+ * documents are checked all the way down unless depth is DONT_VALIDATE.
+ */
+static int value_size(char type, char *data, char *end, int depth) {
+  int avail = end - data, len = 0;
 
-  // throw exception if serialization crapped out
-  if (EG(exception) || FAILURE == result) {
-    return FAILURE;
+  if (avail >= INT_32) {
+    memcpy(&len, data, INT_32);
+    len = MONGO_32(len);
   }
-  // return if there were 0 elements
-  else if (0 == result) {
-    zend_throw_exception_ex(mongo_ce_Exception, 4 TSRMLS_CC, "no elements in doc");
-    return FAILURE;
+
+  switch (type) {
+  case BSON_UNDEF:
+  case BSON_NULL:
+  case BSON_MINKEY:
+  case BSON_MAXKEY:
+    return 0;
+  case BSON_BOOL:
+    return avail >= BYTE_8 ? BYTE_8 : -1;
+  case BSON_INT:
+    return avail >= INT_32 ? INT_32 : -1;
+  case BSON_DOUBLE:
+  case BSON_DATE:
+  case BSON_TIMESTAMP:
+  case BSON_LONG:
+    return avail >= INT_64 ? INT_64 : -1;
+  case BSON_OID:
+    return avail >= OID_SIZE ? OID_SIZE : -1;
+  case BSON_STRING:
+  case BSON_CODE__D:
+  case BSON_SYMBOL:
+    // length, string, \0
+    if (avail < INT_32 || len < 1 || len > avail - INT_32 || data[INT_32 + len - 1] != '\0') {
+      return -1;
+    }
+    return INT_32 + len;
+  case BSON_DBREF: {
+    int str = value_size(BSON_STRING, data, end, depth);
+    return str < 0 || avail - str < OID_SIZE ? -1 : str + OID_SIZE;
   }
+  case BSON_OBJECT:
+  case BSON_ARRAY:
+    if (avail < INT_32 || len < INT_32 + BYTE_8 || len > avail) {
+      return -1;
+    }
+    if (depth != DONT_VALIDATE && validate_document(data, len, depth + 1) == FAILURE) {
+      return -1;
+    }
+    return len;
+  case BSON_BINARY:
+    // length, subtype, bytes
+    if (avail < INT_32 + BYTE_8 || len < 0 || len > avail - INT_32 - BYTE_8) {
+      return -1;
+    }
+    return INT_32 + BYTE_8 + len;
+  case BSON_REGEX: {
+    char *regex_end, *flags_end;
 
-  // throw an exception if the doc was too big
-  if(buf->pos - (buf->start + start) > max) {
-    zend_throw_exception_ex(mongo_ce_Exception, 5 TSRMLS_CC, "size of BSON doc is %d bytes, max is %d",
-                            buf->pos - (buf->start + start), max);
-    return FAILURE;
+    if ((regex_end = memchr(data, '\0', avail)) == 0 ||
+        (flags_end = memchr(regex_end + 1, '\0', end - regex_end - 1)) == 0) {
+      return -1;
+    }
+    return flags_end + 1 - data;
+  }
+  case BSON_CODE: {
+    // total length, code, scope
+    int code, scope;
+
+    if (avail < INT_32 || len > avail ||
+        (code = value_size(BSON_STRING, data + INT_32, data + len, depth)) < 0 ||
+        (scope = value_size(BSON_OBJECT, data + INT_32 + code, data + len, depth)) < 0 ||
+        INT_32 + code + scope != len) {
+      return -1;
+    }
+    return len;
+  }
   }
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+  return -1;
 }
 
-int php_mongo_write_insert(buffer *buf, char *ns, zval *doc, int max TSRMLS_DC) {
-  mongo_msg_header header;
-  int start = buf->pos - buf->start;
+/*
+ * Returns the number of fields of the document at data, or FAILURE if it
+ * isn't exactly len bytes long or is malformed.
+ */
+static int validate_document(char *data, int len, int depth) {
+  char *pos = data + INT_32, *end = data + len - 1;
+  int doc_len, fields = 0;
 
-  CREATE_HEADER(buf, ns, OP_INSERT);
+  if (len < INT_32 + BYTE_8 || depth > MONGO_MAX_BSON_DEPTH) {
+    return FAILURE;
+  }
 
-  if (FAILURE == insert_helper(buf, doc, max TSRMLS_CC)) {
+  memcpy(&doc_len, data, INT_32);
+  if (MONGO_32(doc_len) != len || *end != '\0') {
     return FAILURE;
   }
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+  while (pos < end) {
+    char type = *pos++, *name_end;
+    int size;
+
+    if ((name_end = memchr(pos, '\0', end - pos)) == 0 ||
+        (size = value_size(type, name_end + 1, end, depth)) < 0) {
+      return FAILURE;
+    }
+
+    pos = name_end + 1 + size;
+    fields++;
+  }
+
+  return fields;
 }
 
-int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, int max TSRMLS_DC) {
-  int start = buf->pos - buf->start, count = 0;
-  HashPosition pointer;
-  zval **doc;
-  mongo_msg_header header;
+int php_mongo_validate_bson(char *data, int len) {
+  return validate_document(data, len, 0);
+}
 
-  CREATE_HEADER_WITH_OPTS(buf, ns, OP_INSERT, flags);
-  
-//  php_mongo_serialize_int(buf, flags);
+int php_mongo_bson_value_size(char type, char *data, char *end) {
+  return value_size(type, data, end, DONT_VALIDATE);
+}
 
-  for(zend_hash_internal_pointer_reset_ex(HASH_P(docs), &pointer);
-      zend_hash_get_current_data_ex(HASH_P(docs), (void**)&doc, &pointer) == SUCCESS;
-      zend_hash_move_forward_ex(HASH_P(docs), &pointer)) {
+/*
+ * The bytes of a MongoRawBSON.  The constructor checks them, but the property
+ * can still be replaced (unserialize(), reflection), so they are checked again
+ * each time they're used.  Throws and returns 0 if they aren't a document.
+ */
+static zval* raw_bson(zval *obj TSRMLS_DC) {
+  zval *bson = RAW_BSON_P(obj);
 
-    if (IS_SCALAR_PP(doc)) {
-      continue;
-    }
+  if (Z_TYPE_P(bson) != IS_STRING ||
+      validate_document(Z_STRVAL_P(bson), Z_STRLEN_P(bson), 0) == FAILURE) {
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+    return 0;
+  }
+  return bson;
+}
 
-    if (FAILURE == insert_helper(buf, *doc, max TSRMLS_CC) ||
-        buf->pos - buf->start >= MonGlo(max_send_size)) {
-      return FAILURE;
-    }
+/*
+ * php_mongo_bson_size for a whole document, which may be a MongoRawBSON.  Only
+ * what is copied into buf is counted: strings and binary data that buf takes
+ * references to don't need room in it.
+ */
+static int document_size(buffer *buf, zval *doc, int prep TSRMLS_DC) {
+  int size, ref_min;
 
-    count++;
+  if (IS_RAW_BSON_P(doc)) {
+    zval *bson = RAW_BSON_P(doc);
+
+    // checked by document_to_bson, and there might be an _id to add
+    return (Z_TYPE_P(bson) == IS_STRING ? Z_STRLEN_P(bson) : 0) +
+      (prep ? BYTE_8 + sizeof("_id") + OID_SIZE : 0);
   }
 
-  // if there are no elements, don't bother saving
-  if (count == 0) {
-    zend_throw_exception_ex(mongo_ce_Exception, 6 TSRMLS_CC, "no documents given");
-    return FAILURE;
+  ref_min = MonGlo(size_ref_min);
+  MonGlo(size_ref_min) = buf->ref_min;
+  size = php_mongo_bson_size(HASH_P(doc), prep TSRMLS_CC);
+  MonGlo(size_ref_min) = ref_min;
+
+  return size;
+}
+
+/*
+ * zval_to_bson for a whole document.  The bytes of a MongoRawBSON are copied
+ * as they are, except that inserting one (prep) without an _id adds a new
+ * MongoId in front of its fields, and the MongoRawBSON is updated to contain
+ * it, as prep_obj_for_db does for arrays.
+ */
+static int document_to_bson(buffer *buf, zval *doc, int prep TSRMLS_DC) {
+  zval *bson;
+  char *data, *pos, *end;
+  int len, fields = 0, has_id = 0;
+
+  if (!IS_RAW_BSON_P(doc)) {
+    return zval_to_bson(buf, HASH_P(doc), prep TSRMLS_CC);
   }
 
-  // this is a hard limit in the db server (util/messages.cpp)
-  if (buf->pos - (buf->start + start) > 16000000) {
-    zend_throw_exception_ex(mongo_ce_Exception, 3 TSRMLS_CC, "insert too large: %d, max: 16000000", buf->pos - (buf->start+start));
+  if ((bson = raw_bson(doc TSRMLS_CC)) == 0) {
     return FAILURE;
   }
+  data = Z_STRVAL_P(bson);
+  len = Z_STRLEN_P(bson);
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
-}
-
-int php_mongo_write_update(buffer *buf, char *ns, int flags, zval *criteria, zval *newobj TSRMLS_DC) {
-  mongo_msg_header header;
-  int start = buf->pos - buf->start;
+  // raw_bson checked it, this only counts the fields and looks for an _id
+  pos = data + INT_32;
+  end = data + len - 1;
+  while (len >= INT_32 + BYTE_8 && pos < end) {
+    char type = *pos++, *name_end = memchr(pos, '\0', end - pos);
+    int size;
 
-  CREATE_HEADER(buf, ns, OP_UPDATE);
+    if (!name_end || (size = value_size(type, name_end + 1, end, DONT_VALIDATE)) < 0) {
+      break;
+    }
 
-  php_mongo_serialize_int(buf, flags);
+    has_id = has_id || strcmp(pos, "_id") == 0;
+    pos = name_end + 1 + size;
+    fields++;
+  }
 
-  if (zval_to_bson(buf, HASH_P(criteria), NO_PREP TSRMLS_CC) == FAILURE ||
-      EG(exception) ||
-      zval_to_bson(buf, HASH_P(newobj), NO_PREP TSRMLS_CC) == FAILURE ||
-      EG(exception)) {
+  if (len < INT_32 + BYTE_8 || pos != end) {
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
     return FAILURE;
   }
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
-}
+  if (!prep || has_id) {
+    php_mongo_serialize_bytes(buf, data, len);
+    return fields;
+  }
+  else {
+    int start, extra = BYTE_8 + sizeof("_id") + OID_SIZE;
+    char id[OID_SIZE];
 
-int php_mongo_write_delete(buffer *buf, char *ns, int flags, zval *criteria TSRMLS_DC) {
-  mongo_msg_header header;
-  int start = buf->pos - buf->start;
+    if (BUF_REMAINING <= len + extra) {
+      resize_buf(buf, len + extra);
+    }
+    start = buf->pos - buf->start;
 
-  CREATE_HEADER(buf, ns, OP_DELETE);
+    generate_id(id TSRMLS_CC);
 
-  php_mongo_serialize_int(buf, flags);
+    buf->pos += INT_32;
+    php_mongo_set_type(buf, BSON_OID);
+    php_mongo_serialize_bytes(buf, "_id", sizeof("_id"));
+    php_mongo_serialize_bytes(buf, id, OID_SIZE);
+    php_mongo_serialize_bytes(buf, data + INT_32, len - INT_32);
+    php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
 
-  if (zval_to_bson(buf, HASH_P(criteria), NO_PREP TSRMLS_CC) == FAILURE ||
-      EG(exception)) {
-    return FAILURE;
+    zend_update_property_stringl(mongo_ce_RawBSON, doc, "bson", strlen("bson"), buf->start + start, buf->pos - (buf->start + start) TSRMLS_CC);
+    return fields + 1;
   }
+}
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+static void template_add(mongo_template_part **parts, int *count, int start, int end) {
+  if (*count % 16 == 0) {
+    *parts = (mongo_template_part*)erealloc(*parts, (*count + 16) * sizeof(mongo_template_part));
+  }
+  (*parts)[*count].start = start;
+  (*parts)[*count].end = end;
+  (*count)++;
 }
 
 /*
- * Creates a query string in buf.
- *
- * The following fields of cursor are used:
- *  - ns
- *  - opts
- *  - skip
- *  - limit
- *  - query
- *  - fields
- *
+ * Finds the "?" strings in the document starting at start, adding them to
+ * t->slots and the documents they're in to t->docs.  Returns the number of
+ * slots found.
  */
-int php_mongo_write_query(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
-  mongo_msg_header header;
-  int start = buf->pos - buf->start;
+static int template_scan(mongo_template *t, int start) {
+  char *pos, *end;
+  int len, doc_count = t->doc_count, found = 0;
 
-  CREATE_HEADER_WITH_OPTS(buf, cursor->ns, OP_QUERY, cursor->opts);
-  cursor->send.request_id = header.request_id;
+  memcpy(&len, t->skeleton + start, INT_32);
+  len = MONGO_32(len);
+  template_add(&t->docs, &t->doc_count, start, start + len);
 
-  php_mongo_serialize_int(buf, cursor->skip);
-  php_mongo_serialize_int(buf, get_limit(cursor));
+  pos = t->skeleton + start + INT_32;
+  end = t->skeleton + start + len - 1;
+  while (pos < end) {
+    char type = *pos, *value = pos + 1 + strlen(pos + 1) + 1;
+    int size = value_size(type, value, end, DONT_VALIDATE);
 
-  if (zval_to_bson(buf, HASH_P(cursor->query), NO_PREP TSRMLS_CC) == FAILURE ||
-      EG(exception)) {
-    return FAILURE;
-  }
-  if (cursor->fields && zend_hash_num_elements(HASH_P(cursor->fields)) > 0) {
-    if (zval_to_bson(buf, HASH_P(cursor->fields), NO_PREP TSRMLS_CC) == FAILURE ||
-        EG(exception)) {
-      return FAILURE;
+    if (size < 0) {
+      break;
     }
-  }
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
-}
+    if (type == BSON_STRING && size == INT_32 + 2 && value[INT_32] == '?') {
+      template_add(&t->slots, &t->slot_count, pos - t->skeleton, value + size - t->skeleton);
+      found++;
+    }
+    else if (type == BSON_OBJECT || type == BSON_ARRAY) {
+      found += template_scan(t, value - t->skeleton);
+    }
 
-int php_mongo_write_kill_cursors(buffer *buf, int64_t cursor_id TSRMLS_DC) {
-  mongo_msg_header header;
+    pos = value + size;
+  }
 
-  CREATE_MSG_HEADER(MonGlo(request_id)++, 0, OP_KILL_CURSORS);
-  APPEND_HEADER(buf, 0);
+  // nothing to fix up in here
+  if (!found) {
+    t->doc_count = doc_count;
+  }
 
-  // # of cursors
-  php_mongo_serialize_int(buf, 1);
-  // cursor ids
-  php_mongo_serialize_long(buf, cursor_id);
-  return php_mongo_serialize_size(buf->start, buf TSRMLS_CC);
+  return found;
 }
 
 /*
- * Creates a GET_MORE request
- *
- * The following fields of cursor are used:
- *  - ns
- *  - recv.request_id
- *  - limit
- *  - cursor_id
+ * Copies a scanned template into a single allocation, so it can be freed with
+ * one (p)efree.
  */
-int php_mongo_write_get_more(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
-  mongo_msg_header header;
-  int start = buf->pos - buf->start;
+static mongo_template *template_copy(mongo_template *scan, int persistent) {
+  int slots_size = scan->slot_count * sizeof(mongo_template_part),
+    docs_size = scan->doc_count * sizeof(mongo_template_part);
+  mongo_template *t = (mongo_template*)pemalloc(sizeof(mongo_template) + slots_size + docs_size + scan->len, persistent);
+
+  t->slots = (mongo_template_part*)(t + 1);
+  t->slot_count = scan->slot_count;
+  memcpy(t->slots, scan->slots, slots_size);
+
+  t->docs = t->slots + t->slot_count;
+  t->doc_count = scan->doc_count;
+  memcpy(t->docs, scan->docs, docs_size);
+
+  t->skeleton = (char*)(t->docs + t->doc_count);
+  t->len = scan->len;
+  memcpy(t->skeleton, scan->skeleton, scan->len);
+
+  t->persistent = persistent;
+  return t;
+}
+
+static ulong hash_bytes(ulong h, const char *data, int len) {
+  while (len-- > 0) {
+    h = h * 33 + (unsigned char)*data++;
+  }
+  return h;
+}
+
+/*
+ * Hashes the keys, types and values of a shape made of arrays and scalars,
+ * without encoding it.  Returns FAILURE for anything else (objects, deep
+ * nesting), which is looked up by its BSON instead.
+ */
+static int shape_hash(HashTable *shape, ulong *h, int depth) {
+  Bucket *p;
+
+  if (depth > MONGO_MAX_BSON_DEPTH) {
+    return FAILURE;
+  }
+
+  *h = *h * 33 + '{';
+  for (p = shape->pListHead; p; p = p->pListNext) {
+    zval *data = *(zval**)p->pData;
+
+    if (p->nKeyLength) {
+      *h = hash_bytes(*h, p->arKey, p->nKeyLength);
+    }
+    else {
+      *h = hash_bytes(*h, (char*)&p->h, sizeof(ulong));
+    }
+    *h = *h * 33 + Z_TYPE_P(data);
+
+    switch (Z_TYPE_P(data)) {
+    case IS_NULL:
+      break;
+    case IS_LONG:
+      *h = hash_bytes(*h, (char*)&Z_LVAL_P(data), sizeof(long));
+      break;
+    case IS_DOUBLE:
+      *h = hash_bytes(*h, (char*)&Z_DVAL_P(data), sizeof(double));
+      break;
+    case IS_BOOL:
+      *h = *h * 33 + Z_BVAL_P(data);
+      break;
+    case IS_STRING:
+      *h = hash_bytes(*h, Z_STRVAL_P(data), Z_STRLEN_P(data));
+      *h = *h * 33 + Z_STRLEN_P(data);
+      break;
+    case IS_ARRAY:
+      if (shape_hash(Z_ARRVAL_P(data), h, depth + 1) == FAILURE) {
+        return FAILURE;
+      }
+      break;
+    default:
+      return FAILURE;
+    }
+  }
+  *h = *h * 33 + '}';
+
+  return SUCCESS;
+}
+
+/*
+ * Returns 1 if the BSON document at doc is what zval_to_bson would write for
+ * shape, which shape_hash accepted.  Keys are compared the way the encoder
+ * writes them, with the command character replaced.
+ */
+static int template_match(HashTable *shape, char *doc TSRMLS_DC) {
+  char *pos, *end;
+  int len;
+  Bucket *p;
+
+  memcpy(&len, doc, INT_32);
+  pos = doc + INT_32;
+  end = doc + MONGO_32(len) - 1;
+
+  for (p = shape->pListHead; p; p = p->pListNext) {
+    zval *data = *(zval**)p->pData;
+    char digits[24], *key, type, *name, *value;
+    int key_len, name_len;
+
+    if (pos >= end) {
+      return 0;
+    }
+
+    if (p->nKeyLength) {
+      key = p->arKey;
+      key_len = p->nKeyLength - 1;
+    }
+    else {
+      key = digits;
+      key_len = snprintf(digits, sizeof(digits), "%ld", (long)p->h);
+    }
+
+    type = *pos;
+    name = pos + 1;
+    name_len = strlen(name);
+    value = name + name_len + 1;
+
+    if (name_len != key_len ||
+        (key_len && (key[0] == MonGlo(encoder).cmd_char ? '$' : key[0]) != name[0]) ||
+        (key_len > 1 && memcmp(key + 1, name + 1, key_len - 1) != 0)) {
+      return 0;
+    }
+
+    switch (Z_TYPE_P(data)) {
+    case IS_NULL:
+      if (type != BSON_NULL) {
+        return 0;
+      }
+      pos = value;
+      break;
+    case IS_LONG:
+      if (type == BSON_INT) {
+        int i;
+        memcpy(&i, value, INT_32);
+        if (MONGO_32(i) != (int)Z_LVAL_P(data)) {
+          return 0;
+        }
+        pos = value + INT_32;
+      }
+      else if (type == BSON_LONG) {
+        int64_t l;
+        memcpy(&l, value, INT_64);
+        if (MONGO_64(l) != (int64_t)Z_LVAL_P(data)) {
+          return 0;
+        }
+        pos = value + INT_64;
+      }
+      else {
+        return 0;
+      }
+      break;
+    case IS_DOUBLE: {
+      int64_t bits;
+      memcpy(&bits, &Z_DVAL_P(data), DOUBLE_64);
+      bits = MONGO_64(bits);
+      if (type != BSON_DOUBLE || memcmp(value, &bits, DOUBLE_64) != 0) {
+        return 0;
+      }
+      pos = value + DOUBLE_64;
+      break;
+    }
+    case IS_BOOL:
+      if (type != BSON_BOOL || *value != (char)(Z_BVAL_P(data) ? 1 : 0)) {
+        return 0;
+      }
+      pos = value + BYTE_8;
+      break;
+    case IS_STRING:
+      memcpy(&len, value, INT_32);
+      if (type != BSON_STRING || MONGO_32(len) != Z_STRLEN_P(data) + 1 ||
+          memcmp(value + INT_32, Z_STRVAL_P(data), Z_STRLEN_P(data)) != 0) {
+        return 0;
+      }
+      pos = value + INT_32 + Z_STRLEN_P(data) + 1;
+      break;
+    case IS_ARRAY:
+      if ((type != BSON_OBJECT && type != BSON_ARRAY) ||
+          !template_match(Z_ARRVAL_P(data), value TSRMLS_CC)) {
+        return 0;
+      }
+      memcpy(&len, value, INT_32);
+      pos = value + MONGO_32(len);
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  return pos == end;
+}
+
+mongo_template *php_mongo_template_get(HashTable *shape TSRMLS_DC) {
+  zend_rsrc_list_entry *le;
+  mongo_template scan, *t;
+  buffer buf;
+  char hash_key[128];
+  int prefix = strlen(MONGO_TEMPLATE_KEY), hash_key_len = 0, cache = 1;
+  ulong h = 5381;
+
+  // shapes of arrays and scalars are found by a hash, so they don't have to
+  // be encoded when they've been compiled before; the template found is
+  // checked against the shape in case another one has the same hash
+  if (shape_hash(shape, &h, 0) == SUCCESS) {
+    hash_key_len = snprintf(hash_key, sizeof(hash_key), "%s%lx:%d:%c:%d:%d", MONGO_TEMPLATE_HASH_KEY, h,
+                            MonGlo(encoder).long_type, MonGlo(encoder).cmd_char,
+                            MonGlo(utf8), MonGlo(allow_empty_keys));
+
+    if (zend_hash_find(&EG(persistent_list), hash_key, hash_key_len + 1, (void**)&le) == SUCCESS &&
+        le->type == le_ptemplate) {
+      t = (mongo_template*)le->ptr;
+      if (template_match(shape, t->skeleton TSRMLS_CC)) {
+        return t;
+      }
+      // a different shape got there first, compile this one on its own
+      cache = 0;
+    }
+  }
+
+  // otherwise the persistent list key is the prefix followed by the shape's
+  // BSON
+  CREATE_BUF(buf, prefix + php_mongo_bson_size(shape, NO_PREP TSRMLS_CC) + 1);
+  php_mongo_serialize_bytes(&buf, MONGO_TEMPLATE_KEY, prefix);
+  if (zval_to_bson(&buf, shape, NO_PREP TSRMLS_CC) == FAILURE || EG(exception)) {
+    efree(buf.start);
+    return 0;
+  }
+
+  if (!hash_key_len &&
+      zend_hash_find(&EG(persistent_list), buf.start, buf.pos - buf.start, (void**)&le) == SUCCESS &&
+      le->type == le_ptemplate) {
+    efree(buf.start);
+    return (mongo_template*)le->ptr;
+  }
+
+  memset(&scan, 0, sizeof(mongo_template));
+  scan.skeleton = buf.start + prefix;
+  scan.len = buf.pos - scan.skeleton;
+  template_scan(&scan, 0);
+
+  if (cache && MonGlo(template_count) < MONGO_MAX_TEMPLATES) {
+    zend_rsrc_list_entry nle;
+
+    t = template_copy(&scan, 1);
+
+    nle.ptr = t;
+    nle.type = le_ptemplate;
+    nle.refcount = 1;
+    if (hash_key_len) {
+      zend_hash_update(&EG(persistent_list), hash_key, hash_key_len + 1, &nle, sizeof(zend_rsrc_list_entry), NULL);
+    }
+    else {
+      zend_hash_update(&EG(persistent_list), buf.start, buf.pos - buf.start, &nle, sizeof(zend_rsrc_list_entry), NULL);
+    }
+    MonGlo(template_count)++;
+  }
+  else {
+    t = template_copy(&scan, 0);
+  }
+
+  if (scan.slots) {
+    efree(scan.slots);
+  }
+  if (scan.docs) {
+    efree(scan.docs);
+  }
+  efree(buf.start);
+  return t;
+}
+
+void php_mongo_template_free(mongo_template *t) {
+  if (!t->persistent) {
+    efree(t);
+  }
+}
+
+void php_mongo_template_pfree(zend_rsrc_list_entry *rsrc TSRMLS_DC) {
+  pefree(rsrc->ptr, 1);
+}
+
+int php_mongo_template_bind(buffer *buf, mongo_template *t, HashTable *params TSRMLS_DC) {
+  HashPosition pointer;
+  zval **param;
+  int start = buf->pos - buf->start, copied = 0, i, *delta;
+
+  if (zend_hash_num_elements(params) != t->slot_count) {
+    zend_throw_exception_ex(mongo_ce_Exception, 21 TSRMLS_CC, "expected %d parameters, got %d",
+                            t->slot_count, zend_hash_num_elements(params));
+    return FAILURE;
+  }
+
+  // how much each slot grew (or shrank) by
+  delta = (int*)safe_emalloc(t->slot_count + 1, sizeof(int), 0);
+
+  for (zend_hash_internal_pointer_reset_ex(params, &pointer), i = 0;
+       zend_hash_get_current_data_ex(params, (void**)&param, &pointer) == SUCCESS;
+       zend_hash_move_forward_ex(params, &pointer), i++) {
+    mongo_template_part *slot = &t->slots[i];
+    char *key = t->skeleton + slot->start + 1;
+    int before;
+
+    php_mongo_serialize_bytes(buf, t->skeleton + copied, slot->start - copied);
+
+    before = buf->pos - buf->start;
+    if (php_mongo_serialize_element(key, strlen(key), param, buf, NO_PREP TSRMLS_CC) == ZEND_HASH_APPLY_STOP ||
+        EG(exception)) {
+      efree(delta);
+      return FAILURE;
+    }
+    delta[i] = (buf->pos - buf->start - before) - (slot->end - slot->start);
+
+    copied = slot->end;
+  }
+  php_mongo_serialize_bytes(buf, t->skeleton + copied, t->len - copied);
+
+  // fix up the lengths of the documents around the slots
+  for (i = 0; i < t->doc_count; i++) {
+    mongo_template_part *doc = &t->docs[i];
+    int moved = 0, grown = 0, j, len;
+
+    for (j = 0; j < t->slot_count && t->slots[j].start < doc->end; j++) {
+      if (t->slots[j].end <= doc->start) {
+        moved += delta[j];
+      }
+      else {
+        grown += delta[j];
+      }
+    }
+
+    len = MONGO_32(doc->end - doc->start + grown);
+    memcpy(buf->start + start + doc->start + moved, &len, INT_32);
+  }
+
+  efree(delta);
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC) == FAILURE ? FAILURE : SUCCESS;
+}
+
+static int insert_helper(buffer *buf, zval *doc, int max TSRMLS_DC) {
+  int start = buf->pos - buf->start;
+
+  int result = document_to_bson(buf, doc, PREP TSRMLS_CC);
+
+  // throw exception if serialization crapped out
+  if (EG(exception) || FAILURE == result) {
+    return FAILURE;
+  }
+  // return if there were 0 elements
+  else if (0 == result) {
+    zend_throw_exception_ex(mongo_ce_Exception, 4 TSRMLS_CC, "no elements in doc");
+    return FAILURE;
+  }
+
+  // throw an exception if the doc was too big
+  if(php_mongo_buf_len(buf, buf->start + start) > max) {
+    zend_throw_exception_ex(mongo_ce_Exception, 5 TSRMLS_CC, "size of BSON doc is %d bytes, max is %d",
+                            php_mongo_buf_len(buf, buf->start + start), max);
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+int php_mongo_write_insert(buffer *buf, char *ns, zval *doc, int max TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start;
+
+  CREATE_HEADER(buf, ns, OP_INSERT);
+  reserve_buf(buf, document_size(buf, doc, PREP TSRMLS_CC));
+
+  if (FAILURE == insert_helper(buf, doc, max TSRMLS_CC)) {
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+/*
+ * php_mongo_write_insert for a document given as JSON, which is parsed
+ * straight into buf.
+ */
+int php_mongo_write_insert_json(buffer *buf, char *ns, char *json, int json_len, int max TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start, doc_start, fields;
+
+  CREATE_HEADER(buf, ns, OP_INSERT);
+  reserve_buf(buf, json_len);
+  doc_start = buf->pos - buf->start;
+
+  if (FAILURE == (fields = php_mongo_json_to_bson(buf, json, json_len, PREP TSRMLS_CC))) {
+    return FAILURE;
+  }
+  else if (0 == fields) {
+    zend_throw_exception_ex(mongo_ce_Exception, 4 TSRMLS_CC, "no elements in doc");
+    return FAILURE;
+  }
+
+  if (php_mongo_buf_len(buf, buf->start + doc_start) > max) {
+    zend_throw_exception_ex(mongo_ce_Exception, 5 TSRMLS_CC, "size of BSON doc is %d bytes, max is %d",
+                            php_mongo_buf_len(buf, buf->start + doc_start), max);
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, int max TSRMLS_DC) {
+  int start = buf->pos - buf->start, count = 0, size = 0;
+  HashPosition pointer;
+  zval **doc;
+  mongo_msg_header header;
+
+  CREATE_HEADER_WITH_OPTS(buf, ns, OP_INSERT, flags);
+  
+//  php_mongo_serialize_int(buf, flags);
+
+  // size the whole message up front
+  for(zend_hash_internal_pointer_reset_ex(HASH_P(docs), &pointer);
+      zend_hash_get_current_data_ex(HASH_P(docs), (void**)&doc, &pointer) == SUCCESS &&
+        size < MonGlo(max_send_size);
+      zend_hash_move_forward_ex(HASH_P(docs), &pointer)) {
+    if (!IS_SCALAR_PP(doc)) {
+      size += document_size(buf, *doc, PREP TSRMLS_CC);
+    }
+  }
+  reserve_buf(buf, size < MonGlo(max_send_size) ? size : MonGlo(max_send_size));
+
+  for(zend_hash_internal_pointer_reset_ex(HASH_P(docs), &pointer);
+      zend_hash_get_current_data_ex(HASH_P(docs), (void**)&doc, &pointer) == SUCCESS;
+      zend_hash_move_forward_ex(HASH_P(docs), &pointer)) {
+
+    if (IS_SCALAR_PP(doc)) {
+      continue;
+    }
+
+    if (FAILURE == insert_helper(buf, *doc, max TSRMLS_CC) ||
+        php_mongo_buf_len(buf, buf->start) >= MonGlo(max_send_size)) {
+      return FAILURE;
+    }
+
+    count++;
+  }
+
+  // if there are no elements, don't bother saving
+  if (count == 0) {
+    zend_throw_exception_ex(mongo_ce_Exception, 6 TSRMLS_CC, "no documents given");
+    return FAILURE;
+  }
+
+  // this is a hard limit in the db server (util/messages.cpp)
+  if (php_mongo_buf_len(buf, buf->start + start) > 16000000) {
+    zend_throw_exception_ex(mongo_ce_Exception, 3 TSRMLS_CC, "insert too large: %d, max: 16000000", php_mongo_buf_len(buf, buf->start + start));
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+int php_mongo_write_update(buffer *buf, char *ns, int flags, zval *criteria, zval *newobj TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start;
+
+  CREATE_HEADER(buf, ns, OP_UPDATE);
+
+  php_mongo_serialize_int(buf, flags);
+  reserve_buf(buf, document_size(buf, criteria, NO_PREP TSRMLS_CC) +
+              document_size(buf, newobj, NO_PREP TSRMLS_CC));
+
+  if (document_to_bson(buf, criteria, NO_PREP TSRMLS_CC) == FAILURE ||
+      EG(exception) ||
+      document_to_bson(buf, newobj, NO_PREP TSRMLS_CC) == FAILURE ||
+      EG(exception)) {
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+int php_mongo_write_delete(buffer *buf, char *ns, int flags, zval *criteria TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start;
+
+  CREATE_HEADER(buf, ns, OP_DELETE);
+
+  php_mongo_serialize_int(buf, flags);
+
+  if (document_to_bson(buf, criteria, NO_PREP TSRMLS_CC) == FAILURE ||
+      EG(exception)) {
+    return FAILURE;
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+/*
+ * Creates a query string in buf.
+ *
+ * The following fields of cursor are used:
+ *  - ns
+ *  - opts
+ *  - skip
+ *  - limit
+ *  - query
+ *  - fields
+ *
+ */
+int php_mongo_write_query(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start;
+
+  CREATE_HEADER_WITH_OPTS(buf, cursor->ns, OP_QUERY, cursor->opts);
+  cursor->send.request_id = header.request_id;
+
+  php_mongo_serialize_int(buf, cursor->skip);
+  php_mongo_serialize_int(buf, get_limit(cursor));
+
+  if (document_to_bson(buf, cursor->query, NO_PREP TSRMLS_CC) == FAILURE ||
+      EG(exception)) {
+    return FAILURE;
+  }
+  if (cursor->fields && (IS_RAW_BSON_P(cursor->fields) ||
+                         zend_hash_num_elements(HASH_P(cursor->fields)) > 0)) {
+    if (document_to_bson(buf, cursor->fields, NO_PREP TSRMLS_CC) == FAILURE ||
+        EG(exception)) {
+      return FAILURE;
+    }
+  }
+
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+int php_mongo_write_kill_cursors(buffer *buf, int64_t cursor_id TSRMLS_DC) {
+  mongo_msg_header header;
+
+  CREATE_MSG_HEADER(MonGlo(request_id)++, 0, OP_KILL_CURSORS);
+  APPEND_HEADER(buf, 0);
+
+  // # of cursors
+  php_mongo_serialize_int(buf, 1);
+  // cursor ids
+  php_mongo_serialize_long(buf, cursor_id);
+  return php_mongo_serialize_size(buf->start, buf TSRMLS_CC);
+}
+
+/*
+ * Creates a GET_MORE request
+ *
+ * The following fields of cursor are used:
+ *  - ns
+ *  - recv.request_id
+ *  - limit
+ *  - cursor_id
+ */
+int php_mongo_write_get_more(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
+  mongo_msg_header header;
+  int start = buf->pos - buf->start;
 
   CREATE_RESPONSE_HEADER(buf, cursor->ns, cursor->recv.request_id, OP_GET_MORE);
   cursor->send.request_id = header.request_id;
@@ -816,33 +2273,483 @@ int php_mongo_write_get_more(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
   php_mongo_serialize_int(buf, get_limit(cursor));
   php_mongo_serialize_long(buf, cursor->cursor_id);
 
-  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+
+static int get_limit(mongo_cursor *cursor) {
+  int lim_at;
+
+  if (cursor->limit < 0) {
+    return cursor->limit;
+  }
+  else if (cursor->batch_size < 0) {
+    return cursor->batch_size;
+  }
+
+  lim_at = cursor->limit > cursor->batch_size ? cursor->limit - cursor->num : cursor->limit;
+  if (cursor->batch_size && (!lim_at || cursor->batch_size <= lim_at)) {
+    return cursor->batch_size;
+  }
+  else if (lim_at && (!cursor->batch_size || lim_at < cursor->batch_size)) {
+    return lim_at;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Prints a BSON long for MongoInt64 and MONGO_TYPE_LONG_AS_STRING.
+ */
+static char* long_to_string(int64_t l) {
+  char *buffer;
+
+#ifdef WIN32
+  spprintf(&buffer, 0, "%I64d", l);
+#else
+  spprintf(&buffer, 0, "%lld", (long long int)l);
+#endif
+  return buffer;
+}
+
+/*
+ * Decodes the value of an element of the given type into value, buf points
+ * just past the element's name.  Returns the position after the value, or 0
+ * with an exception thrown.  For types it doesn't know, the bytes from
+ * buf_start up to here are dumped into the exception message.  types is a set
+ * of MONGO_TYPE_* flags.
+ */
+static char* decode_value(char type, char *name, char *buf, char *buf_start, zval *value, mongo_key_cache *keys, int types TSRMLS_DC) {
+  switch(type) {
+  case BSON_OID: {
+    php_mongo_id_init(value, buf TSRMLS_CC);
+    buf += OID_SIZE;
+    break;
+  }
+  case BSON_DOUBLE: {
+    double d = *(double*)buf;
+    int64_t i, *i_p;
+    i_p = &i;
+
+    memcpy(i_p, &d, DOUBLE_64);
+    i = MONGO_64(i);
+    memcpy(&d, i_p, DOUBLE_64);
+
+    ZVAL_DOUBLE(value, d);
+    buf += DOUBLE_64;
+    break;
+  }
+  case BSON_SYMBOL:
+  case BSON_STRING: {
+    // len includes \0
+    int len = MONGO_32(*((int*)buf));
+    if (INVALID_STRING_LEN(len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 0 TSRMLS_CC, "invalid string length for key \"%s\": %d", name, len);
+      return 0;
+    }
+    buf += INT_32;
+
+    ZVAL_STRINGL(value, buf, len-1, 1);
+    buf += len;
+    break;
+  }
+  case BSON_OBJECT: {
+    array_init(value);
+    buf = decode_document(buf, Z_ARRVAL_P(value), 0, 0, keys, types TSRMLS_CC);
+    if (EG(exception)) {
+      return 0;
+    }
+    break;
+  }
+  case BSON_ARRAY: {
+    int count = list_length(buf);
+
+    if (count < 0) {
+      array_init(value);
+      buf = decode_document(buf, Z_ARRVAL_P(value), 0, 0, keys, types TSRMLS_CC);
+    }
+    else {
+      MONGO_ARRAY_INIT_SIZE(value, count);
+      buf = decode_list(buf, Z_ARRVAL_P(value), keys, types TSRMLS_CC);
+    }
+    if (EG(exception)) {
+      return 0;
+    }
+    break;
+  }
+  case BSON_BINARY: {
+    unsigned char type;
+
+    int len = MONGO_32(*(int*)buf);
+    if (INVALID_STRING_LEN(len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "invalid binary length for key \"%s\": %d", name, len);
+      return 0;
+    }
+    buf += INT_32;
+
+    type = *buf++;
+
+    /* If the type is 2, check if the binary data
+     * is prefixed by its length.
+     *
+     * There is an infinitesimally small chance that
+     * the first four bytes will happen to be the
+     * length of the rest of the string.  In this
+     * case, the data will be corrupted.
+     */
+    if ((int)type == 2) {
+      int len2 = MONGO_32(*(int*)buf);
+
+      /* if the lengths match, the data is to spec,
+       * so we use len2 as the true length.
+       */
+      if (len2 == len - 4) {
+        len = len2;
+        buf += INT_32;
+      }
+    }
+
+    if (types & MONGO_TYPE_BIN_AS_STRING) {
+      ZVAL_STRINGL(value, buf, len, 1);
+    }
+    else {
+      object_init_ex(value, mongo_ce_BinData);
+
+      zend_update_property_stringl(mongo_ce_BinData, value, "bin", strlen("bin"), buf, len TSRMLS_CC);
+      zend_update_property_long(mongo_ce_BinData, value, "type", strlen("type"), type TSRMLS_CC);
+    }
+
+    buf += len;
+    break;
+  }
+  case BSON_BOOL: {
+    char d = *buf++;
+    ZVAL_BOOL(value, d);
+    break;
+  }
+  case BSON_UNDEF:
+  case BSON_NULL: {
+    ZVAL_NULL(value);
+    break;
+  }
+  case BSON_INT: {
+    ZVAL_LONG(value, MONGO_32(*((int*)buf)));
+    buf += INT_32;
+    break;
+  }
+  case BSON_LONG: {
+    if (types & MONGO_TYPE_LONG_AS_STRING) {
+      ZVAL_STRING(value, long_to_string((int64_t)MONGO_64(*((int64_t*)buf))), 0);
+    }
+    else if (MonGlo(long_as_object) && !(types & MONGO_TYPE_LONG_AS_INT)) {
+      char *buffer = long_to_string((int64_t)MONGO_64(*((int64_t*)buf)));
+
+      object_init_ex(value, mongo_ce_Int64);
+
+      zend_update_property_string(mongo_ce_Int64, value, "value", strlen("value"), buffer TSRMLS_CC);
+
+      efree(buffer);
+    } else {
+      if (MonGlo(native_long) || (types & MONGO_TYPE_LONG_AS_INT)) {
+#if SIZEOF_LONG == 4
+        zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "Can not natively represent the long %llu on this platform", (int64_t)MONGO_64(*((int64_t*)buf)));
+        return 0;
+#else
+# if SIZEOF_LONG == 8
+        ZVAL_LONG(value, (long)MONGO_64(*((int64_t*)buf)));
+# else
+#  error The PHP number size is neither 4 or 8 bytes; no clue what to do with that!
+# endif
+#endif
+      } else {
+        ZVAL_DOUBLE(value, (double)MONGO_64(*((int64_t*)buf)));
+      }
+    }
+    buf += INT_64;
+    break;
+  }
+  case BSON_DATE: {
+    int64_t d = MONGO_64(*((int64_t*)buf));
+    buf += INT_64;
+
+    if (types & MONGO_TYPE_DATE_AS_INT) {
+#if SIZEOF_LONG == 8
+      ZVAL_LONG(value, (long)d);
+#else
+      // milliseconds don't fit in 32 bits
+      ZVAL_DOUBLE(value, (double)d);
+#endif
+      break;
+    }
+
+    object_init_ex(value, mongo_ce_Date);
+
+    zend_update_property_long(mongo_ce_Date, value, "sec", strlen("sec"), (long)(d/1000) TSRMLS_CC);
+    zend_update_property_long(mongo_ce_Date, value, "usec", strlen("usec"), (long)((d*1000)%1000000) TSRMLS_CC);
+
+    break;
+  }
+  case BSON_REGEX: {
+    char *regex, *flags;
+    int regex_len, flags_len;
+
+    regex = buf;
+    regex_len = strlen(buf);
+    buf += regex_len+1;
+
+    flags = buf;
+    flags_len = strlen(buf);
+    buf += flags_len+1;
+
+    object_init_ex(value, mongo_ce_Regex);
+
+    zend_update_property_stringl(mongo_ce_Regex, value, "regex", strlen("regex"), regex, regex_len TSRMLS_CC);
+    zend_update_property_stringl(mongo_ce_Regex, value, "flags", strlen("flags"), flags, flags_len TSRMLS_CC);
+
+    break;
+  }
+  case BSON_CODE:
+  case BSON_CODE__D: {
+    zval *zcope;
+    int code_len;
+    char *code;
+
+    // CODE has a useless total size field
+    if (type == BSON_CODE) {
+      buf += INT_32;
+    }
+
+    // length of code (includes \0)
+    code_len = MONGO_32(*(int*)buf);
+    if (INVALID_STRING_LEN(code_len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 2 TSRMLS_CC, "invalid code length for key \"%s\": %d", name, code_len);
+      return 0;
+    }
+    buf += INT_32;
+
+    code = buf;
+    buf += code_len;
+
+    // initialize scope array
+    MAKE_STD_ZVAL(zcope);
+    array_init(zcope);
+
+    if (type == BSON_CODE) {
+      buf = bson_to_zval(buf, HASH_P(zcope) TSRMLS_CC);
+      if (EG(exception)) {
+        zval_ptr_dtor(&zcope);
+        return 0;
+      }
+    }
+
+    object_init_ex(value, mongo_ce_Code);
+    // exclude \0
+    zend_update_property_stringl(mongo_ce_Code, value, "code", strlen("code"), code, code_len-1 TSRMLS_CC);
+    zend_update_property(mongo_ce_Code, value, "scope", strlen("scope"), zcope TSRMLS_CC);
+    zval_ptr_dtor(&zcope);
+
+    break;
+  }
+  /* DEPRECATED
+   * database reference (12)
+   *   - 4 bytes ns length (includes trailing \0)
+   *   - ns + \0
+   *   - 12 bytes MongoId
+   * This converts the deprecated, old-style db ref type
+   * into the new type (array('$ref' => ..., $id => ...)).
+   */
+  case BSON_DBREF: {
+    int ns_len;
+    char *ns;
+    zval *zoid;
+
+    // ns
+    ns_len = *(int*)buf;
+    if (INVALID_STRING_LEN(ns_len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 3 TSRMLS_CC, "invalid dbref length for key \"%s\": %d", name, ns_len);
+      return 0;
+    }
+    buf += INT_32;
+    ns = buf;
+    buf += ns_len;
+
+    // id
+    MAKE_STD_ZVAL(zoid);
+    php_mongo_id_init(zoid, buf TSRMLS_CC);
+
+    buf += OID_SIZE;
+
+    // put it all together
+    array_init(value);
+    add_assoc_stringl(value, "$ref", ns, ns_len-1, 1);
+    add_assoc_zval(value, "$id", zoid);
+    break;
+  }
+  /* MongoTimestamp (17)
+   * 8 bytes total:
+   *  - sec: 4 bytes
+   *  - inc: 4 bytes
+   */
+  case BSON_TIMESTAMP: {
+    object_init_ex(value, mongo_ce_Timestamp);
+    zend_update_property_long(mongo_ce_Timestamp, value, "inc", strlen("inc"), MONGO_32(*(int*)buf) TSRMLS_CC);
+    buf += INT_32;
+    zend_update_property_long(mongo_ce_Timestamp, value, "sec", strlen("sec"), MONGO_32(*(int*)buf) TSRMLS_CC);
+    buf += INT_32;
+    break;
+  }
+  /* max key (127)
+   * max and min keys are used only for sharding, and
+   * cannot be resaved to the database at the moment
+   */
+  case BSON_MINKEY: {
+    object_init_ex(value, mongo_ce_MinKey);
+    break;
+  }
+  /* min key (0)
+   */
+  case BSON_MAXKEY: {
+    object_init_ex(value, mongo_ce_MaxKey);
+    break;
+  }
+  default: {
+    /* if we run into a type we don't recognize, there's
+     * either been some corruption or we've messed up on
+     * the parsing.  Either way, it's helpful to know the
+     * situation that led us here, so this dumps the
+     * buffer up to this point to stdout and returns.
+     *
+     * We can't dump any more of the buffer, unfortunately,
+     * because we don't keep track of the size.  Besides,
+     * if it is corrupt, the size might be messed up, too.
+     */
+    char *msg, *pos, *template;
+    int i, width, len;
+    unsigned char t = type;
+
+    template = "type 0x00 not supported:";
+
+    // each byte is " xx" (3 chars)
+    width = 3;
+    len = (buf - buf_start) * width;
+
+    msg = (char*)emalloc(strlen(template)+len+1);
+    memcpy(msg, template, strlen(template));
+    pos = msg+7;
+
+    sprintf(pos++, "%x", t/16);
+    t = t%16;
+    sprintf(pos++, "%x", t);
+    // remove '\0' added by sprintf
+    *(pos) = ' ';
+
+    // jump to end of template
+    pos = msg + strlen(template);
+    for (i=0; i<buf-buf_start; i++) {
+      sprintf(pos, " %02x", (unsigned char)buf_start[i]);
+      pos += width;
+    }
+    // sprintf 0-terminates the string
+
+    zend_throw_exception(mongo_ce_Exception, msg, 17 TSRMLS_CC);
+    efree(msg);
+    return 0;
+  }
+  }
+
+  return buf;
+}
+
+char* php_mongo_bson_to_value(char type, char *name, char *buf, char *buf_start, zval *value, int types TSRMLS_DC) {
+  return decode_value(type, name, buf, buf_start, value, 0, types TSRMLS_CC);
 }
 
+/*
+ * If key is an integer the way zend_symtable_update sees it (no leading zeros,
+ * no "-0", fits in a long), stores it in index and returns 1.
+ */
+static int key_to_index(char *key, int len, long *index) {
+  char *digits = key[0] == '-' ? key + 1 : key, *pos;
 
-static int get_limit(mongo_cursor *cursor) {
-  int lim_at;
+  if (len == 0 || len >= MAX_LENGTH_OF_LONG || digits == key + len ||
+      (digits[0] == '0' && (digits != key || len > 1))) {
+    return 0;
+  }
 
-  if (cursor->limit < 0) {
-    return cursor->limit;
+  for (pos = digits; pos < key + len; pos++) {
+    if (*pos < '0' || *pos > '9') {
+      return 0;
+    }
   }
-  else if (cursor->batch_size < 0) {
-    return cursor->batch_size;
+
+  errno = 0;
+  *index = strtol(key, 0, 10);
+  return errno != ERANGE;
+}
+
+/*
+ * Looks up the next field name of the document being decoded in the cache and
+ * copies its entry to key (the cache may be reallocated while the field's value
+ * is decoded).  Returns 0 once there are more fields than the cache holds, or
+ * once a field isn't the same as last time's: the entries from there on are
+ * dropped and the rest of the document is decoded without them, then the next
+ * document fills them in again.
+ */
+static int intern_key(mongo_key_cache *keys, char *name, mongo_key *key) {
+  mongo_key *entry;
+
+  if (keys->at >= MONGO_MAX_CACHED_KEYS) {
+    return 0;
   }
 
-  lim_at = cursor->limit > cursor->batch_size ? cursor->limit - cursor->at : cursor->limit;
-  if (cursor->batch_size && (!lim_at || cursor->batch_size <= lim_at)) {
-    return cursor->batch_size;
+  if (keys->at < keys->count) {
+    entry = &keys->keys[keys->at];
+    if (strcmp(entry->name, name) != 0) {
+      while (keys->count > keys->at) {
+        efree(keys->keys[--keys->count].name);
+      }
+      keys->at = MONGO_MAX_CACHED_KEYS;
+      return 0;
+    }
   }
-  else if (lim_at && (!cursor->batch_size || lim_at < cursor->batch_size)) {
-    return lim_at;
+  else {
+    if (keys->count == keys->size) {
+      keys->size = keys->size ? keys->size * 2 : 16;
+      keys->keys = (mongo_key*)erealloc(keys->keys, keys->size * sizeof(mongo_key));
+    }
+    entry = &keys->keys[keys->count++];
+
+    entry->len = strlen(name) + 1;
+    entry->name = estrndup(name, entry->len - 1);
+    entry->h = zend_inline_hash_func(name, entry->len);
+    entry->is_index = key_to_index(name, entry->len - 1, &entry->index);
   }
 
-  return 0;
+  keys->at++;
+  *key = *entry;
+  return 1;
 }
 
+static void add_field(HashTable *result, char *name, mongo_key *key, zval *value) {
+  if (!key) {
+    zend_symtable_update(result, name, strlen(name)+1, &value, sizeof(zval*), NULL);
+  }
+  else if (key->is_index) {
+    zend_hash_index_update(result, key->index, &value, sizeof(zval*), NULL);
+  }
+  else {
+    zend_hash_quick_update(result, name, key->len, key->h, &value, sizeof(zval*), NULL);
+  }
+}
 
-char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
+/*
+ * Decodes the document at buf into result.  If filter is set, it is a level of
+ * a mongo_decode_filter, and the fields it leaves out are skipped over.  If
+ * keys is set, field names are hashed once for all the documents sharing the
+ * cache, rather than for each document.  types is passed on to decode_value.
+ */
+static char* decode_document(char *buf, HashTable *result, HashTable *filter, int include, mongo_key_cache *keys, int types TSRMLS_DC) {
   /*
    * buf_start is used for debugging
    *
@@ -852,7 +2759,7 @@ char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
    * we lose buf's position as we iterate, so we
    * need buf_start to save it.
    */
-  char *buf_start = buf;
+  char *buf_start = buf, *end = 0;
   char type;
 
   if (buf == 0) {
@@ -860,384 +2767,433 @@ char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
   }
 
   // for size
+  if (filter) {
+    int len;
+
+    memcpy(&len, buf, INT_32);
+    end = buf + MONGO_32(len);
+  }
   buf += INT_32;
 
   while ((type = *buf++) != 0) {
     char *name;
     zval *value;
+    mongo_key field, *key = 0;
 
     name = buf;
     // get past field name
-    buf += strlen(buf) + 1;
+    if (keys && intern_key(keys, name, &field)) {
+      key = &field;
+      buf += key->len;
+    }
+    else {
+      buf += strlen(buf) + 1;
+    }
+
+    if (filter) {
+      HashTable **below = 0;
+      int skip;
+
+      if (key) {
+        zend_hash_quick_find(filter, name, key->len, key->h, (void**)&below);
+      }
+      else {
+        zend_hash_find(filter, name, buf - name, (void**)&below);
+      }
+
+      // only some of the fields of an embedded document
+      if (below && *below && (type == BSON_OBJECT || type == BSON_ARRAY)) {
+        MAKE_STD_ZVAL(value);
+        array_init(value);
+
+        buf = decode_document(buf, Z_ARRVAL_P(value), *below, include, keys, types TSRMLS_CC);
+        if (buf == 0) {
+          zval_ptr_dtor(&value);
+          return 0;
+        }
+
+        add_field(result, name, key, value);
+        continue;
+      }
+
+      if (below && !*below) {
+        skip = !include;
+      }
+      else {
+        skip = include;
+      }
+
+      if (skip) {
+        int size = php_mongo_bson_value_size(type, buf, end);
+
+        if (size < 0) {
+          zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+          return 0;
+        }
+
+        buf += size;
+        continue;
+      }
+    }
 
     MAKE_STD_ZVAL(value);
     ZVAL_NULL(value);
 
     // get value
-    switch(type) {
-    case BSON_OID: {
-      mongo_id *this_id;
-      zval *str = 0;
+    buf = decode_value(type, name, buf, buf_start, value, keys, types TSRMLS_CC);
+    if (buf == 0) {
+      zval_ptr_dtor(&value);
+      return 0;
+    }
 
-      object_init_ex(value, mongo_ce_Id);
+    add_field(result, name, key, value);
+  }
 
-      this_id = (mongo_id*)zend_object_store_get_object(value TSRMLS_CC);
-      this_id->id = estrndup(buf, OID_SIZE);
+  return buf;
+}
 
-      MAKE_STD_ZVAL(str);
-      ZVAL_NULL(str);
+/*
+ * Returns the number of elements of the BSON array at buf, or -1 if its keys
+ * aren't "0", "1", ... in order (or it's broken), in which case it has to be
+ * decoded as a document.  Only the lengths of the values are looked at.
+ */
+static int list_length(char *buf) {
+  char *pos = buf + INT_32, *end, type;
+  int len, count = 0;
+
+  memcpy(&len, buf, INT_32);
+  len = MONGO_32(len);
+  if (len < INT_32 + BYTE_8) {
+    return -1;
+  }
+  end = buf + len;
 
-      MONGO_METHOD(MongoId, __toString, str, value);
-      zend_update_property(mongo_ce_Id, value, "$id", strlen("$id"), str TSRMLS_CC);
-      zval_ptr_dtor(&str);
+  while (pos < end) {
+    char *name, *name_end;
+    long index;
+    int size;
 
-      buf += OID_SIZE;
-      break;
+    if ((type = *pos++) == 0) {
+      return count;
     }
-    case BSON_DOUBLE: {
-      double d = *(double*)buf;
-      int64_t i, *i_p;
-      i_p = &i;
 
-      memcpy(i_p, &d, DOUBLE_64);
-      i = MONGO_64(i);
-      memcpy(&d, i_p, DOUBLE_64);
-
-      ZVAL_DOUBLE(value, d);
-      buf += DOUBLE_64;
-      break;
+    name = pos;
+    name_end = (char*)memchr(name, 0, end - name);
+    if (!name_end) {
+      return -1;
     }
-    case BSON_SYMBOL:
-    case BSON_STRING: {
-      // len includes \0
-      int len = MONGO_32(*((int*)buf));
-      if (INVALID_STRING_LEN(len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 0 TSRMLS_CC, "invalid string length for key \"%s\": %d", name, len);
-        return 0;
-      }
-      buf += INT_32;
 
-      ZVAL_STRINGL(value, buf, len-1, 1);
-      buf += len;
-      break;
+    if (count < INDEX_KEYS ? strcmp(name, index_keys[count]) != 0 :
+        !key_to_index(name, name_end - name, &index) || index != count) {
+      return -1;
     }
-    case BSON_OBJECT:
-    case BSON_ARRAY: {
-      array_init(value);
-      buf = bson_to_zval(buf, Z_ARRVAL_P(value) TSRMLS_CC);
-      if (EG(exception)) {
-        zval_ptr_dtor(&value);
-        return 0;
-      }
-      break;
+
+    if ((size = php_mongo_bson_value_size(type, name_end + 1, end)) < 0) {
+      return -1;
     }
-    case BSON_BINARY: {
-      unsigned char type;
 
-      int len = MONGO_32(*(int*)buf);
-      if (INVALID_STRING_LEN(len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "invalid binary length for key \"%s\": %d", name, len);
-        return 0;
-      }
-      buf += INT_32;
+    pos = name_end + 1 + size;
+    count++;
+  }
+
+  return -1;
+}
 
-      type = *buf++;
+/*
+ * Decodes a BSON array that list_length has checked into result, appending
+ * the elements instead of looking up the keys.
+ */
+static char* decode_list(char *buf, HashTable *result, mongo_key_cache *keys, int types TSRMLS_DC) {
+  char *buf_start = buf, type;
 
-      /* If the type is 2, check if the binary data
-       * is prefixed by its length.
-       *
-       * There is an infinitesimally small chance that
-       * the first four bytes will happen to be the
-       * length of the rest of the string.  In this
-       * case, the data will be corrupted.
-       */
-      if ((int)type == 2) {
-        int len2 = MONGO_32(*(int*)buf);
-
-        /* if the lengths match, the data is to spec,
-         * so we use len2 as the true length.
-         */
-        if (len2 == len - 4) {
-          len = len2;
-          buf += INT_32;
-        }
-      }
+  buf += INT_32;
 
-      object_init_ex(value, mongo_ce_BinData);
+  while ((type = *buf++) != 0) {
+    char *name = buf;
+    zval *value;
 
-      zend_update_property_stringl(mongo_ce_BinData, value, "bin", strlen("bin"), buf, len TSRMLS_CC);
-      zend_update_property_long(mongo_ce_BinData, value, "type", strlen("type"), type TSRMLS_CC);
+    buf += strlen(buf) + 1;
 
-      buf += len;
-      break;
-    }
-    case BSON_BOOL: {
-      char d = *buf++;
-      ZVAL_BOOL(value, d);
-      break;
-    }
-    case BSON_UNDEF:
-    case BSON_NULL: {
-      ZVAL_NULL(value);
-      break;
-    }
-    case BSON_INT: {
-      ZVAL_LONG(value, MONGO_32(*((int*)buf)));
-      buf += INT_32;
-      break;
+    MAKE_STD_ZVAL(value);
+    ZVAL_NULL(value);
+
+    buf = decode_value(type, name, buf, buf_start, value, keys, types TSRMLS_CC);
+    if (buf == 0) {
+      zval_ptr_dtor(&value);
+      return 0;
     }
-    case BSON_LONG: {
-      if (MonGlo(long_as_object)) {
-        char *buffer;
 
-#ifdef WIN32
-        spprintf(&buffer, 0, "%I64d", (int64_t)MONGO_64(*((int64_t*)buf)));
-#else
-        spprintf(&buffer, 0, "%lld", (long long int)MONGO_64(*((int64_t*)buf)));
-#endif
-        object_init_ex(value, mongo_ce_Int64);
+    zend_hash_next_index_insert(result, &value, sizeof(zval*), NULL);
+  }
 
-        zend_update_property_string(mongo_ce_Int64, value, "value", strlen("value"), buffer TSRMLS_CC);
+  return buf;
+}
 
-        efree(buffer);
-      } else {
-        if (MonGlo(native_long)) {
-#if SIZEOF_LONG == 4
-          zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "Can not natively represent the long %llu on this platform", (int64_t)MONGO_64(*((int64_t*)buf)));
-          return 0;
-#else
-# if SIZEOF_LONG == 8
-          ZVAL_LONG(value, (long)MONGO_64(*((int64_t*)buf)));
-# else
-#  error The PHP number size is neither 4 or 8 bytes; no clue what to do with that!
-# endif
-#endif
-        } else {
-          ZVAL_DOUBLE(value, (double)MONGO_64(*((int64_t*)buf)));
-        }
-      }
-      buf += INT_64;
-      break;
-    }
-    case BSON_DATE: {
-      int64_t d = MONGO_64(*((int64_t*)buf));
-      buf += INT_64;
+char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
+  return decode_document(buf, result, 0, 0, 0, 0 TSRMLS_CC);
+}
 
-      object_init_ex(value, mongo_ce_Date);
+char* php_mongo_bson_to_zval_ex(char *buf, HashTable *result, mongo_decode_filter *filter, mongo_key_cache *keys, int types TSRMLS_DC) {
+  if (keys) {
+    // a new document, its fields are compared with the last one's
+    keys->at = 0;
+  }
 
-      zend_update_property_long(mongo_ce_Date, value, "sec", strlen("sec"), (long)(d/1000) TSRMLS_CC);
-      zend_update_property_long(mongo_ce_Date, value, "usec", strlen("usec"), (long)((d*1000)%1000000) TSRMLS_CC);
+  if (!filter) {
+    return decode_document(buf, result, 0, 0, keys, types TSRMLS_CC);
+  }
+  return decode_document(buf, result, filter->fields, filter->include, keys, types TSRMLS_CC);
+}
 
-      break;
-    }
-    case BSON_REGEX: {
-      char *regex, *flags;
-      int regex_len, flags_len;
+mongo_key_cache* php_mongo_key_cache_new() {
+  mongo_key_cache *keys = (mongo_key_cache*)emalloc(sizeof(mongo_key_cache));
+  memset(keys, 0, sizeof(mongo_key_cache));
+  return keys;
+}
 
-      regex = buf;
-      regex_len = strlen(buf);
-      buf += regex_len+1;
+void php_mongo_key_cache_free(mongo_key_cache *keys) {
+  int i;
 
-      flags = buf;
-      flags_len = strlen(buf);
-      buf += flags_len+1;
+  for (i = 0; i < keys->count; i++) {
+    efree(keys->keys[i].name);
+  }
+  if (keys->keys) {
+    efree(keys->keys);
+  }
+  efree(keys);
+}
 
-      object_init_ex(value, mongo_ce_Regex);
+static void filter_level_dtor(void *data) {
+  HashTable *level = *(HashTable**)data;
 
-      zend_update_property_stringl(mongo_ce_Regex, value, "regex", strlen("regex"), regex, regex_len TSRMLS_CC);
-      zend_update_property_stringl(mongo_ce_Regex, value, "flags", strlen("flags"), flags, flags_len TSRMLS_CC);
+  if (level) {
+    zend_hash_destroy(level);
+    FREE_HASHTABLE(level);
+  }
+}
 
-      break;
-    }
-    case BSON_CODE:
-    case BSON_CODE__D: {
-      zval *zcope;
-      int code_len;
-      char *code;
+static HashTable* filter_level_new() {
+  HashTable *level;
 
-      // CODE has a useless total size field
-      if (type == BSON_CODE) {
-        buf += INT_32;
-      }
+  ALLOC_HASHTABLE(level);
+  zend_hash_init(level, 8, NULL, filter_level_dtor, 0);
+  return level;
+}
 
-      // length of code (includes \0)
-      code_len = MONGO_32(*(int*)buf);
-      if (INVALID_STRING_LEN(code_len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 2 TSRMLS_CC, "invalid code length for key \"%s\": %d", name, code_len);
-        return 0;
-      }
-      buf += INT_32;
+static void filter_add(HashTable *level, char *path, int path_len) {
+  char *dot = memchr(path, '.', path_len), *name;
+  int name_len = dot ? dot - path : path_len;
+  HashTable **below, *next = 0;
 
-      code = buf;
-      buf += code_len;
+  name = estrndup(path, name_len);
 
-      // initialize scope array
-      MAKE_STD_ZVAL(zcope);
-      array_init(zcope);
+  if (!dot) {
+    // the whole field, whatever was asked for below it before
+    zend_hash_update(level, name, name_len+1, &next, sizeof(HashTable*), NULL);
+  }
+  else if (zend_hash_find(level, name, name_len+1, (void**)&below) == FAILURE) {
+    next = filter_level_new();
+    zend_hash_add(level, name, name_len+1, &next, sizeof(HashTable*), NULL);
+    filter_add(next, dot+1, path_len-name_len-1);
+  }
+  // otherwise, if it is already there as a whole field, that covers this one
+  else if (*below) {
+    filter_add(*below, dot+1, path_len-name_len-1);
+  }
 
-      if (type == BSON_CODE) {
-        buf = bson_to_zval(buf, HASH_P(zcope) TSRMLS_CC);
-        if (EG(exception)) {
-          zval_ptr_dtor(&zcope);
-          return 0;
-        }
-      }
+  efree(name);
+}
 
-      object_init_ex(value, mongo_ce_Code);
-      // exclude \0
-      zend_update_property_stringl(mongo_ce_Code, value, "code", strlen("code"), code, code_len-1 TSRMLS_CC);
-      zend_update_property(mongo_ce_Code, value, "scope", strlen("scope"), zcope TSRMLS_CC);
-      zval_ptr_dtor(&zcope);
+mongo_decode_filter* php_mongo_decode_filter_new(HashTable *fields TSRMLS_DC) {
+  mongo_decode_filter *filter;
+  HashPosition pos;
+  zval **data;
+
+  filter = (mongo_decode_filter*)emalloc(sizeof(mongo_decode_filter));
+  filter->include = -1;
+  filter->fields = filter_level_new();
+
+  for (zend_hash_internal_pointer_reset_ex(fields, &pos);
+       zend_hash_get_current_data_ex(fields, (void**)&data, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(fields, &pos)) {
+    char *key;
+    uint key_len;
+    ulong index;
+    int include;
+
+    // array("a", "b.c") is short for array("a" => true, "b.c" => true)
+    if (zend_hash_get_current_key_ex(fields, &key, &key_len, &index, NO_DUP, &pos) == HASH_KEY_IS_STRING) {
+      include = zend_is_true(*data);
+    }
+    else if (Z_TYPE_PP(data) == IS_STRING) {
+      key = Z_STRVAL_PP(data);
+      key_len = Z_STRLEN_PP(data)+1;
+      include = 1;
+    }
+    else {
+      continue;
+    }
 
-      break;
+    if (filter->include != -1 && filter->include != include) {
+      zend_throw_exception(mongo_ce_Exception, "fields can either all be included or all be excluded", 23 TSRMLS_CC);
+      php_mongo_decode_filter_free(filter);
+      return 0;
     }
-    /* DEPRECATED
-     * database reference (12)
-     *   - 4 bytes ns length (includes trailing \0)
-     *   - ns + \0
-     *   - 12 bytes MongoId
-     * This converts the deprecated, old-style db ref type
-     * into the new type (array('$ref' => ..., $id => ...)).
-     */
-    case BSON_DBREF: {
-      int ns_len;
-      char *ns;
-      zval *zoid;
-      mongo_id *this_id;
-
-      // ns
-      ns_len = *(int*)buf;
-      if (INVALID_STRING_LEN(ns_len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 3 TSRMLS_CC, "invalid dbref length for key \"%s\": %d", name, ns_len);
-        return 0;
-      }
-      buf += INT_32;
-      ns = buf;
-      buf += ns_len;
 
-      // id
-      MAKE_STD_ZVAL(zoid);
-      object_init_ex(zoid, mongo_ce_Id);
+    filter->include = include;
+    filter_add(filter->fields, key, key_len-1);
+  }
 
-      this_id = (mongo_id*)zend_object_store_get_object(zoid TSRMLS_CC);
-      this_id->id = estrndup(buf, OID_SIZE);
+  return filter;
+}
 
-      buf += OID_SIZE;
+void php_mongo_decode_filter_free(mongo_decode_filter *filter) {
+  zend_hash_destroy(filter->fields);
+  FREE_HASHTABLE(filter->fields);
+  efree(filter);
+}
 
-      // put it all together
-      array_init(value);
-      add_assoc_stringl(value, "$ref", ns, ns_len-1, 1);
-      add_assoc_zval(value, "$id", zoid);
-      break;
+static int str_is(char *s, int len, char *lit) {
+  return len == (int)strlen(lit) && strncmp(s, lit, len) == 0;
+}
+
+int php_mongo_type_map_set(int *types, char *type, int type_len, char *as, int as_len) {
+  if (str_is(type, type_len, "date")) {
+    if (str_is(as, as_len, "int")) {
+      *types |= MONGO_TYPE_DATE_AS_INT;
+      return SUCCESS;
     }
-    /* MongoTimestamp (17)
-     * 8 bytes total:
-     *  - sec: 4 bytes
-     *  - inc: 4 bytes
-     */
-    case BSON_TIMESTAMP: {
-      object_init_ex(value, mongo_ce_Timestamp);
-      zend_update_property_long(mongo_ce_Timestamp, value, "inc", strlen("inc"), MONGO_32(*(int*)buf) TSRMLS_CC);
-      buf += INT_32;
-      zend_update_property_long(mongo_ce_Timestamp, value, "sec", strlen("sec"), MONGO_32(*(int*)buf) TSRMLS_CC);
-      buf += INT_32;
-      break;
+    if (str_is(as, as_len, "default")) {
+      *types &= ~MONGO_TYPE_DATE_AS_INT;
+      return SUCCESS;
     }
-    /* max key (127)
-     * max and min keys are used only for sharding, and
-     * cannot be resaved to the database at the moment
-     */
-    case BSON_MINKEY: {
-      object_init_ex(value, mongo_ce_MinKey);
-      break;
+  }
+  else if (str_is(type, type_len, "long")) {
+    int as_type = 0;
+
+    if (str_is(as, as_len, "int")) {
+      as_type = MONGO_TYPE_LONG_AS_INT;
     }
-    /* min key (0)
-     */
-    case BSON_MAXKEY: {
-      object_init_ex(value, mongo_ce_MaxKey);
-      break;
+    else if (str_is(as, as_len, "string")) {
+      as_type = MONGO_TYPE_LONG_AS_STRING;
+    }
+    else if (!str_is(as, as_len, "default")) {
+      return FAILURE;
     }
-    default: {
-      /* if we run into a type we don't recognize, there's
-       * either been some corruption or we've messed up on
-       * the parsing.  Either way, it's helpful to know the
-       * situation that led us here, so this dumps the
-       * buffer up to this point to stdout and returns.
-       *
-       * We can't dump any more of the buffer, unfortunately,
-       * because we don't keep track of the size.  Besides,
-       * if it is corrupt, the size might be messed up, too.
-       */
-      char *msg, *pos, *template;
-      int i, width, len;
-      unsigned char t = type;
-
-      template = "type 0x00 not supported:";
-
-      // each byte is " xx" (3 chars)
-      width = 3;
-      len = (buf - buf_start) * width;
-
-      msg = (char*)emalloc(strlen(template)+len+1);
-      memcpy(msg, template, strlen(template));
-      pos = msg+7;
-
-      sprintf(pos++, "%x", t/16);
-      t = t%16;
-      sprintf(pos++, "%x", t);
-      // remove '\0' added by sprintf
-      *(pos) = ' ';
-
-      // jump to end of template
-      pos = msg + strlen(template);
-      for (i=0; i<buf-buf_start; i++) {
-        sprintf(pos, " %02x", (unsigned char)buf_start[i]);
-        pos += width;
-      }
-      // sprintf 0-terminates the string
 
-      zend_throw_exception(mongo_ce_Exception, msg, 17 TSRMLS_CC);
-      efree(msg);
-      return 0;
+    *types = (*types & ~(MONGO_TYPE_LONG_AS_INT|MONGO_TYPE_LONG_AS_STRING)) | as_type;
+    return SUCCESS;
+  }
+  else if (str_is(type, type_len, "binary")) {
+    if (str_is(as, as_len, "string")) {
+      *types |= MONGO_TYPE_BIN_AS_STRING;
+      return SUCCESS;
     }
+    if (str_is(as, as_len, "default")) {
+      *types &= ~MONGO_TYPE_BIN_AS_STRING;
+      return SUCCESS;
     }
+  }
 
-    zend_symtable_update(result, name, strlen(name)+1, &value, sizeof(zval*), NULL);
+  return FAILURE;
+}
+
+int php_mongo_type_map_parse(char *str, int *types) {
+  while (*str) {
+    char *type, *as;
+
+    if (*str == ',' || *str == ' ') {
+      str++;
+      continue;
+    }
+
+    type = str;
+    while (*str && *str != ':' && *str != ',' && *str != ' ') {
+      str++;
+    }
+    if (*str != ':') {
+      return FAILURE;
+    }
+
+    as = ++str;
+    while (*str && *str != ',' && *str != ' ') {
+      str++;
+    }
+
+    if (php_mongo_type_map_set(types, type, as - type - 1, as, str - as) == FAILURE) {
+      return FAILURE;
+    }
   }
 
-  return buf;
+  return SUCCESS;
 }
 
-static int is_utf8(const char *s, int len) {
-  int i;
+/*
+ * Checks that s is made of well-formed UTF-8 sequences (1 to 4 bytes, lead
+ * byte followed by the right number of continuation bytes).
+ *
+ * Most strings are plain ASCII, so runs of bytes without the high bit set are
+ * skipped a block at a time: 16 bytes with SSE2 (always there on x86_64) or a
+ * machine word elsewhere.  Only the multi-byte sequences are looked at one byte
+ * at a time.
+ */
+int php_mongo_is_utf8(const char *s, int len) {
+  const unsigned char *pos = (const unsigned char*)s, *end = pos + len;
+
+  while (pos < end) {
+    int extra, i;
+
+#ifdef MONGO_UTF8_SSE2
+    while (end - pos >= 16 &&
+           _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)pos)) == 0) {
+      pos += 16;
+    }
+#else
+    while (end - pos >= (int)sizeof(unsigned long)) {
+      unsigned long word;
+
+      memcpy(&word, pos, sizeof(unsigned long));
+      if (word & MONGO_HIGH_BITS) {
+        break;
+      }
+      pos += sizeof(unsigned long);
+    }
+#endif
+
+    if (pos == end) {
+      break;
+    }
+
+    if (*pos < 0x80) {
+      pos++;
+      continue;
+    }
+    else if ((*pos & 0xE0) == 0xC0) {
+      extra = 1;
+    }
+    else if ((*pos & 0xF0) == 0xE0) {
+      extra = 2;
+    }
+    else if ((*pos & 0xF8) == 0xF0) {
+      extra = 3;
+    }
+    else {
+      return 0;
+    }
 
-  for (i=0; i<len; i++) {
-    if (i+3 < len &&
-        (s[i] & 248) == 240 &&
-        (s[i+1] & 192) == 128 &&
-        (s[i+2] & 192) == 128 &&
-        (s[i+3] & 192) == 128) {
-      i += 3;
-    }
-    else if (i+2 < len &&
-             (s[i] & 240) == 224 &&
-             (s[i+1] & 192) == 128 &&
-             (s[i+2] & 192) == 128) {
-      i += 2;
-    }
-    else if (i+1 < len &&
-             (s[i] & 224) == 192 &&
-             (s[i+1] & 192) == 128) {
-      i += 1;
-    }
-    else if ((s[i] & 128) != 0) {
+    if (end - pos <= extra) {
       return 0;
     }
+
+    for (i = 1; i <= extra; i++) {
+      if ((pos[i] & 0xC0) != 0x80) {
+        return 0;
+      }
+    }
+
+    pos += extra + 1;
   }
+
   return 1;
 }
 
@@ -1332,10 +3288,22 @@ PHP_FUNCTION(bson_encode) {
       RETURN_STRINGL(buf.start, 8, 0);
       break;
     }
+    else if (clazz == mongo_ce_RawBSON) {
+      zval *bson = raw_bson(z TSRMLS_CC);
+
+      if (!bson) {
+        return;
+      }
+      RETURN_STRINGL(Z_STRVAL_P(bson), Z_STRLEN_P(bson), 1);
+      break;
+    }
   }
   /* fallthrough for a normal obj */
   case IS_ARRAY: {
-    CREATE_BUF(buf, INITIAL_BUF_SIZE);
+    // one spare byte, see reserve_buf
+    int size = php_mongo_bson_size(HASH_P(z), NO_PREP TSRMLS_CC) + 1;
+
+    CREATE_BUF(buf, size);
     zval_to_bson(&buf, HASH_P(z), 0 TSRMLS_CC);
 
     RETVAL_STRINGL(buf.start, buf.pos-buf.start, 1);
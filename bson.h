@@ -45,12 +45,14 @@
 
 #define CREATE_BUF_STATIC(n) char b[n];         \
   buf.start = buf.pos = b;                      \
-  buf.end = b+n;
+  buf.end = b+n;                                \
+  buf.ref_min = buf.ref_count = 0;              \
+  buf.refs = 0;
 
 int php_mongo_serialize_size(char *start, buffer *buf TSRMLS_DC);
 
 /* driver */
-int php_mongo_serialize_element(char*, zval**, buffer*, int TSRMLS_DC);
+int php_mongo_serialize_element(char*, int, zval**, buffer*, int TSRMLS_DC);
 
 /* objects */
 void php_mongo_serialize_date(buffer*, zval* TSRMLS_DC);
@@ -69,9 +71,15 @@ void php_mongo_serialize_int(buffer*, int);
 void php_mongo_serialize_byte(buffer*, char);
 void php_mongo_serialize_bytes(buffer*, char*, int);
 void php_mongo_serialize_key(buffer*, char*, int, int TSRMLS_DC);
+
+/**
+ * Points g->encoder at the variants for g's settings.
+ */
+void php_mongo_bind_encoder(zend_mongo_globals *g);
 void php_mongo_serialize_ns(buffer*, char* TSRMLS_DC);
 
 int php_mongo_write_insert(buffer*, char*, zval*, int max TSRMLS_DC);
+int php_mongo_write_insert_json(buffer*, char*, char*, int, int max TSRMLS_DC);
 int php_mongo_write_batch_insert(buffer*, char*, int flags, zval*, int max TSRMLS_DC);
 int php_mongo_write_query(buffer*, mongo_cursor* TSRMLS_DC);
 int php_mongo_write_get_more(buffer*, mongo_cursor* TSRMLS_DC);
@@ -84,10 +92,203 @@ int php_mongo_write_kill_cursors(buffer*, int64_t TSRMLS_DC);
 #define php_mongo_serialize_bool(buf, b) php_mongo_serialize_byte(buf, (char)b)
 
 int resize_buf(buffer*, int);
+/**
+ * Makes sure there is room for size more bytes without further reallocs.
+ */
+int reserve_buf(buffer*, int);
+
+/**
+ * Per-class list of properties, see get_shape in bson.c.
+ */
+typedef struct {
+  // index in the object's properties_table
+  int offset;
+  char *name;
+  int name_len;
+  // name with the command character replaced, in mongo_shape.keys
+  char *key;
+} mongo_shape_prop;
+
+typedef struct {
+  // -1 if the class can't be shaped
+  int count;
+  mongo_shape_prop *props;
+  char *keys;
+  // the mongo.cmd keys were built with
+  char cmd_char;
+} mongo_shape;
+
+/**
+ * Frees the shapes built during the request, from RSHUTDOWN.
+ */
+void php_mongo_shapes_shutdown(TSRMLS_D);
+
+/**
+ * Gets an empty buffer with room for at least size bytes to build a message
+ * in.  Every buffer must be given back with php_mongo_buf_release, not
+ * efree'd.
+ */
+void php_mongo_buf_get(buffer*, int TSRMLS_DC);
+void php_mongo_buf_release(buffer* TSRMLS_DC);
+
+/**
+ * Number of bytes from from to the end of the buffer, counting the strings
+ * that are only referenced.
+ */
+int php_mongo_buf_len(buffer*, char *from);
+
+/**
+ * Frees the request's send buffer, from RSHUTDOWN.
+ */
+void php_mongo_buf_shutdown(TSRMLS_D);
+
+/**
+ * Returns the exact size of the BSON document zval_to_bson would create from
+ * the given hash, so the buffer can be allocated once.
+ */
+int php_mongo_bson_size(HashTable*, int TSRMLS_DC);
 
 int zval_to_bson(buffer*, HashTable*, int TSRMLS_DC);
+
+/**
+ * Checks that the len bytes at data are exactly one well-formed BSON document.
+ * Returns the number of top-level fields, or FAILURE.  Strings are not checked
+ * to be UTF-8.
+ */
+int php_mongo_validate_bson(char *data, int len);
+
+/**
+ * Size of the value of the given type at data, or -1 if it runs past end.
+ * Embedded documents are not looked into.
+ */
+int php_mongo_bson_value_size(char type, char *data, char *end);
+
+typedef struct {
+  // offsets in mongo_template.skeleton
+  int start;
+  int end;
+} mongo_template_part;
+
+typedef struct _mongo_template {
+  // the shape as BSON, with "?" strings where parameters go
+  char *skeleton;
+  int len;
+  // the "?" elements, from type byte to end of value, in order
+  mongo_template_part *slots;
+  int slot_count;
+  // the documents containing slots, whose lengths change with the parameters
+  mongo_template_part *docs;
+  int doc_count;
+  // whether it lives in the persistent list or belongs to one object
+  int persistent;
+} mongo_template;
+
+/**
+ * Compiles a query shape into a template, or finds the one compiled for the
+ * same shape by an earlier request.  Returns 0 if the shape can't be
+ * serialized.
+ */
+mongo_template *php_mongo_template_get(HashTable* TSRMLS_DC);
+void php_mongo_template_free(mongo_template*);
+void php_mongo_template_pfree(zend_rsrc_list_entry* TSRMLS_DC);
+
+/**
+ * Writes the template's document to buf with its slots replaced by params,
+ * in order.
+ */
+int php_mongo_template_bind(buffer*, mongo_template*, HashTable* TSRMLS_DC);
+
+/**
+ * Fills in the table of array keys ("0".."9999") zval_to_bson uses for lists.
+ * Called once, from MINIT.
+ */
+void php_mongo_init_index_keys();
+
+/**
+ * Returns 1 if the len bytes at s are valid UTF-8, 0 otherwise.
+ */
+int php_mongo_is_utf8(const char *s, int len);
 char* bson_to_zval(char*, HashTable* TSRMLS_DC);
 
+/*
+ * How cursors decode dates, 64-bit ints and binary data, set with
+ * MongoCursor::typeMap() or mongo.type_map.  With none of these set they're
+ * MongoDates, floats (or ints or MongoInt64s, see mongo.native_long and
+ * mongo.long_as_object) and MongoBinDatas.
+ */
+// milliseconds since the epoch
+#define MONGO_TYPE_DATE_AS_INT 1
+#define MONGO_TYPE_LONG_AS_INT 2
+#define MONGO_TYPE_LONG_AS_STRING 4
+// just the bytes, without the subtype
+#define MONGO_TYPE_BIN_AS_STRING 8
+
+/**
+ * Sets how values of type ("date", "long" or "binary") are decoded in types:
+ * as ("int", "string" or "default").  Returns FAILURE for combinations that
+ * aren't supported: dates can't be strings and binary data can't be ints.
+ */
+int php_mongo_type_map_set(int *types, char *type, int type_len, char *as, int as_len);
+
+/**
+ * Parses mongo.type_map, "type:as" pairs separated by commas, into types.
+ */
+int php_mongo_type_map_parse(char *str, int *types);
+
+/**
+ * Decodes a single value, for when only some fields of a document are wanted.
+ * Returns the position after it, or 0 if an exception was thrown.
+ */
+char* php_mongo_bson_to_value(char type, char *name, char *buf, char *buf_start, zval *value, int types TSRMLS_DC);
+
+typedef struct _mongo_decode_filter {
+  // 1 to decode only the fields listed, 0 to decode all but them
+  int include;
+  // name => HashTable* of the fields below it, or 0 for the whole field
+  HashTable *fields;
+} mongo_decode_filter;
+
+/**
+ * Compiles the fields given to MongoCursor::decodeFields: names, with dots
+ * for the fields of embedded documents, => true to decode only those or
+ * => false to decode all but those.  Returns 0 (and throws) if both are used.
+ */
+mongo_decode_filter* php_mongo_decode_filter_new(HashTable *fields TSRMLS_DC);
+void php_mongo_decode_filter_free(mongo_decode_filter *filter);
+
+typedef struct {
+  char *name;
+  // with the \0
+  int len;
+  ulong h;
+  // set if zend_symtable_update would use the name as an integer key
+  int is_index;
+  long index;
+} mongo_key;
+
+/*
+ * The field names of the documents of a cursor, in the order they were met.
+ * Documents of the same shape have the same names in the same order, so these
+ * are only hashed for the first one.
+ */
+typedef struct _mongo_key_cache {
+  mongo_key *keys;
+  int count;
+  int size;
+  // the next field of the document being decoded
+  int at;
+} mongo_key_cache;
+
+mongo_key_cache* php_mongo_key_cache_new();
+void php_mongo_key_cache_free(mongo_key_cache *keys);
+
+/**
+ * bson_to_zval, stepping over the fields the filter leaves out and taking the
+ * hashes of field names from keys.  Either can be 0.  types is a set of
+ * MONGO_TYPE_* flags.
+ */
+char* php_mongo_bson_to_zval_ex(char *buf, HashTable *result, mongo_decode_filter *filter, mongo_key_cache *keys, int types TSRMLS_DC);
+
 /**
  * Initialize buffer to contain "\0", so mongo_buf_append will start appending
  * at the beginning.
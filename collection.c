@@ -64,6 +64,11 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_batchInsert, 0, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_INFO(0, array_of_options)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_insertJSON, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, json)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_distinct, 0, 0, 1)
 	ZEND_ARG_INFO(0, key)
 	ZEND_ARG_INFO(0, query)
@@ -403,22 +408,75 @@ PHP_METHOD(MongoCollection, insert) {
     RETURN_FALSE;
   }
 
-  CREATE_BUF(buf, INITIAL_BUF_SIZE);
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
   if (FAILURE == php_mongo_write_insert(&buf, Z_STRVAL_P(c->ns), a,
                                         mongo_util_server_get_bson_size(server TSRMLS_CC) TSRMLS_CC)) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     zval_ptr_dtor(&options);
     RETURN_FALSE;
   }
 
   SEND_MSG;
 
-  efree(buf.start);
+  php_mongo_buf_release(&buf TSRMLS_CC);
   if (free_options) {
       zval_ptr_dtor(&options);
   }
 }
 
+/* {{{ MongoCollection::insertJSON(string json [, array options])
+ *
+ * Inserts a document given as JSON, parsed straight into BSON without
+ * building PHP values first.  See json_to_bson() for the extended JSON it
+ * reads.  An _id is generated if the document doesn't have one, but as there
+ * is no array to add it to, it isn't returned.
+ */
+PHP_METHOD(MongoCollection, insertJSON) {
+  zval *options = 0, *errmsg = 0;
+  char *json;
+  int json_len, free_options = 0;
+  mongo_collection *c;
+  mongo_server *server;
+  buffer buf;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|a", &json, &json_len, &options) == FAILURE) {
+    return;
+  }
+
+  if (!options) {
+    MAKE_STD_ZVAL(options);
+    array_init(options);
+    free_options = 1;
+  }
+
+  PHP_MONGO_GET_COLLECTION(getThis());
+
+  if ((server = get_server(c TSRMLS_CC)) == 0) {
+    if (free_options) {
+      zval_ptr_dtor(&options);
+    }
+    RETURN_FALSE;
+  }
+
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
+  if (FAILURE == php_mongo_write_insert_json(&buf, Z_STRVAL_P(c->ns), json, json_len,
+                                             mongo_util_server_get_bson_size(server TSRMLS_CC) TSRMLS_CC)) {
+    php_mongo_buf_release(&buf TSRMLS_CC);
+    if (free_options) {
+      zval_ptr_dtor(&options);
+    }
+    RETURN_FALSE;
+  }
+
+  SEND_MSG;
+
+  php_mongo_buf_release(&buf TSRMLS_CC);
+  if (free_options) {
+    zval_ptr_dtor(&options);
+  }
+}
+/* }}} */
+
 PHP_METHOD(MongoCollection, batchInsert) {
   zval *docs, *options = NULL, *errmsg = 0;
   mongo_collection *c;
@@ -447,17 +505,17 @@ PHP_METHOD(MongoCollection, batchInsert) {
     RETURN_FALSE;
   }
 
-  CREATE_BUF(buf, INITIAL_BUF_SIZE);
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
 
   if (php_mongo_write_batch_insert(&buf, Z_STRVAL_P(c->ns), bit_opts, docs,
                                    mongo_util_server_get_bson_size(server TSRMLS_CC) TSRMLS_CC) == FAILURE) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     return;
   }
 
   SEND_MSG;
 
-  efree(buf.start);
+  php_mongo_buf_release(&buf TSRMLS_CC);
 }
 
 PHP_METHOD(MongoCollection, find) {
@@ -564,16 +622,16 @@ PHP_METHOD(MongoCollection, update) {
     RETURN_FALSE;
   }
 
-  CREATE_BUF(buf, INITIAL_BUF_SIZE);
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
   if (FAILURE == php_mongo_write_update(&buf, Z_STRVAL_P(c->ns), bit_opts, criteria, newobj TSRMLS_CC)) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     zval_ptr_dtor(&options);
     return;
   }
 
   SEND_MSG;
 
-  efree(buf.start);
+  php_mongo_buf_release(&buf TSRMLS_CC);
   zval_ptr_dtor(&options);
 }
 
@@ -629,9 +687,9 @@ PHP_METHOD(MongoCollection, remove) {
     RETURN_FALSE;
   }
 
-  CREATE_BUF(buf, INITIAL_BUF_SIZE);
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
   if (FAILURE == php_mongo_write_delete(&buf, Z_STRVAL_P(c->ns), flags, criteria TSRMLS_CC)) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     zval_ptr_dtor(&options);
     zval_ptr_dtor(&criteria);
     return;
@@ -639,7 +697,7 @@ PHP_METHOD(MongoCollection, remove) {
 
   SEND_MSG;
 
-  efree(buf.start);
+  php_mongo_buf_release(&buf TSRMLS_CC);
   zval_ptr_dtor(&options);
   zval_ptr_dtor(&criteria);
 }
@@ -1268,6 +1326,7 @@ static zend_function_entry MongoCollection_methods[] = {
   PHP_ME(MongoCollection, validate, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, insert, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, batchInsert, arginfo_batchInsert, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, insertJSON, arginfo_insertJSON, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, update, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, remove, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, find, NULL, ZEND_ACC_PUBLIC)
@@ -32,6 +32,7 @@ PHP_METHOD(MongoCollection, drop);
 PHP_METHOD(MongoCollection, validate);
 PHP_METHOD(MongoCollection, insert);
 PHP_METHOD(MongoCollection, batchInsert);
+PHP_METHOD(MongoCollection, insertJSON);
 PHP_METHOD(MongoCollection, update);
 PHP_METHOD(MongoCollection, remove);
 PHP_METHOD(MongoCollection, find);
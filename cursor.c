@@ -38,6 +38,7 @@
 #include "util/link.h"
 #include "util/rs.h"
 #include "util/io.h"
+#include "util/json.h"
 
 #if WIN32
 HANDLE cursor_mutex;
@@ -54,6 +55,9 @@ static pthread_mutex_t cursor_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define CURSOR_FLAG_EXHAUST      64 /* Not implemented */
 #define CURSOR_FLAG_PARTIAL     128
 
+// how much JSON writeJSON() buffers before writing it out
+#define MONGO_JSON_CHUNK 8192
+
 // externs
 extern zend_class_entry *mongo_ce_Id,
   *mongo_ce_Mongo,
@@ -173,6 +177,7 @@ PHP_METHOD(MongoCursor, __construct) {
   cursor->num = 0;
   cursor->special = 0;
   cursor->persist = 0;
+  cursor->types = MonGlo(types);
 
   timeout = zend_read_static_property(mongo_ce_Cursor, "timeout", strlen("timeout"), NOISY TSRMLS_CC);
   cursor->timeout = Z_LVAL_P(timeout);
@@ -199,65 +204,135 @@ static void make_special(mongo_cursor *cursor) {
   add_assoc_zval(cursor->query, "$query", temp);
 }
 
-/* {{{ MongoCursor::hasNext
+static int cursor_send_query(mongo_cursor *cursor TSRMLS_DC);
+static int cursor_recv_query(mongo_cursor *cursor TSRMLS_DC);
+
+/*
+ * Sends the query the first time the cursor is used.
  */
-PHP_METHOD(MongoCursor, hasNext) {
+static int cursor_start(zval *this_ptr, mongo_cursor *cursor TSRMLS_DC) {
+  zval temp;
+
+  if (cursor->started_iterating) {
+    // the query went out with send(), so its reply is all that's left
+    if (cursor->awaiting_reply) {
+      cursor->awaiting_reply = 0;
+      return cursor_recv_query(cursor TSRMLS_CC);
+    }
+    return SUCCESS;
+  }
+
+  ZVAL_NULL(&temp);
+  MONGO_METHOD(MongoCursor, doQuery, &temp, this_ptr);
+  zval_dtor(&temp);
+  if (EG(exception)) {
+    return FAILURE;
+  }
+
+  cursor->started_iterating = 1;
+  return SUCCESS;
+}
+
+/*
+ * Asks the database for the next batch.  The reply is read by
+ * php_mongo_get_reply().
+ */
+static int cursor_send_get_more(mongo_cursor *cursor TSRMLS_DC) {
   buffer buf;
   int size;
-  mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
   zval *temp;
 
-  MONGO_CHECK_INITIALIZED(cursor->link, MongoCursor);
+  size = 34+strlen(cursor->ns);
+  php_mongo_buf_get(&buf, size TSRMLS_CC);
+  if (FAILURE == php_mongo_write_get_more(&buf, cursor TSRMLS_CC)) {
+    php_mongo_buf_release(&buf TSRMLS_CC);
+    return FAILURE;
+  }
+
+  MAKE_STD_ZVAL(temp);
+  ZVAL_NULL(temp);
+
+  if(mongo_say(cursor->server, &buf, temp TSRMLS_CC) == FAILURE) {
+    php_mongo_buf_release(&buf TSRMLS_CC);
+
+    mongo_cursor_throw(cursor->server, 1 TSRMLS_CC, Z_STRVAL_P(temp));
+    zval_ptr_dtor(&temp);
+    mongo_util_cursor_failed(cursor TSRMLS_CC);
+    return FAILURE;
+  }
+
+  php_mongo_buf_release(&buf TSRMLS_CC);
+  zval_ptr_dtor(&temp);
+  return SUCCESS;
+}
 
-  if (!cursor->started_iterating) {
-    MONGO_METHOD(MongoCursor, doQuery, return_value, getThis());
-    cursor->started_iterating = 1;
+/*
+ * In prefetch mode, sends the getmore for the next batch once half of this
+ * one has been read, so the reply is on its way while the rest is used.  It
+ * waits in the socket (or parked, see php_mongo_get_reply()) until then.
+ * Returns FAILURE, with an exception thrown and the cursor reset, if the
+ * getmore couldn't be sent.
+ */
+static int cursor_prefetch(mongo_cursor *cursor TSRMLS_DC) {
+  if (!cursor->prefetch || cursor->getmore_sent || cursor->cursor_id == 0 || !cursor->server ||
+      (cursor->limit > 0 && cursor->num >= cursor->limit) ||
+      cursor->buf.pos - cursor->buf.start < (cursor->buf.end - cursor->buf.start) / 2) {
+    return SUCCESS;
   }
 
-	if ((cursor->limit > 0 && cursor->at >= cursor->limit) || cursor->num == 0) {
-		if (cursor->cursor_id != 0) {
-			mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
-		}
-		RETURN_FALSE;
-	}
+  if (cursor_send_get_more(cursor TSRMLS_CC) == FAILURE) {
+    return FAILURE;
+  }
+
+  php_mongo_expect_reply(cursor->server, cursor->send.request_id);
+  cursor->getmore_sent = 1;
+  return SUCCESS;
+}
+
+/*
+ * Returns whether there are more results, getting the next batch from the
+ * database if the current one has been used up.
+ */
+static int cursor_has_next(zval *this_ptr, mongo_cursor *cursor TSRMLS_DC) {
+  zval *temp;
+
+  if (cursor_start(this_ptr, cursor TSRMLS_CC) == FAILURE) {
+    return 0;
+  }
+
+  if ((cursor->limit > 0 && cursor->at >= cursor->limit) || cursor->num == 0) {
+    if (cursor->cursor_id != 0) {
+      mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
+    }
+    return 0;
+  }
   if (cursor->at < cursor->num) {
-    RETURN_TRUE;
+    return 1;
   }
   else if (cursor->cursor_id == 0) {
-    RETURN_FALSE;
+    return 0;
   }
   // if we have a cursor_id, we should have a server
   else if (cursor->server == 0) {
     mongo_cursor_throw(0, 18 TSRMLS_CC, "trying to get more, but cannot find server");
-    return;
+    return 0;
   }
 
-  // we have to go and check with the db
-  size = 34+strlen(cursor->ns);
-  CREATE_BUF(buf, size);
-  if (FAILURE == php_mongo_write_get_more(&buf, cursor TSRMLS_CC)) {
-    efree(buf.start);
-    return;
+  // we have to go and check with the db, unless prefetching already did
+  if (cursor->getmore_sent) {
+    cursor->getmore_sent = 0;
+  }
+  else if (cursor_send_get_more(cursor TSRMLS_CC) == FAILURE) {
+    return 0;
   }
 
   MAKE_STD_ZVAL(temp);
   ZVAL_NULL(temp);
 
-  if(mongo_say(cursor->server, &buf, temp TSRMLS_CC) == FAILURE) {
-    efree(buf.start);
-
-    mongo_cursor_throw(cursor->server, 1 TSRMLS_CC, Z_STRVAL_P(temp));
-    zval_ptr_dtor(&temp);
-    mongo_util_cursor_failed(cursor TSRMLS_CC);
-    return;
-  }
-
-  efree(buf.start);
-
   if (php_mongo_get_reply(cursor, temp TSRMLS_CC) != SUCCESS) {
     zval_ptr_dtor(&temp);
     mongo_util_cursor_failed(cursor TSRMLS_CC);
-    return;
+    return 0;
   }
 
   zval_ptr_dtor(&temp);
@@ -269,18 +344,27 @@ PHP_METHOD(MongoCursor, hasNext) {
 
   if (cursor->flag & 1) {
     mongo_cursor_throw(cursor->server, 2 TSRMLS_CC, "cursor not found");
-    return;
+    return 0;
   }
 
   // sometimes we'll have a cursor_id but there won't be any more results
   if (cursor->at >= cursor->num) {
-    RETURN_FALSE;
+    return 0;
   }
   // but sometimes there will be
   else {
-    RETURN_TRUE;
+    return 1;
   }
 }
+
+/* {{{ MongoCursor::hasNext
+ */
+PHP_METHOD(MongoCursor, hasNext) {
+  mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(cursor->link, MongoCursor);
+
+  RETURN_BOOL(cursor_has_next(getThis(), cursor TSRMLS_CC));
+}
 /* }}} */
 
 /* {{{ MongoCursor::getNext
@@ -365,13 +449,51 @@ PHP_METHOD(MongoCursor, fields) {
 /* }}} */
 
 
+/* {{{ MongoCursor::decodeFields(array fields)
+ *
+ * Like fields(), but applied when the results are decoded: the fields left out
+ * are still sent by the database, but skipped over instead of being turned
+ * into PHP values.  Handy when the same query is used for different things.
+ */
+PHP_METHOD(MongoCursor, decodeFields) {
+  zval *z;
+  mongo_decode_filter *filter;
+  preiteration_setup;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &z) == FAILURE) {
+    return;
+  }
+
+  filter = php_mongo_decode_filter_new(Z_ARRVAL_P(z) TSRMLS_CC);
+  if (!filter) {
+    return;
+  }
+
+  if (cursor->decode_filter) {
+    php_mongo_decode_filter_free(cursor->decode_filter);
+    cursor->decode_filter = 0;
+  }
+
+  // no fields, decode everything again
+  if (filter->include == -1) {
+    php_mongo_decode_filter_free(filter);
+  }
+  else {
+    cursor->decode_filter = filter;
+  }
+
+  RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+
 /* {{{ MongoCursor::dead
  */
 PHP_METHOD(MongoCursor, dead) {
   mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
   MONGO_CHECK_INITIALIZED(cursor->link, MongoCursor);
 
-  RETURN_BOOL(cursor->started_iterating && cursor->cursor_id == 0);
+  RETURN_BOOL(cursor->started_iterating && !cursor->awaiting_reply && cursor->cursor_id == 0);
 }
 /* }}} */
 
@@ -465,6 +587,87 @@ PHP_METHOD(MongoCursor, partial)
 /* }}} */
 
 
+/* {{{ MongoCursor::typeMap(array map)
+ *
+ * Decodes dates, 64-bit ints and binary data as plain PHP values rather than
+ * objects: "date" => "int" for milliseconds since the epoch, "long" => "int"
+ * or "string" and "binary" => "string".  "default" goes back to the usual
+ * type.  Types that aren't given keep the mongo.type_map setting.
+ */
+PHP_METHOD(MongoCursor, typeMap) {
+  zval *z, **as;
+  HashPosition pos;
+  int types;
+  preiteration_setup;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &z) == FAILURE) {
+    return;
+  }
+
+  types = cursor->types;
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(z), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(z), (void**)&as, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(z), &pos)) {
+    char *type;
+    uint type_len;
+    ulong index;
+
+    if (zend_hash_get_current_key_ex(Z_ARRVAL_P(z), &type, &type_len, &index, NO_DUP, &pos) != HASH_KEY_IS_STRING ||
+        Z_TYPE_PP(as) != IS_STRING ||
+        php_mongo_type_map_set(&types, type, type_len-1, Z_STRVAL_PP(as), Z_STRLEN_PP(as)) == FAILURE) {
+      zend_throw_exception(mongo_ce_Exception, "type map entries can be \"date\" => \"int\", \"long\" => \"int\" or \"string\" and \"binary\" => \"string\"", 24 TSRMLS_CC);
+      return;
+    }
+  }
+
+  cursor->types = types;
+  RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+
+/* {{{ MongoCursor::lazy(bool lazy)
+ *
+ * Makes the cursor return MongoLazyDocuments, which only decode the fields
+ * that are read, instead of arrays.
+ */
+PHP_METHOD(MongoCursor, lazy) {
+  zend_bool lazy = 1;
+  preiteration_setup;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &lazy) == FAILURE) {
+    return;
+  }
+
+  cursor->lazy = lazy;
+  RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+
+/* {{{ MongoCursor::prefetch
+ *
+ * Asks for the next batch as soon as half of the current one has been read,
+ * instead of once it has run out, so iterating doesn't wait on the network
+ * between batches.
+ */
+PHP_METHOD(MongoCursor, prefetch) {
+  zend_bool prefetch = 1;
+  mongo_cursor *cursor;
+
+  PHP_MONGO_GET_CURSOR(getThis());
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &prefetch) == FAILURE) {
+    return;
+  }
+
+  cursor->prefetch = prefetch;
+  RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+
 /* {{{ MongoCursor::timeout
  */
 PHP_METHOD(MongoCursor, timeout) {
@@ -678,10 +881,30 @@ PHP_METHOD(MongoCursor, doQuery) {
   mongo_cursor_throw(cursor->server, 19 TSRMLS_CC, "max number of retries exhausted, couldn't send query");
 }
 
+/* {{{ MongoCursor->send
+ *
+ * Sends the query without waiting for the reply, which is read when the
+ * results are first asked for.  Queries sent one after another on the same
+ * connection are answered in about one round trip.
+ */
+PHP_METHOD(MongoCursor, send) {
+  preiteration_setup;
+
+  mongo_util_cursor_reset(cursor TSRMLS_CC);
+  if (cursor_send_query(cursor TSRMLS_CC) == FAILURE) {
+    return;
+  }
+
+  php_mongo_expect_reply(cursor->server, cursor->send.request_id);
+  cursor->awaiting_reply = 1;
+  cursor->started_iterating = 1;
+
+  RETVAL_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
 int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
   mongo_cursor *cursor;
-  buffer buf;
-  zval *errmsg;
 
   cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
   if (!cursor) {
@@ -691,9 +914,25 @@ int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
     return FAILURE;
   }
 
-  CREATE_BUF(buf, INITIAL_BUF_SIZE);
+  if (cursor_send_query(cursor TSRMLS_CC) == FAILURE) {
+    return FAILURE;
+  }
+
+  return cursor_recv_query(cursor TSRMLS_CC);
+}
+/* }}} */
+
+/*
+ * Sends the query to the server it should go to, without waiting for the
+ * reply.
+ */
+static int cursor_send_query(mongo_cursor *cursor TSRMLS_DC) {
+  buffer buf;
+  zval *errmsg;
+
+  php_mongo_buf_get(&buf, INITIAL_BUF_SIZE TSRMLS_CC);
   if (php_mongo_write_query(&buf, cursor TSRMLS_CC) == FAILURE) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     return FAILURE;
   }
 
@@ -712,7 +951,7 @@ int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
   // if getting the slave didn't work (or we're not using a rs), just get master socket
   if (cursor->server == 0 &&
       (cursor->server = mongo_util_link_get_socket(cursor->link, errmsg TSRMLS_CC)) == 0) {
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
 
     // if we couldn't connect to the master or the slave
     if (cursor->opts & CURSOR_FLAG_SLAVE_OKAY) {
@@ -733,12 +972,25 @@ int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
     else {
       mongo_cursor_throw(cursor->server, 14 TSRMLS_CC, "couldn't send query");
     }
-    efree(buf.start);
+    php_mongo_buf_release(&buf TSRMLS_CC);
     zval_ptr_dtor(&errmsg);
     return mongo_util_cursor_failed(cursor TSRMLS_CC);
   }
 
-  efree(buf.start);
+  php_mongo_buf_release(&buf TSRMLS_CC);
+  zval_ptr_dtor(&errmsg);
+
+  return SUCCESS;
+}
+
+/*
+ * Reads the reply to the query.
+ */
+static int cursor_recv_query(mongo_cursor *cursor TSRMLS_DC) {
+  zval *errmsg;
+
+  MAKE_STD_ZVAL(errmsg);
+  ZVAL_NULL(errmsg);
 
   if (php_mongo_get_reply(cursor, errmsg TSRMLS_CC) == FAILURE) {
     zval_ptr_dtor(&errmsg);
@@ -754,7 +1006,6 @@ int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
 
   return SUCCESS;
 }
-/* }}} */
 
 int mongo_util_cursor_failed(mongo_cursor *cursor TSRMLS_DC) {
   mongo_server *old = cursor->server;
@@ -787,36 +1038,51 @@ PHP_METHOD(MongoCursor, current) {
 }
 /* }}} */
 
-/* {{{ MongoCursor->key
+/*
+ * Sets key to the current document's _id as a string, or to its position in
+ * the results if it doesn't have one.
  */
-PHP_METHOD(MongoCursor, key) {
-  zval **id;
-  mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  MONGO_CHECK_INITIALIZED(cursor->link, MongoCursor);
+static void cursor_current_key(mongo_cursor *cursor, zval *key TSRMLS_DC) {
+  zval **id = 0;
 
-  if (!cursor->current) {
-    RETURN_NULL();
+  if (Z_TYPE_P(cursor->current) == IS_ARRAY) {
+    zend_hash_find(HASH_P(cursor->current), "_id", 4, (void**)&id);
   }
-  if (cursor->current &&
-      Z_TYPE_P(cursor->current) == IS_ARRAY &&
-      zend_hash_find(HASH_P(cursor->current), "_id", 4, (void**)&id) == SUCCESS) {
+  else {
+    id = php_mongo_lazy_document_find(cursor->current, "_id", strlen("_id") TSRMLS_CC);
+  }
+
+  if (id) {
 
     if (Z_TYPE_PP(id) == IS_OBJECT) {
 #if ZEND_MODULE_API_NO >= 20060613
-      zend_std_cast_object_tostring(*id, return_value, IS_STRING TSRMLS_CC);
+      zend_std_cast_object_tostring(*id, key, IS_STRING TSRMLS_CC);
 #else
-      zend_std_cast_object_tostring(*id, return_value, IS_STRING, 0 TSRMLS_CC);
+      zend_std_cast_object_tostring(*id, key, IS_STRING, 0 TSRMLS_CC);
 #endif /* ZEND_MODULE_API_NO >= 20060613 */
     }
     else {
-      RETVAL_ZVAL(*id, 1, 0);
-      convert_to_string(return_value);
+      ZVAL_ZVAL(key, *id, 1, 0);
+      convert_to_string(key);
     }
   }
   else {
-    RETURN_LONG(cursor->at - 1);
+    ZVAL_LONG(key, cursor->at - 1);
   }
 }
+
+/* {{{ MongoCursor->key
+ */
+PHP_METHOD(MongoCursor, key) {
+  mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(cursor->link, MongoCursor);
+
+  if (!cursor->current) {
+    RETURN_NULL();
+  }
+
+  cursor_current_key(cursor, return_value TSRMLS_CC);
+}
 /* }}} */
 
 int mongo_cursor__should_retry(mongo_cursor *cursor) {
@@ -849,101 +1115,457 @@ int mongo_cursor__should_retry(mongo_cursor *cursor) {
   return 1;
 }
 
+mongo_reply* mongo_util_reply_new(int len) {
+  mongo_reply *reply = (mongo_reply*)emalloc(XtOffsetOf(mongo_reply, data) + len);
+  reply->refcount = 1;
+  return reply;
+}
+
+void mongo_util_reply_release(mongo_reply *reply) {
+  if (--reply->refcount == 0) {
+    efree(reply);
+  }
+}
+
+/*
+ * Whether the documents of the current reply can be errors: a failed query
+ * sets the QueryFailure flag and sends back {$err : ...}, and commands (e.g.,
+ * getLastError) report errors with {err : "..."}.  Anything else is a user's
+ * document, whatever its fields are called.
+ */
+static int cursor_reply_may_be_error(mongo_cursor *cursor) {
+  int len = strlen(cursor->ns);
+
+  return (cursor->flag & 2) || (len >= 5 && strcmp(".$cmd", cursor->ns + len - 5) == 0);
+}
+
+/*
+ * Throws if doc is an error reply: a failed query sends back {$err : ...} and
+ * getLastError returns {err : "..."}.  Returns FAILURE, with *doc set to the
+ * whole error document as an array, if it was an error.
+ */
+static int cursor_check_error(mongo_cursor *cursor, zval **doc TSRMLS_DC) {
+  zval **err = 0, **code_z, *exception;
+  // default error code
+  int code = 4;
+
+  // errors are reported with the whole document
+  if (Z_TYPE_PP(doc) == IS_OBJECT) {
+    mongo_lazy_document *lazy;
+    zval *arr;
+
+    if (!php_mongo_lazy_document_is_error(*doc TSRMLS_CC)) {
+      return SUCCESS;
+    }
+
+    lazy = (mongo_lazy_document*)zend_object_store_get_object(*doc TSRMLS_CC);
+
+    MAKE_STD_ZVAL(arr);
+    array_init(arr);
+    bson_to_zval(lazy->doc, Z_ARRVAL_P(arr) TSRMLS_CC);
+
+    zval_ptr_dtor(doc);
+    *doc = arr;
+
+    if (EG(exception)) {
+      return FAILURE;
+    }
+  }
+
+  if (zend_hash_find(Z_ARRVAL_PP(doc), "$err", strlen("$err")+1, (void**)&err) == FAILURE &&
+      // getLastError can return an error here
+      (zend_hash_find(Z_ARRVAL_PP(doc), "err", strlen("err")+1, (void**)&err) == FAILURE ||
+       Z_TYPE_PP(err) != IS_STRING)) {
+    return SUCCESS;
+  }
+
+  if (zend_hash_find(Z_ARRVAL_PP(doc), "code", strlen("code")+1, (void**)&code_z) == SUCCESS) {
+    // check for not master
+    if (Z_TYPE_PP(code_z) == IS_LONG) {
+      code = Z_LVAL_PP(code_z);
+    }
+    else if (Z_TYPE_PP(code_z) == IS_DOUBLE) {
+      code = (int)Z_DVAL_PP(code_z);
+    }
+    // else code == 4
+
+    // this shouldn't be necessary after 1.7.* is standard, it forces
+    // failover in case the master steps down.
+    // not master: 10107
+    // not master and slaveok=false (more recent): 13435
+    // not master or secondary: 13436
+    if (cursor->link->rs && (code == 10107 || code == 13435 || code == 13436 || code == 10058)) {
+      mongo_util_link_master_failed(cursor->link TSRMLS_CC);
+    }
+  }
+
+  exception = mongo_cursor_throw(cursor->server, code TSRMLS_CC, Z_STRVAL_PP(err));
+  zend_update_property(mongo_ce_CursorException, exception, "doc", strlen("doc"), *doc TSRMLS_CC);
+  return FAILURE;
+}
+
+/*
+ * Decodes the document at cursor->buf.pos into *doc, as an array or a
+ * MongoLazyDocument, and moves the cursor past it.
+ *
+ * Documents are only checked for errors in replies that can carry them, see
+ * cursor_reply_may_be_error.  Returns FAILURE, with an
+ * exception thrown and *doc set to 0, if the document couldn't be decoded,
+ * was an error or the getmore for prefetching couldn't be sent.
+ */
+static int cursor_next_document(mongo_cursor *cursor, zval **doc TSRMLS_DC) {
+  MAKE_STD_ZVAL(*doc);
+  if (cursor->lazy) {
+    cursor->buf.pos = php_mongo_lazy_document_init(*doc, cursor->reply, cursor->buf.pos, cursor->buf.end, cursor->types TSRMLS_CC);
+  }
+  else {
+    array_init(*doc);
+
+    if (!cursor->keys) {
+      cursor->keys = php_mongo_key_cache_new();
+    }
+
+    // a query failure is reported with $err, which mustn't be filtered out
+    cursor->buf.pos = php_mongo_bson_to_zval_ex((char*)cursor->buf.pos, Z_ARRVAL_PP(doc),
+                                                cursor->flag & 2 ? 0 : cursor->decode_filter,
+                                                cursor->keys, cursor->types TSRMLS_CC);
+  }
+
+  if (EG(exception)) {
+    zval_ptr_dtor(doc);
+    *doc = 0;
+    return FAILURE;
+  }
+
+  // increment cursor position
+  cursor->at++;
+
+  if (cursor_reply_may_be_error(cursor) && cursor_check_error(cursor, doc TSRMLS_CC) == FAILURE) {
+    zval_ptr_dtor(doc);
+    *doc = 0;
+    return FAILURE;
+  }
+
+  if (cursor_prefetch(cursor TSRMLS_CC) == FAILURE) {
+    zval_ptr_dtor(doc);
+    *doc = 0;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Moves the cursor on to the next result, leaving cursor->current at 0 once
+ * there are no more.  Returns FAILURE, with an exception thrown, on error.
+ */
+static int cursor_next(zval *this_ptr, mongo_cursor *cursor TSRMLS_DC) {
+  if (cursor_start(this_ptr, cursor TSRMLS_CC) == FAILURE) {
+    return FAILURE;
+  }
+
+  // destroy old current
+  if (cursor->current) {
+    zval_ptr_dtor(&cursor->current);
+    cursor->current = 0;
+  }
+
+  // check for results
+  if (!cursor_has_next(this_ptr, cursor TSRMLS_CC)) {
+    // we're out of results
+    return EG(exception) ? FAILURE : SUCCESS;
+  }
+
+  // we got more results
+  if (cursor->at < cursor->num) {
+    return cursor_next_document(cursor, &cursor->current TSRMLS_CC);
+  }
+
+  return SUCCESS;
+}
+
 /* {{{ MongoCursor->next
  */
 PHP_METHOD(MongoCursor, next) {
-  zval has_next;
   mongo_cursor *cursor;
 
   PHP_MONGO_GET_CURSOR(getThis());
 
-  if (!cursor->started_iterating) {
-    MONGO_METHOD(MongoCursor, doQuery, return_value, getThis());
-    if (EG(exception)) {
-      return;
+  if (cursor_next(getThis(), cursor TSRMLS_CC) == FAILURE) {
+    RETURN_FALSE;
+  }
+
+  RETURN_NULL();
+}
+/* }}} */
+
+/*
+ * Returns how many documents are left in the current reply, stopping at the
+ * cursor's limit.
+ */
+static int cursor_batch_left(mongo_cursor *cursor) {
+  int left = cursor->num - cursor->at;
+
+  if (cursor->limit > 0 && cursor->limit - cursor->at < left) {
+    left = cursor->limit - cursor->at;
+  }
+  return left > 0 ? left : 0;
+}
+
+/*
+ * Decodes the documents left in the current reply onto the end of docs.
+ */
+static int cursor_decode_batch(mongo_cursor *cursor, zval *docs TSRMLS_DC) {
+  int left = cursor_batch_left(cursor);
+
+  while (left-- > 0) {
+    zval *doc;
+
+    if (cursor_next_document(cursor, &doc TSRMLS_CC) == FAILURE) {
+      return FAILURE;
     }
-    cursor->started_iterating = 1;
+    add_next_index_zval(docs, doc);
   }
 
-  // destroy old current
+  return SUCCESS;
+}
+
+/* {{{ MongoCursor->fetchBatch
+ *
+ * Returns the documents left in the current batch, getting the next batch
+ * from the database first if this one has been used up.  Returns an empty
+ * array once there are no more results.
+ */
+PHP_METHOD(MongoCursor, fetchBatch) {
+  int has_next;
+  mongo_cursor *cursor;
+
+  PHP_MONGO_GET_CURSOR(getThis());
+
   if (cursor->current) {
     zval_ptr_dtor(&cursor->current);
     cursor->current = 0;
   }
 
-  // check for results
-  MONGO_METHOD(MongoCursor, hasNext, &has_next, getThis());
+  has_next = cursor_has_next(getThis(), cursor TSRMLS_CC);
   if (EG(exception)) {
     return;
   }
-  if (!Z_BVAL(has_next)) {
-    // we're out of results
-    RETURN_NULL();
+
+  MONGO_ARRAY_INIT_SIZE(return_value, has_next ? cursor_batch_left(cursor) : 0);
+
+  if (has_next && cursor_decode_batch(cursor, return_value TSRMLS_CC) == FAILURE) {
+    zval_dtor(return_value);
+    RETURN_FALSE;
   }
+}
+/* }}} */
 
-  // we got more results
-  if (cursor->at < cursor->num) {
-    zval **err = 0, **ok = 0;
+/* {{{ MongoCursor->toArray
+ *
+ * Returns the rest of the results, a batch at a time.  Unlike
+ * iterator_to_array(), the array is a list and isn't keyed by _id.
+ */
+PHP_METHOD(MongoCursor, toArray) {
+  int has_next;
+  mongo_cursor *cursor;
+
+  PHP_MONGO_GET_CURSOR(getThis());
+
+  if (cursor->current) {
+    zval_ptr_dtor(&cursor->current);
+    cursor->current = 0;
+  }
+
+  has_next = cursor_has_next(getThis(), cursor TSRMLS_CC);
+  if (EG(exception)) {
+    return;
+  }
 
-    MAKE_STD_ZVAL(cursor->current);
-    array_init(cursor->current);
-    cursor->buf.pos = bson_to_zval((char*)cursor->buf.pos, Z_ARRVAL_P(cursor->current) TSRMLS_CC);
+  // the first batch is usually the only one, or at least the biggest
+  MONGO_ARRAY_INIT_SIZE(return_value, has_next ? cursor_batch_left(cursor) : 0);
 
+  while (has_next) {
+    if (cursor_decode_batch(cursor, return_value TSRMLS_CC) == FAILURE) {
+      zval_dtor(return_value);
+      RETURN_FALSE;
+    }
+
+    has_next = cursor_has_next(getThis(), cursor TSRMLS_CC);
     if (EG(exception)) {
-      zval_ptr_dtor(&cursor->current);
-      cursor->current = 0;
-      return;
+      zval_dtor(return_value);
+      RETURN_FALSE;
     }
+  }
+}
+/* }}} */
 
-    // increment cursor position
-    cursor->at++;
-
-    // check for $err
-    if (zend_hash_find(Z_ARRVAL_P(cursor->current), "$err", strlen("$err")+1, (void**)&err) == SUCCESS ||
-        // getLastError can return an error here
-        (zend_hash_find(Z_ARRVAL_P(cursor->current), "err", strlen("err")+1, (void**)&err) == SUCCESS &&
-         Z_TYPE_PP(err) == IS_STRING)) {
-      zval **code_z, *exception;
-      // default error code
-      int code = 4;
-
-      if (zend_hash_find(Z_ARRVAL_P(cursor->current), "code", strlen("code")+1, (void**)&code_z) == SUCCESS) {
-        // check for not master
-        if (Z_TYPE_PP(code_z) == IS_LONG) {
-          code = Z_LVAL_PP(code_z);
-        }
-        else if (Z_TYPE_PP(code_z) == IS_DOUBLE) {
-          code = (int)Z_DVAL_PP(code_z);
-        }
-        // else code == 4
-
-        // this shouldn't be necessary after 1.7.* is standard, it forces
-        // failover in case the master steps down.
-        // not master: 10107
-        // not master and slaveok=false (more recent): 13435
-        // not master or secondary: 13436
-        if (cursor->link->rs && (code == 10107 || code == 13435 || code == 13436 || code == 10058)) {
-          mongo_util_link_master_failed(cursor->link TSRMLS_CC);
-        }
+/*
+ * Appends the document at cursor->buf.pos to json and moves the cursor past
+ * it.  Error replies are decoded so they throw the same exception they would
+ * when iterating.
+ */
+static int cursor_next_json(mongo_cursor *cursor, smart_str *json, int flags TSRMLS_DC) {
+  char *next;
+
+  if (cursor_reply_may_be_error(cursor) && php_mongo_bson_is_error(cursor->buf.pos, cursor->buf.end)) {
+    zval *doc;
+
+    MAKE_STD_ZVAL(doc);
+    array_init(doc);
+    bson_to_zval(cursor->buf.pos, Z_ARRVAL_P(doc) TSRMLS_CC);
+
+    if (!EG(exception)) {
+      cursor_check_error(cursor, &doc TSRMLS_CC);
+    }
+    zval_ptr_dtor(&doc);
+    return FAILURE;
+  }
+
+  if ((next = php_mongo_bson_to_json(json, cursor->buf.pos, cursor->buf.end, flags TSRMLS_CC)) == 0) {
+    return FAILURE;
+  }
+
+  cursor->buf.pos = next;
+  cursor->at++;
+
+  return cursor_prefetch(cursor TSRMLS_CC);
+}
+
+/*
+ * Writes the rest of the results to json as a JSON array.  If stream is set,
+ * json is written out and emptied whenever it gets to MONGO_JSON_CHUNK bytes,
+ * so only that much is held in memory.  *count is set to the number of
+ * documents written.
+ */
+static int cursor_write_json(zval *this_ptr, mongo_cursor *cursor, smart_str *json, php_stream *stream, int flags, int *count TSRMLS_DC) {
+  if (cursor->current) {
+    zval_ptr_dtor(&cursor->current);
+    cursor->current = 0;
+  }
+
+  smart_str_appendc(json, '[');
+
+  while (cursor_has_next(this_ptr, cursor TSRMLS_CC)) {
+    int left = cursor_batch_left(cursor);
+
+    while (left-- > 0) {
+      if (*count) {
+        smart_str_appendc(json, ',');
+      }
+      if (cursor_next_json(cursor, json, flags TSRMLS_CC) == FAILURE) {
+        return FAILURE;
       }
+      (*count)++;
 
-      exception = mongo_cursor_throw(cursor->server, code TSRMLS_CC, Z_STRVAL_PP(err));
-      zend_update_property(mongo_ce_CursorException, exception, "doc", strlen("doc"), cursor->current TSRMLS_CC);
-      zval_ptr_dtor(&cursor->current);
-      cursor->current = 0;
-      RETURN_FALSE;
+      if (stream && json->len >= MONGO_JSON_CHUNK) {
+        if (php_stream_write(stream, json->c, json->len) != json->len) {
+          zend_throw_exception(mongo_ce_Exception, "could not write JSON to stream", 26 TSRMLS_CC);
+          return FAILURE;
+        }
+        json->len = 0;
+      }
     }
   }
 
-  RETURN_NULL();
+  if (EG(exception)) {
+    return FAILURE;
+  }
+
+  smart_str_appendc(json, ']');
+
+  if (stream && php_stream_write(stream, json->c, json->len) != json->len) {
+    zend_throw_exception(mongo_ce_Exception, "could not write JSON to stream", 26 TSRMLS_CC);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/* {{{ MongoCursor->toJSON([array options])
+ *
+ * Returns the rest of the results as a JSON array, written straight from the
+ * BSON the database sent.  See bson_to_json() for the options.  decodeFields(),
+ * typeMap() and lazy() don't apply.
+ */
+PHP_METHOD(MongoCursor, toJSON) {
+  zval *options = 0;
+  int flags = 0, count = 0;
+  smart_str json = {0};
+  mongo_cursor *cursor;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|a", &options) == FAILURE) {
+    return;
+  }
+
+  PHP_MONGO_GET_CURSOR(getThis());
+
+  if (options && php_mongo_json_flags(Z_ARRVAL_P(options), &flags TSRMLS_CC) == FAILURE) {
+    return;
+  }
+
+  if (cursor_write_json(getThis(), cursor, &json, 0, flags, &count TSRMLS_CC) == FAILURE) {
+    smart_str_free(&json);
+    RETURN_FALSE;
+  }
+
+  smart_str_0(&json);
+  RETURN_STRINGL(json.c, json.len, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursor->writeJSON(resource stream [, array options])
+ *
+ * Like toJSON(), but writes the JSON to a stream a few kilobytes at a time, so
+ * results of any size can be exported.  Returns the number of documents
+ * written.
+ */
+PHP_METHOD(MongoCursor, writeJSON) {
+  zval *zstream, *options = 0;
+  int flags = 0, count = 0, status;
+  smart_str json = {0};
+  php_stream *stream;
+  mongo_cursor *cursor;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "r|a", &zstream, &options) == FAILURE) {
+    return;
+  }
+
+  PHP_MONGO_GET_CURSOR(getThis());
+  php_stream_from_zval(stream, &zstream);
+
+  if (options && php_mongo_json_flags(Z_ARRVAL_P(options), &flags TSRMLS_CC) == FAILURE) {
+    return;
+  }
+
+  status = cursor_write_json(getThis(), cursor, &json, stream, flags, &count TSRMLS_CC);
+  smart_str_free(&json);
+
+  if (status == FAILURE) {
+    RETURN_FALSE;
+  }
+  RETURN_LONG(count);
 }
 /* }}} */
 
+/*
+ * Starts the results over, unless the query went out with send() and none of
+ * them have been read yet.
+ */
+static void cursor_rewind(zval *this_ptr, mongo_cursor *cursor TSRMLS_DC) {
+  if (!cursor->awaiting_reply) {
+    mongo_util_cursor_reset(cursor TSRMLS_CC);
+  }
+  cursor_next(this_ptr, cursor TSRMLS_CC);
+}
+
 /* {{{ MongoCursor->rewind
  */
 PHP_METHOD(MongoCursor, rewind) {
-  MONGO_METHOD(MongoCursor, reset, return_value, getThis());
-  MONGO_METHOD(MongoCursor, next, return_value, getThis());
+  mongo_cursor *cursor;
+
+  PHP_MONGO_GET_CURSOR(getThis());
+
+  cursor_rewind(getThis(), cursor TSRMLS_CC);
 }
 /* }}} */
 
@@ -969,6 +1591,13 @@ PHP_METHOD(MongoCursor, reset) {
 void mongo_util_cursor_reset(mongo_cursor *cursor TSRMLS_DC) {
   cursor->buf.pos = cursor->buf.start;
 
+  // nobody will read the reply to send() or a prefetch now
+  if (cursor->awaiting_reply || cursor->getmore_sent) {
+    php_mongo_forget_reply(cursor->server, cursor->send.request_id TSRMLS_CC);
+    cursor->awaiting_reply = 0;
+    cursor->getmore_sent = 0;
+  }
+
   if (cursor->current) {
     zval_ptr_dtor(&cursor->current);
   }
@@ -1089,6 +1718,23 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_fields, 0, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_ARRAY_INFO(0, fields, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_decode_fields, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_ARRAY_INFO(0, fields, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_type_map, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_ARRAY_INFO(0, map, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_to_json, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_write_json, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, stream)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_add_option, 0, ZEND_RETURN_VALUE, 2)
 	ZEND_ARG_INFO(0, key)
 	ZEND_ARG_INFO(0, value)
@@ -1127,6 +1773,14 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_partial, 0, ZEND_RETURN_VALUE, 0)
 	ZEND_ARG_INFO(0, okay)
 ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_lazy, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, lazy)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_prefetch, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, prefetch)
+ZEND_END_ARG_INFO()
 /* }}} */
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_timeout, 0, ZEND_RETURN_VALUE, 1)
@@ -1142,12 +1796,18 @@ static zend_function_entry MongoCursor_methods[] = {
   PHP_ME(MongoCursor, __construct, arginfo___construct, ZEND_ACC_CTOR|ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, hasNext, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, getNext, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, fetchBatch, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, toArray, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, toJSON, arginfo_to_json, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, writeJSON, arginfo_write_json, ZEND_ACC_PUBLIC)
 
   /* options */
   PHP_ME(MongoCursor, limit, arginfo_limit, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, batchSize, arginfo_batchsize, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, skip, arginfo_skip, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, fields, arginfo_fields, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, decodeFields, arginfo_decode_fields, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, typeMap, arginfo_type_map, ZEND_ACC_PUBLIC)
 
   /* meta options */
   PHP_ME(MongoCursor, addOption, arginfo_add_option, ZEND_ACC_PUBLIC)
@@ -1163,10 +1823,13 @@ static zend_function_entry MongoCursor_methods[] = {
   PHP_ME(MongoCursor, immortal, arginfo_immortal, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, awaitData, arginfo_await_data, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, partial, arginfo_partial, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, lazy, arginfo_lazy, ZEND_ACC_PUBLIC)
 
   /* query */
   PHP_ME(MongoCursor, timeout, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, prefetch, arginfo_prefetch, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, doQuery, arginfo_no_parameters, ZEND_ACC_PROTECTED|ZEND_ACC_DEPRECATED)
+  PHP_ME(MongoCursor, send, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, info, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, dead, arginfo_no_parameters, ZEND_ACC_PUBLIC)
 
@@ -1447,6 +2110,8 @@ static void kill_cursor(cursor_node *node, zend_rsrc_list_entry *le TSRMLS_DC) {
   buf.pos = quickbuf;
   buf.start = buf.pos;
   buf.end = buf.start + 128;
+  buf.ref_min = buf.ref_count = 0;
+  buf.refs = 0;
 
   php_mongo_write_kill_cursors(&buf, node->cursor_id TSRMLS_CC);
 
@@ -1471,6 +2136,11 @@ void php_mongo_cursor_free(void *object TSRMLS_DC) {
   mongo_cursor *cursor = (mongo_cursor*)object;
 
   if (cursor) {
+    // nobody will read the reply to send() or a prefetch now
+    if ((cursor->awaiting_reply || cursor->getmore_sent) && cursor->server) {
+      php_mongo_forget_reply(cursor->server, cursor->send.request_id TSRMLS_CC);
+    }
+
     if (cursor->cursor_id != 0) {
       mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
     }
@@ -1479,8 +2149,10 @@ void php_mongo_cursor_free(void *object TSRMLS_DC) {
 
     if (cursor->query) zval_ptr_dtor(&cursor->query);
     if (cursor->fields) zval_ptr_dtor(&cursor->fields);
+    if (cursor->decode_filter) php_mongo_decode_filter_free(cursor->decode_filter);
+    if (cursor->keys) php_mongo_key_cache_free(cursor->keys);
 
-    if (cursor->buf.start) efree(cursor->buf.start);
+    if (cursor->reply) mongo_util_reply_release(cursor->reply);
     if (cursor->ns) efree(cursor->ns);
 
     if (cursor->resource) zval_ptr_dtor(&cursor->resource);
@@ -1491,6 +2163,112 @@ void php_mongo_cursor_free(void *object TSRMLS_DC) {
   }
 }
 
+/*
+ * foreach goes through these rather than calling the Iterator methods, as
+ * long as a subclass hasn't overridden them.
+ */
+typedef struct {
+  zend_object_iterator it;
+  mongo_cursor *cursor;
+} mongo_cursor_iterator;
+
+static zend_object_iterator* (*cursor_user_get_iterator)(zend_class_entry *ce, zval *object, int by_ref TSRMLS_DC);
+
+static void cursor_it_dtor(zend_object_iterator *iter TSRMLS_DC) {
+  zval *object = (zval*)iter->data;
+
+  zval_ptr_dtor(&object);
+  efree(iter);
+}
+
+static int cursor_it_valid(zend_object_iterator *iter TSRMLS_DC) {
+  return ((mongo_cursor_iterator*)iter)->cursor->current ? SUCCESS : FAILURE;
+}
+
+static void cursor_it_get_current_data(zend_object_iterator *iter, zval ***data TSRMLS_DC) {
+  *data = &((mongo_cursor_iterator*)iter)->cursor->current;
+}
+
+#if ZEND_MODULE_API_NO >= 20121212
+static void cursor_it_get_current_key(zend_object_iterator *iter, zval *key TSRMLS_DC) {
+  cursor_current_key(((mongo_cursor_iterator*)iter)->cursor, key TSRMLS_CC);
+}
+#else
+static int cursor_it_get_current_key(zend_object_iterator *iter, char **str_key, uint *str_key_len, ulong *int_key TSRMLS_DC) {
+  zval key;
+
+  cursor_current_key(((mongo_cursor_iterator*)iter)->cursor, &key TSRMLS_CC);
+
+  if (Z_TYPE(key) == IS_STRING) {
+    *str_key = Z_STRVAL(key);
+    *str_key_len = Z_STRLEN(key)+1;
+    return HASH_KEY_IS_STRING;
+  }
+
+  *int_key = Z_TYPE(key) == IS_LONG ? Z_LVAL(key) : 0;
+  zval_dtor(&key);
+  return HASH_KEY_IS_LONG;
+}
+#endif /* ZEND_MODULE_API_NO >= 20121212 */
+
+static void cursor_it_move_forward(zend_object_iterator *iter TSRMLS_DC) {
+  cursor_next((zval*)iter->data, ((mongo_cursor_iterator*)iter)->cursor TSRMLS_CC);
+}
+
+static void cursor_it_rewind(zend_object_iterator *iter TSRMLS_DC) {
+  mongo_cursor *cursor = ((mongo_cursor_iterator*)iter)->cursor;
+
+  cursor_rewind((zval*)iter->data, cursor TSRMLS_CC);
+}
+
+static zend_object_iterator_funcs cursor_iterator_funcs = {
+  cursor_it_dtor,
+  cursor_it_valid,
+  cursor_it_get_current_data,
+  cursor_it_get_current_key,
+  cursor_it_move_forward,
+  cursor_it_rewind,
+  NULL
+};
+
+static int cursor_iterator_overridden(zend_class_entry *ce) {
+  static char *methods[] = {"current", "key", "next", "rewind", "valid", 0};
+  zend_function *fptr;
+  int i;
+
+  if (ce == mongo_ce_Cursor) {
+    return 0;
+  }
+
+  for (i = 0; methods[i]; i++) {
+    if (zend_hash_find(&ce->function_table, methods[i], strlen(methods[i])+1, (void**)&fptr) == SUCCESS &&
+        fptr->common.scope != mongo_ce_Cursor) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static zend_object_iterator* php_mongo_cursor_get_iterator(zend_class_entry *ce, zval *object, int by_ref TSRMLS_DC) {
+  mongo_cursor_iterator *iter;
+  mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(object TSRMLS_CC);
+
+  // the Iterator methods throw for uninitialized cursors and complain about
+  // references, so leave those to them
+  if (by_ref || !cursor->link || cursor_iterator_overridden(ce)) {
+    return cursor_user_get_iterator(ce, object, by_ref TSRMLS_CC);
+  }
+
+  iter = (mongo_cursor_iterator*)emalloc(sizeof(mongo_cursor_iterator));
+
+  zval_add_ref(&object);
+  iter->it.data = object;
+  iter->it.funcs = &cursor_iterator_funcs;
+  iter->cursor = cursor;
+
+  return &iter->it;
+}
+
 void mongo_init_MongoCursor(TSRMLS_D) {
   zend_class_entry ce;
 
@@ -1499,6 +2277,9 @@ void mongo_init_MongoCursor(TSRMLS_D) {
   mongo_ce_Cursor = zend_register_internal_class(&ce TSRMLS_CC);
   zend_class_implements(mongo_ce_Cursor TSRMLS_CC, 1, zend_ce_iterator);
 
+  cursor_user_get_iterator = mongo_ce_Cursor->get_iterator;
+  mongo_ce_Cursor->get_iterator = php_mongo_cursor_get_iterator;
+
   zend_declare_property_bool(mongo_ce_Cursor, "slaveOkay", strlen("slaveOkay"), 0, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC TSRMLS_CC);
   zend_declare_property_long(mongo_ce_Cursor, "timeout", strlen("timeout"), 30000L, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC TSRMLS_CC);
 }
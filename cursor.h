@@ -46,6 +46,16 @@ int mongo_util_cursor_failed(mongo_cursor *cursor TSRMLS_DC);
  */
 int mongo_cursor__should_retry(mongo_cursor *cursor);
 
+/**
+ * Allocates a reply for len bytes of documents, with a refcount of 1.
+ */
+mongo_reply* mongo_util_reply_new(int len);
+
+/**
+ * Drops a reference to a reply, freeing it when that was the last one.
+ */
+void mongo_util_reply_release(mongo_reply *reply);
+
 PHP_METHOD(MongoCursor, __construct);
 PHP_METHOD(MongoCursor, getNext);
 PHP_METHOD(MongoCursor, hasNext);
@@ -53,6 +63,8 @@ PHP_METHOD(MongoCursor, limit);
 PHP_METHOD(MongoCursor, batchSize);
 PHP_METHOD(MongoCursor, skip);
 PHP_METHOD(MongoCursor, fields);
+PHP_METHOD(MongoCursor, decodeFields);
+PHP_METHOD(MongoCursor, typeMap);
 
 PHP_METHOD(MongoCursor, setFlag);
 PHP_METHOD(MongoCursor, tailable);
@@ -60,8 +72,10 @@ PHP_METHOD(MongoCursor, slaveOkay);
 PHP_METHOD(MongoCursor, immortal);
 PHP_METHOD(MongoCursor, awaitData);
 PHP_METHOD(MongoCursor, partial);
+PHP_METHOD(MongoCursor, lazy);
 
 PHP_METHOD(MongoCursor, timeout);
+PHP_METHOD(MongoCursor, prefetch);
 PHP_METHOD(MongoCursor, dead);
 PHP_METHOD(MongoCursor, snapshot);
 PHP_METHOD(MongoCursor, sort);
@@ -69,9 +83,14 @@ PHP_METHOD(MongoCursor, hint);
 PHP_METHOD(MongoCursor, addOption);
 PHP_METHOD(MongoCursor, explain);
 PHP_METHOD(MongoCursor, doQuery);
+PHP_METHOD(MongoCursor, send);
 PHP_METHOD(MongoCursor, current);
 PHP_METHOD(MongoCursor, key);
 PHP_METHOD(MongoCursor, next);
+PHP_METHOD(MongoCursor, fetchBatch);
+PHP_METHOD(MongoCursor, toArray);
+PHP_METHOD(MongoCursor, toJSON);
+PHP_METHOD(MongoCursor, writeJSON);
 PHP_METHOD(MongoCursor, rewind);
 PHP_METHOD(MongoCursor, valid);
 PHP_METHOD(MongoCursor, reset);
@@ -1168,6 +1168,9 @@ PHP_METHOD(MongoGridFSFile, getBytes) {
 	} else if (Z_TYPE_PP(size) == IS_OBJECT && (Z_OBJCE_PP(size) == mongo_ce_Int32 || Z_OBJCE_PP(size) == mongo_ce_Int64)) {
 		zval *sizet = zend_read_property(mongo_ce_Int64, *size, "value", strlen("value"), NOISY TSRMLS_CC);
 		len = atoi(Z_STRVAL_P(sizet));
+	} else if (Z_TYPE_PP(size) == IS_STRING) {
+		// mongo.type_map can make longs strings
+		len = atoi(Z_STRVAL_PP(size));
 	}
 
   str = (char*)emalloc(len + 1);
@@ -26,6 +26,7 @@
 
 #include <php.h>
 #include <zend_exceptions.h>
+#include <zend_interfaces.h>
 #include <ext/standard/php_rand.h>
 
 #include "php_mongo.h"
@@ -34,11 +35,14 @@
 #include "php_mongo.h"
 #include "db.h"
 #include "collection.h"
+#include "cursor.h"
 #include "bson.h"
 
 extern zend_class_entry *mongo_ce_DB,
   *mongo_ce_Exception;
 
+extern zend_object_handlers mongo_default_handlers;
+
 zend_object_handlers mongo_id_handlers;
 
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
@@ -51,7 +55,10 @@ zend_class_entry *mongo_ce_Date = NULL,
   *mongo_ce_Regex = NULL,
   *mongo_ce_Timestamp = NULL,
   *mongo_ce_Int32 = NULL,
-  *mongo_ce_Int64 = NULL;
+  *mongo_ce_Int64 = NULL,
+  *mongo_ce_RawBSON = NULL,
+  *mongo_ce_QueryTemplate = NULL,
+  *mongo_ce_LazyDocument = NULL;
 
 void generate_id(char *data TSRMLS_DC) {
   int inc;
@@ -157,14 +164,120 @@ int php_mongo_compare_ids(zval *o1, zval *o2 TSRMLS_DC) {
 static void php_mongo_id_free(void *object TSRMLS_DC) {
   mongo_id *id = (mongo_id*)object;
   if (id) {
-    if (id->id) {
-      efree(id->id);
-    }
     zend_object_std_dtor(&id->std TSRMLS_CC);
     efree(id);
   }
 }
 
+// hex digit values, and the digit itself for anything else
+static char hex_values[256];
+
+static void id_to_hex(char *id, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < 12; i++) {
+    unsigned char x = (unsigned char)id[i];
+
+    hex[2*i] = digits[x >> 4];
+    hex[2*i+1] = digits[x & 0xF];
+  }
+  hex[24] = '\0';
+}
+
+void php_mongo_id_init(zval *value, char *id TSRMLS_DC) {
+  mongo_id *this_id;
+
+  object_init_ex(value, mongo_ce_Id);
+
+  this_id = (mongo_id*)zend_object_store_get_object(value TSRMLS_CC);
+  memcpy(this_id->id, id, OID_SIZE);
+  this_id->initialized = 1;
+}
+
+/*
+ * $id isn't set until something looks at the properties of the MongoId: most
+ * ids, like the _ids of query results, are never looked at that way.
+ */
+static void php_mongo_id_fill_in(zval *object TSRMLS_DC) {
+  mongo_id *id = (mongo_id*)zend_object_store_get_object(object TSRMLS_CC);
+  zval *str;
+
+  if (id->has_hex || !id->initialized || MonGlo(no_id)) {
+    return;
+  }
+  // before the update, which comes back through write_property
+  id->has_hex = 1;
+
+  MAKE_STD_ZVAL(str);
+  Z_TYPE_P(str) = IS_STRING;
+  Z_STRLEN_P(str) = 24;
+  Z_STRVAL_P(str) = (char*)emalloc(25);
+  id_to_hex(id->id, Z_STRVAL_P(str));
+
+  zend_update_property(mongo_ce_Id, object, "$id", strlen("$id"), str TSRMLS_CC);
+  zval_ptr_dtor(&str);
+}
+
+/*
+ * The property handlers of MongoId fill in $id, then do what they always do.
+ * The key argument was added in PHP 5.4.
+ */
+#if ZEND_MODULE_API_NO >= 20100525
+# define MONGO_PROPERTY_KEY_DC , const zend_literal *key
+# define MONGO_PROPERTY_KEY_CC , key
+#else
+# define MONGO_PROPERTY_KEY_DC
+# define MONGO_PROPERTY_KEY_CC
+#endif
+
+static zval* id_read_property(zval *object, zval *member, int type MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  return zend_get_std_object_handlers()->read_property(object, member, type MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+
+static void id_write_property(zval *object, zval *member, zval *value MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  zend_get_std_object_handlers()->write_property(object, member, value MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+
+#if ZEND_MODULE_API_NO >= 20121212
+static zval** id_get_property_ptr_ptr(zval *object, zval *member, int type MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  return zend_get_std_object_handlers()->get_property_ptr_ptr(object, member, type MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+#else
+static zval** id_get_property_ptr_ptr(zval *object, zval *member MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  return zend_get_std_object_handlers()->get_property_ptr_ptr(object, member MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+#endif
+
+static int id_has_property(zval *object, zval *member, int has_set_exists MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  return zend_get_std_object_handlers()->has_property(object, member, has_set_exists MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+
+static void id_unset_property(zval *object, zval *member MONGO_PROPERTY_KEY_DC TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  zend_get_std_object_handlers()->unset_property(object, member MONGO_PROPERTY_KEY_CC TSRMLS_CC);
+}
+
+static HashTable* id_get_properties(zval *object TSRMLS_DC) {
+  php_mongo_id_fill_in(object TSRMLS_CC);
+  return zend_get_std_object_handlers()->get_properties(object TSRMLS_CC);
+}
+
+void php_mongo_id_handlers(zend_object_handlers *handlers) {
+  handlers->compare_objects = php_mongo_compare_ids;
+  handlers->read_property = id_read_property;
+  handlers->write_property = id_write_property;
+  handlers->get_property_ptr_ptr = id_get_property_ptr_ptr;
+  handlers->has_property = id_has_property;
+  handlers->unset_property = id_unset_property;
+  handlers->get_properties = id_get_properties;
+}
+
 static zend_object_value php_mongo_id_new(zend_class_entry *class_type TSRMLS_DC) {
   zend_object_value retval;
   mongo_id *intern;
@@ -197,6 +310,7 @@ static zend_function_entry MongoId_methods[] = {
 
 void mongo_init_MongoId(TSRMLS_D) {
   zend_class_entry id;
+  int i;
   INIT_CLASS_ENTRY(id, "MongoId", MongoId_methods);
 
   id.create_object = php_mongo_id_new;
@@ -208,41 +322,36 @@ void mongo_init_MongoId(TSRMLS_D) {
   if (!MonGlo(no_id)) {
     zend_declare_property_null(mongo_ce_Id, "$id", strlen("$id"), ZEND_ACC_PUBLIC TSRMLS_CC);
   }
+
+  for (i = 0; i < 256; i++) {
+    hex_values[i] = (char)i;
+  }
+  for (i = 0; i < 10; i++) {
+    hex_values['0' + i] = i;
+  }
+  for (i = 0; i < 6; i++) {
+    hex_values['a' + i] = hex_values['A' + i] = 10 + i;
+  }
 }
 
 /* {{{ MongoId::__construct()
  */
 PHP_METHOD(MongoId, __construct) {
-  zval *id = 0, *str = 0;
+  zval *id = 0;
   mongo_id *this_id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z", &id) == FAILURE) {
     return;
   }
-  if (!this_id->id) {
-      this_id->id = (char*)emalloc(OID_SIZE+1);
-      this_id->id[OID_SIZE] = '\0';
-  }
 
   if (id &&
       Z_TYPE_P(id) == IS_STRING &&
       Z_STRLEN_P(id) == 24) {
+    unsigned char *hex = (unsigned char*)Z_STRVAL_P(id);
     int i;
-    for(i=0;i<12;i++) {
-      char digit1 = Z_STRVAL_P(id)[i*2], digit2 = Z_STRVAL_P(id)[i*2+1];
-      digit1 = digit1 >= 'a' && digit1 <= 'f' ? digit1 - 87 : digit1;
-      digit1 = digit1 >= 'A' && digit1 <= 'F' ? digit1 - 55 : digit1;
-      digit1 = digit1 >= '0' && digit1 <= '9' ? digit1 - 48 : digit1;
 
-      digit2 = digit2 >= 'a' && digit2 <= 'f' ? digit2 - 87 : digit2;
-      digit2 = digit2 >= 'A' && digit2 <= 'F' ? digit2 - 55 : digit2;
-      digit2 = digit2 >= '0' && digit2 <= '9' ? digit2 - 48 : digit2;
-
-      this_id->id[i] = digit1*16+digit2;
-    }
-
-    if (!MonGlo(no_id)) {
-      zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), id TSRMLS_CC);
+    for(i=0;i<12;i++) {
+      this_id->id[i] = hex_values[hex[i*2]]*16 + hex_values[hex[i*2+1]];
     }
   }
   else if (id &&
@@ -250,24 +359,15 @@ PHP_METHOD(MongoId, __construct) {
            Z_OBJCE_P(id) == mongo_ce_Id) {
     mongo_id *that_id = (mongo_id*)zend_object_store_get_object(id TSRMLS_CC);
     memcpy(this_id->id, that_id->id, OID_SIZE);
-
-    if (!MonGlo(no_id)) {
-      zval *str = zend_read_property(mongo_ce_Id, id, "$id", strlen("$id"), NOISY TSRMLS_CC);
-      zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), str TSRMLS_CC);
-    }
   }
   else {
     generate_id(this_id->id TSRMLS_CC);
+  }
 
-    if (!MonGlo(no_id)) {
-      MAKE_STD_ZVAL(str);
-      ZVAL_NULL(str);
+  this_id->initialized = 1;
 
-      MONGO_METHOD(MongoId, __toString, str, getThis());
-      zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), str TSRMLS_CC);
-      zval_ptr_dtor(&str);
-    }
-  }
+  // (re)set $id from the new value the next time it's looked at
+  this_id->has_hex = 0;
 }
 /* }}} */
 
@@ -275,38 +375,16 @@ PHP_METHOD(MongoId, __construct) {
 /* {{{ MongoId::__toString()
  */
 PHP_METHOD(MongoId, __toString) {
-  int i;
   mongo_id *this_id;
-  char *id_str, *movable;
   char *id;
 
   this_id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  MONGO_CHECK_INITIALIZED_STRING(this_id->id, MongoId);
+  MONGO_CHECK_INITIALIZED_STRING(this_id->initialized, MongoId);
 
   id = (char*)emalloc(25);
-  id_str = this_id->id;
-
-  movable = id;
-  for(i=0; i<12; i++) {
-    int x = *id_str;
-    char digit1, digit2;
-
-    if (*id_str < 0) {
-      x = 256 + *id_str;
-    }
-
-    digit1 = x / 16;
-    digit2 = x % 16;
-
-    id[2*i]   = (digit1 < 10) ? '0' + digit1 : digit1 - 10 + 'a';
-    id[2*i+1] = (digit2 < 10) ? '0' + digit2 : digit2 - 10 + 'a';
+  id_to_hex(this_id->id, id);
 
-    id_str++;
-  }
-
-  id[24] = '\0';
-
-  RETURN_STRING(id, NO_DUP);
+  RETURN_STRINGL(id, 24, NO_DUP);
 }
 /* }}} */
 
@@ -333,7 +411,7 @@ PHP_METHOD(MongoId, __set_state) {
 PHP_METHOD(MongoId, getTimestamp) {
   int ts = 0, i;
   mongo_id *id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  MONGO_CHECK_INITIALIZED_STRING(id->id, MongoId);
+  MONGO_CHECK_INITIALIZED_STRING(id->initialized, MongoId);
 
   for (i=0; i<4; i++) {
     int x = ((int)id->id[i] < 0) ? 256+id->id[i] : id->id[i];
@@ -349,7 +427,7 @@ PHP_METHOD(MongoId, getTimestamp) {
 PHP_METHOD(MongoId, getPID) {
   int pid = 0, i;
   mongo_id *id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  MONGO_CHECK_INITIALIZED_STRING(id->id, MongoId);
+  MONGO_CHECK_INITIALIZED_STRING(id->initialized, MongoId);
 
   for (i=8; i>6; i--) {
     int x = ((int)id->id[i] < 0) ? 256+id->id[i] : id->id[i];
@@ -364,7 +442,7 @@ PHP_METHOD(MongoId, getInc) {
   int inc = 0;
   char *ptr = (char*)&inc;
   mongo_id *id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  MONGO_CHECK_INITIALIZED_STRING(id->id, MongoId);
+  MONGO_CHECK_INITIALIZED_STRING(id->initialized, MongoId);
 
   // 11, 10, 9, '\0'
   ptr[0] = id->id[11];
@@ -907,3 +985,519 @@ void mongo_init_MongoInt64(TSRMLS_D) {
 
   zend_declare_property_string(mongo_ce_Int64, "value", strlen("value"), "", ZEND_ACC_PUBLIC TSRMLS_CC);
 }
+
+
+
+/* {{{ MongoRawBSON::__construct(string)
+ *
+ * Takes a document that is already BSON (e.g., from bson_encode or a cache) so
+ * it can be inserted, used as a query, etc. without being decoded first.  The
+ * bytes are checked to be a well-formed document once, here.
+ */
+PHP_METHOD(MongoRawBSON, __construct) {
+  char *bson;
+  int bson_len;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &bson, &bson_len) == FAILURE) {
+    return;
+  }
+
+  if (php_mongo_validate_bson(bson, bson_len) == FAILURE) {
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+    return;
+  }
+
+  zend_update_property_stringl(mongo_ce_RawBSON, getThis(), "bson", strlen("bson"), bson, bson_len TSRMLS_CC);
+}
+/* }}} */
+
+
+/* {{{ MongoRawBSON::__toString()
+ */
+PHP_METHOD(MongoRawBSON, __toString) {
+  zval *bson = zend_read_property(mongo_ce_RawBSON, getThis(), "bson", strlen("bson"), NOISY TSRMLS_CC);
+
+  if (Z_TYPE_P(bson) != IS_STRING) {
+    RETURN_EMPTY_STRING();
+  }
+  RETURN_STRINGL(Z_STRVAL_P(bson), Z_STRLEN_P(bson), 1);
+}
+/* }}} */
+
+
+static zend_function_entry MongoRawBSON_methods[] = {
+  PHP_ME(MongoRawBSON, __construct, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoRawBSON, __toString, NULL, ZEND_ACC_PUBLIC )
+  { NULL, NULL, NULL }
+};
+
+void mongo_init_MongoRawBSON(TSRMLS_D) {
+  zend_class_entry ce;
+  INIT_CLASS_ENTRY(ce, "MongoRawBSON", MongoRawBSON_methods);
+  mongo_ce_RawBSON = zend_register_internal_class(&ce TSRMLS_CC);
+  // the bytes are only checked by the constructor
+  mongo_ce_RawBSON->ce_flags |= ZEND_ACC_FINAL_CLASS;
+
+  zend_declare_property_stringl(mongo_ce_RawBSON, "bson", strlen("bson"), "\x05\0\0\0\0", 5, ZEND_ACC_PROTECTED TSRMLS_CC);
+}
+
+
+
+/* {{{ MongoQueryTemplate::__construct(array)
+ *
+ * Takes a query with the string "?" in place of each value that changes, e.g.
+ * array("user_id" => "?", "status" => array('$in' => "?")).  The query is
+ * turned into BSON once and kept for later requests, bind() only has to fill
+ * in the values.
+ */
+PHP_METHOD(MongoQueryTemplate, __construct) {
+  zval *shape;
+  mongo_query_template *query;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &shape) == FAILURE) {
+    return;
+  }
+
+  query = (mongo_query_template*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  if (query->compiled) {
+    php_mongo_template_free(query->compiled);
+  }
+  query->compiled = php_mongo_template_get(Z_ARRVAL_P(shape) TSRMLS_CC);
+}
+/* }}} */
+
+
+/* {{{ MongoQueryTemplate::bind(array)
+ *
+ * Returns the query as a MongoRawBSON, with the values given replacing the
+ * "?"s in order.
+ */
+PHP_METHOD(MongoQueryTemplate, bind) {
+  zval *params;
+  mongo_query_template *query;
+  buffer buf;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &params) == FAILURE) {
+    return;
+  }
+
+  query = (mongo_query_template*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(query->compiled, MongoQueryTemplate);
+
+  CREATE_BUF(buf, query->compiled->len + INITIAL_BUF_SIZE);
+  if (php_mongo_template_bind(&buf, query->compiled, Z_ARRVAL_P(params) TSRMLS_CC) == FAILURE) {
+    efree(buf.start);
+    return;
+  }
+
+  object_init_ex(return_value, mongo_ce_RawBSON);
+  zend_update_property_stringl(mongo_ce_RawBSON, return_value, "bson", strlen("bson"), buf.start, buf.pos - buf.start TSRMLS_CC);
+  efree(buf.start);
+}
+/* }}} */
+
+
+static void php_mongo_query_template_free(void *object TSRMLS_DC) {
+  mongo_query_template *query = (mongo_query_template*)object;
+
+  if (query) {
+    if (query->compiled) {
+      php_mongo_template_free(query->compiled);
+    }
+    zend_object_std_dtor(&query->std TSRMLS_CC);
+    efree(query);
+  }
+}
+
+static zend_object_value php_mongo_query_template_new(zend_class_entry *class_type TSRMLS_DC) {
+  php_mongo_obj_new(mongo_query_template);
+}
+
+static zend_function_entry MongoQueryTemplate_methods[] = {
+  PHP_ME(MongoQueryTemplate, __construct, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoQueryTemplate, bind, NULL, ZEND_ACC_PUBLIC )
+  { NULL, NULL, NULL }
+};
+
+void mongo_init_MongoQueryTemplate(TSRMLS_D) {
+  zend_class_entry ce;
+  INIT_CLASS_ENTRY(ce, "MongoQueryTemplate", MongoQueryTemplate_methods);
+  ce.create_object = php_mongo_query_template_new;
+  mongo_ce_QueryTemplate = zend_register_internal_class(&ce TSRMLS_CC);
+}
+
+
+
+/*
+ * MongoLazyDocument is a read-only view of a document in a cursor's reply.
+ * Fields are decoded the first time they're read, the offsets of the fields
+ * are found on the first lookup by name.
+ */
+
+// offset of the document's trailing \0
+static int lazy_document_end(mongo_lazy_document *lazy) {
+  int len;
+
+  memcpy(&len, lazy->doc, INT_32);
+  return MONGO_32(len) - 1;
+}
+
+// offset of the field after the one at at, or FAILURE if that one is malformed
+static int lazy_document_next(mongo_lazy_document *lazy, int at) {
+  char *end = lazy->doc + lazy_document_end(lazy), *name = lazy->doc + at + 1, *name_end;
+  int size;
+
+  if ((name_end = memchr(name, '\0', end - name)) == 0 ||
+      (size = php_mongo_bson_value_size(lazy->doc[at], name_end + 1, end)) < 0) {
+    return FAILURE;
+  }
+
+  return name_end + 1 + size - lazy->doc;
+}
+
+static int lazy_document_index(mongo_lazy_document *lazy TSRMLS_DC) {
+  int at = INT_32, end;
+
+  if (lazy->index) {
+    return SUCCESS;
+  }
+
+  ALLOC_HASHTABLE(lazy->index);
+  zend_hash_init(lazy->index, 16, NULL, NULL, 0);
+
+  end = lazy_document_end(lazy);
+  while (at < end) {
+    int next = lazy_document_next(lazy, at);
+
+    if (next == FAILURE) {
+      zend_hash_destroy(lazy->index);
+      FREE_HASHTABLE(lazy->index);
+      lazy->index = 0;
+
+      zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+      return FAILURE;
+    }
+
+    // like bson_to_zval, the last of duplicate names wins
+    zend_symtable_update(lazy->index, lazy->doc + at + 1, strlen(lazy->doc + at + 1) + 1, &at, sizeof(int), NULL);
+    at = next;
+  }
+
+  return SUCCESS;
+}
+
+/*
+ * The value of the (well-formed) field at at, decoded once.
+ */
+static zval** lazy_document_value(mongo_lazy_document *lazy, int at TSRMLS_DC) {
+  char *name = lazy->doc + at + 1;
+  zval **found, *value;
+
+  if (!lazy->values) {
+    ALLOC_HASHTABLE(lazy->values);
+    zend_hash_init(lazy->values, 8, NULL, ZVAL_PTR_DTOR, 0);
+  }
+  else if (zend_hash_index_find(lazy->values, at, (void**)&found) == SUCCESS) {
+    return found;
+  }
+
+  MAKE_STD_ZVAL(value);
+  ZVAL_NULL(value);
+
+  if (php_mongo_bson_to_value(lazy->doc[at], name, name + strlen(name) + 1, lazy->doc, value, lazy->types TSRMLS_CC) == 0) {
+    zval_ptr_dtor(&value);
+    return 0;
+  }
+
+  zend_hash_index_update(lazy->values, at, &value, sizeof(zval*), (void**)&found);
+  return found;
+}
+
+// field lookup for ArrayAccess, where offsets can be of any type
+static int* lazy_document_offset(mongo_lazy_document *lazy, zval *offset TSRMLS_DC) {
+  zval key;
+  int *at;
+
+  if (lazy_document_index(lazy TSRMLS_CC) == FAILURE) {
+    return 0;
+  }
+
+  key = *offset;
+  zval_copy_ctor(&key);
+  convert_to_string(&key);
+
+  if (zend_symtable_find(lazy->index, Z_STRVAL(key), Z_STRLEN(key) + 1, (void**)&at) == FAILURE) {
+    at = 0;
+  }
+
+  zval_dtor(&key);
+  return at;
+}
+
+char* php_mongo_lazy_document_init(zval *doc, mongo_reply *reply, char *buf, char *end, int types TSRMLS_DC) {
+  mongo_lazy_document *lazy;
+  int len = 0;
+
+  if (end - buf >= INT_32) {
+    memcpy(&len, buf, INT_32);
+    len = MONGO_32(len);
+  }
+
+  if (len < INT_32 + BYTE_8 || len > end - buf || buf[len - 1] != '\0') {
+    ZVAL_NULL(doc);
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+    return 0;
+  }
+
+  object_init_ex(doc, mongo_ce_LazyDocument);
+  lazy = (mongo_lazy_document*)zend_object_store_get_object(doc TSRMLS_CC);
+
+  lazy->reply = reply;
+  reply->refcount++;
+  lazy->doc = buf;
+  lazy->at = INT_32;
+  lazy->types = types;
+
+  return buf + len;
+}
+
+zval** php_mongo_lazy_document_find(zval *doc, char *name, int name_len TSRMLS_DC) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(doc TSRMLS_CC);
+  int *at;
+
+  if (lazy_document_index(lazy TSRMLS_CC) == FAILURE ||
+      zend_symtable_find(lazy->index, name, name_len + 1, (void**)&at) == FAILURE) {
+    return 0;
+  }
+
+  return lazy_document_value(lazy, *at TSRMLS_CC);
+}
+
+int php_mongo_lazy_document_is_error(zval *doc TSRMLS_DC) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(doc TSRMLS_CC);
+  int *at;
+
+  if (lazy_document_index(lazy TSRMLS_CC) == FAILURE) {
+    return 0;
+  }
+
+  return zend_hash_exists(lazy->index, "$err", strlen("$err") + 1) ||
+    (zend_hash_find(lazy->index, "err", strlen("err") + 1, (void**)&at) == SUCCESS &&
+     lazy->doc[*at] == BSON_STRING);
+}
+
+
+/* {{{ MongoLazyDocument::offsetExists(mixed)
+ */
+PHP_METHOD(MongoLazyDocument, offsetExists) {
+  zval *offset;
+  mongo_lazy_document *lazy;
+  int *at;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &offset) == FAILURE) {
+    return;
+  }
+
+  lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  // as isset() on an array, null fields don't count
+  at = lazy_document_offset(lazy, offset TSRMLS_CC);
+  RETURN_BOOL(at && lazy->doc[*at] != BSON_NULL && lazy->doc[*at] != BSON_UNDEF);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::offsetGet(mixed)
+ */
+PHP_METHOD(MongoLazyDocument, offsetGet) {
+  zval *offset, **value;
+  mongo_lazy_document *lazy;
+  int *at;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &offset) == FAILURE) {
+    return;
+  }
+
+  lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  if ((at = lazy_document_offset(lazy, offset TSRMLS_CC)) == 0 ||
+      (value = lazy_document_value(lazy, *at TSRMLS_CC)) == 0) {
+    return;
+  }
+
+  RETURN_ZVAL(*value, 1, 0);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::offsetSet(mixed, mixed)
+ */
+PHP_METHOD(MongoLazyDocument, offsetSet) {
+  zend_throw_exception(mongo_ce_Exception, "MongoLazyDocument is read-only, use toArray() to get a copy that can be changed", 22 TSRMLS_CC);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::offsetUnset(mixed)
+ */
+PHP_METHOD(MongoLazyDocument, offsetUnset) {
+  zend_throw_exception(mongo_ce_Exception, "MongoLazyDocument is read-only, use toArray() to get a copy that can be changed", 22 TSRMLS_CC);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::rewind()
+ */
+PHP_METHOD(MongoLazyDocument, rewind) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  lazy->at = INT_32;
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::valid()
+ */
+PHP_METHOD(MongoLazyDocument, valid) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  if (lazy->at >= lazy_document_end(lazy)) {
+    RETURN_FALSE;
+  }
+
+  // the field has to be well-formed before current() looks at it
+  if (lazy_document_next(lazy, lazy->at) == FAILURE) {
+    lazy->at = lazy_document_end(lazy);
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+    RETURN_FALSE;
+  }
+
+  RETURN_TRUE;
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::current()
+ */
+PHP_METHOD(MongoLazyDocument, current) {
+  zval **value;
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  if (lazy->at >= lazy_document_end(lazy) ||
+      lazy_document_next(lazy, lazy->at) == FAILURE ||
+      (value = lazy_document_value(lazy, lazy->at TSRMLS_CC)) == 0) {
+    RETURN_NULL();
+  }
+
+  RETURN_ZVAL(*value, 1, 0);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::key()
+ */
+PHP_METHOD(MongoLazyDocument, key) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  if (lazy->at >= lazy_document_end(lazy)) {
+    RETURN_NULL();
+  }
+
+  RETURN_STRING(lazy->doc + lazy->at + 1, 1);
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::next()
+ */
+PHP_METHOD(MongoLazyDocument, next) {
+  int next;
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  if (lazy->at >= lazy_document_end(lazy)) {
+    return;
+  }
+
+  next = lazy_document_next(lazy, lazy->at);
+  lazy->at = next == FAILURE ? lazy_document_end(lazy) : next;
+}
+/* }}} */
+
+
+/* {{{ MongoLazyDocument::toArray()
+ *
+ * Decodes the whole document, as a non-lazy cursor would have.
+ */
+PHP_METHOD(MongoLazyDocument, toArray) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  MONGO_CHECK_INITIALIZED(lazy->doc, MongoLazyDocument);
+
+  array_init(return_value);
+  php_mongo_bson_to_zval_ex(lazy->doc, Z_ARRVAL_P(return_value), 0, 0, lazy->types TSRMLS_CC);
+}
+/* }}} */
+
+
+static void php_mongo_lazy_document_free(void *object TSRMLS_DC) {
+  mongo_lazy_document *lazy = (mongo_lazy_document*)object;
+
+  if (lazy) {
+    if (lazy->index) {
+      zend_hash_destroy(lazy->index);
+      FREE_HASHTABLE(lazy->index);
+    }
+    if (lazy->values) {
+      zend_hash_destroy(lazy->values);
+      FREE_HASHTABLE(lazy->values);
+    }
+    if (lazy->reply) {
+      mongo_util_reply_release(lazy->reply);
+    }
+    zend_object_std_dtor(&lazy->std TSRMLS_CC);
+    efree(lazy);
+  }
+}
+
+static zend_object_value php_mongo_lazy_document_new(zend_class_entry *class_type TSRMLS_DC) {
+  php_mongo_obj_new(mongo_lazy_document);
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_lazy_offset, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_lazy_offset_set, 0, ZEND_RETURN_VALUE, 2)
+	ZEND_ARG_INFO(0, offset)
+	ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoLazyDocument_methods[] = {
+  PHP_ME(MongoLazyDocument, offsetExists, arginfo_lazy_offset, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, offsetGet, arginfo_lazy_offset, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, offsetSet, arginfo_lazy_offset_set, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, offsetUnset, arginfo_lazy_offset, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, rewind, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, valid, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, current, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, key, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, next, NULL, ZEND_ACC_PUBLIC )
+  PHP_ME(MongoLazyDocument, toArray, NULL, ZEND_ACC_PUBLIC )
+  { NULL, NULL, NULL }
+};
+
+void mongo_init_MongoLazyDocument(TSRMLS_D) {
+  zend_class_entry ce;
+  INIT_CLASS_ENTRY(ce, "MongoLazyDocument", MongoLazyDocument_methods);
+  ce.create_object = php_mongo_lazy_document_new;
+  mongo_ce_LazyDocument = zend_register_internal_class(&ce TSRMLS_CC);
+  // only cursors make them
+  mongo_ce_LazyDocument->ce_flags |= ZEND_ACC_FINAL_CLASS;
+  zend_class_implements(mongo_ce_LazyDocument TSRMLS_CC, 2, zend_ce_arrayaccess, zend_ce_iterator);
+}
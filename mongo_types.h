@@ -47,10 +47,57 @@ PHP_METHOD(MongoInt32, __toString);
 PHP_METHOD(MongoInt64, __construct);
 PHP_METHOD(MongoInt64, __toString);
 
+PHP_METHOD(MongoRawBSON, __construct);
+PHP_METHOD(MongoRawBSON, __toString);
+
+PHP_METHOD(MongoQueryTemplate, __construct);
+PHP_METHOD(MongoQueryTemplate, bind);
+
+PHP_METHOD(MongoLazyDocument, offsetExists);
+PHP_METHOD(MongoLazyDocument, offsetGet);
+PHP_METHOD(MongoLazyDocument, offsetSet);
+PHP_METHOD(MongoLazyDocument, offsetUnset);
+PHP_METHOD(MongoLazyDocument, rewind);
+PHP_METHOD(MongoLazyDocument, valid);
+PHP_METHOD(MongoLazyDocument, current);
+PHP_METHOD(MongoLazyDocument, key);
+PHP_METHOD(MongoLazyDocument, next);
+PHP_METHOD(MongoLazyDocument, toArray);
+
+/*
+ * Makes doc a MongoLazyDocument for the document at buf, which is in reply and
+ * must end before end.  Its fields are decoded according to types, see
+ * MONGO_TYPE_*.  Returns the position after the document, or 0 with an
+ * exception thrown.
+ */
+char* php_mongo_lazy_document_init(zval *doc, mongo_reply *reply, char *buf, char *end, int types TSRMLS_DC);
+
+/*
+ * Returns the decoded value of the field name (name_len bytes, without the
+ * \0) of a MongoLazyDocument, or 0 if it doesn't have one.
+ */
+zval** php_mongo_lazy_document_find(zval *doc, char *name, int name_len TSRMLS_DC);
+
+/*
+ * If a MongoLazyDocument is an error reply ($err, or err set to a string).
+ */
+int php_mongo_lazy_document_is_error(zval *doc TSRMLS_DC);
+
 int php_mongo_id_serialize(zval*, unsigned char**, zend_uint*, zend_serialize_data* TSRMLS_DC);
 int php_mongo_id_unserialize(zval**, zend_class_entry*, const unsigned char*, zend_uint, zend_unserialize_data* TSRMLS_DC);
 int php_mongo_compare_ids(zval*, zval* TSRMLS_DC);
 
+/*
+ * Sets up value as a MongoId for the 12 bytes at id.
+ */
+void php_mongo_id_init(zval *value, char *id TSRMLS_DC);
+
+/*
+ * MongoId's object handlers: comparison, and the property handlers that fill
+ * in $id the first time it's needed.
+ */
+void php_mongo_id_handlers(zend_object_handlers *handlers);
+
 PHP_METHOD(MongoRegex, __construct);
 PHP_METHOD(MongoRegex, __toString);
 
@@ -30,6 +30,7 @@
 #include "mongo.h"
 #include "cursor.h"
 #include "mongo_types.h"
+#include "bson.h"
 
 #include "util/pool.h"
 #include "util/server.h"
@@ -53,7 +54,8 @@ zend_class_entry *mongo_ce_ConnectionException,
 int le_pconnection,
   le_pserver,
   le_prs,
-  le_cursor_list;
+  le_cursor_list,
+  le_ptemplate;
 
 static void mongo_init_MongoExceptions(TSRMLS_D);
 
@@ -69,13 +71,14 @@ static void mongo_init_globals(zend_mongo_globals* g TSRMLS_DC);
 
 #if WIN32
 extern HANDLE cursor_mutex;
-extern HANDLE io_mutex;
 extern HANDLE pool_mutex;
 #endif
 
 zend_function_entry mongo_functions[] = {
   PHP_FE(bson_encode, NULL)
   PHP_FE(bson_decode, NULL)
+  PHP_FE(bson_to_json, NULL)
+  PHP_FE(json_to_bson, NULL)
   { NULL, NULL, NULL }
 };
 
@@ -90,7 +93,7 @@ zend_module_entry mongo_module_entry = {
   PHP_MINIT(mongo),
   PHP_MSHUTDOWN(mongo),
   PHP_RINIT(mongo),
-  NULL,
+  PHP_RSHUTDOWN(mongo),
   PHP_MINFO(mongo),
   PHP_MONGO_VERSION,
 #if ZEND_MODULE_API_NO >= 20060613
@@ -110,6 +113,50 @@ ZEND_GET_MODULE(mongo)
 #endif
 
 
+/*
+ * The settings the encoder depends on rebind it (see php_mongo_bind_encoder)
+ * after they're updated.
+ */
+static void bind_encoder(void *mh_arg2) {
+#ifndef ZTS
+  php_mongo_bind_encoder((zend_mongo_globals*)mh_arg2);
+#else
+  php_mongo_bind_encoder((zend_mongo_globals*)ts_resource(*((int*)mh_arg2)));
+#endif
+}
+
+static PHP_INI_MH(OnUpdateEncoderLong) {
+  int retval = OnUpdateLong(entry, new_value, new_value_length, mh_arg1, mh_arg2, mh_arg3, stage TSRMLS_CC);
+
+  bind_encoder(mh_arg2);
+  return retval;
+}
+
+static PHP_INI_MH(OnUpdateTypeMap) {
+  int types = 0;
+  zend_mongo_globals *g;
+
+  if (php_mongo_type_map_parse(new_value, &types) == FAILURE) {
+    return FAILURE;
+  }
+
+#ifndef ZTS
+  g = (zend_mongo_globals*)mh_arg2;
+#else
+  g = (zend_mongo_globals*)ts_resource(*((int*)mh_arg2));
+#endif
+  g->types = types;
+
+  return OnUpdateString(entry, new_value, new_value_length, mh_arg1, mh_arg2, mh_arg3, stage TSRMLS_CC);
+}
+
+static PHP_INI_MH(OnUpdateEncoderString) {
+  int retval = OnUpdateStringUnempty(entry, new_value, new_value_length, mh_arg1, mh_arg2, mh_arg3, stage TSRMLS_CC);
+
+  bind_encoder(mh_arg2);
+  return retval;
+}
+
 /* {{{ PHP_INI */
 // these must be in the same order as mongo_globals are declared or it will segfault on 64-bit machines!
 PHP_INI_BEGIN()
@@ -117,14 +164,17 @@ STD_PHP_INI_ENTRY("mongo.allow_persistent", "1", PHP_INI_ALL, OnUpdateLong, allo
 STD_PHP_INI_ENTRY("mongo.default_host", "localhost", PHP_INI_ALL, OnUpdateString, default_host, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.default_port", "27017", PHP_INI_ALL, OnUpdateLong, default_port, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.chunk_size", "262144", PHP_INI_ALL, OnUpdateLong, chunk_size, zend_mongo_globals, mongo_globals)
-STD_PHP_INI_ENTRY("mongo.cmd", "$", PHP_INI_ALL, OnUpdateStringUnempty, cmd_char, zend_mongo_globals, mongo_globals)
-STD_PHP_INI_ENTRY("mongo.utf8", "1", PHP_INI_ALL, OnUpdateLong, utf8, zend_mongo_globals, mongo_globals)
-STD_PHP_INI_ENTRY("mongo.native_long", "0", PHP_INI_ALL, OnUpdateLong, native_long, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.cmd", "$", PHP_INI_ALL, OnUpdateEncoderString, cmd_char, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.utf8", "1", PHP_INI_ALL, OnUpdateEncoderLong, utf8, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.native_long", "0", PHP_INI_ALL, OnUpdateEncoderLong, native_long, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.long_as_object", "0", PHP_INI_ALL, OnUpdateLong, long_as_object, zend_mongo_globals, mongo_globals)
-STD_PHP_INI_ENTRY("mongo.allow_empty_keys", "0", PHP_INI_ALL, OnUpdateLong, allow_empty_keys, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.allow_empty_keys", "0", PHP_INI_ALL, OnUpdateEncoderLong, allow_empty_keys, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.no_id", "0", PHP_INI_SYSTEM, OnUpdateLong, no_id, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.ping_interval", "5", PHP_INI_ALL, OnUpdateLong, ping_interval, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.is_master_interval", "60", PHP_INI_ALL, OnUpdateLong, is_master_interval, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.send_buffer_max", "4194304", PHP_INI_ALL, OnUpdateLong, send_buffer_max, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.zero_copy_threshold", "65536", PHP_INI_ALL, OnUpdateLong, zero_copy_threshold, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.type_map", "", PHP_INI_ALL, OnUpdateTypeMap, type_map, zend_mongo_globals, mongo_globals)
 
 #ifdef HAVE_MONGO_SESSION
 STD_PHP_INI_ENTRY("mongo.session_url", "mongodb://localhost:27017", PHP_INI_ALL, OnUpdateString, session_url, zend_mongo_globals, mongo_globals)
@@ -153,6 +203,7 @@ PHP_MINIT_FUNCTION(mongo) {
   le_pserver = zend_register_list_destructors_ex(NULL, mongo_util_server_shutdown, PHP_SERVER_RES_NAME, module_number);
   le_prs = zend_register_list_destructors_ex(NULL, mongo_util_rs_shutdown, PHP_RS_RES_NAME, module_number);
   le_cursor_list = zend_register_list_destructors_ex(NULL, php_mongo_cursor_list_pfree, PHP_CURSOR_LIST_RES_NAME, module_number);
+  le_ptemplate = zend_register_list_destructors_ex(NULL, php_mongo_template_pfree, PHP_TEMPLATE_RES_NAME, module_number);
 
   mongo_init_Mongo(TSRMLS_C);
   mongo_init_MongoDB(TSRMLS_C);
@@ -175,10 +226,15 @@ PHP_MINIT_FUNCTION(mongo) {
   mongo_init_MongoTimestamp(TSRMLS_C);
   mongo_init_MongoInt32(TSRMLS_C);
   mongo_init_MongoInt64(TSRMLS_C);
+  mongo_init_MongoRawBSON(TSRMLS_C);
+  mongo_init_MongoQueryTemplate(TSRMLS_C);
+  mongo_init_MongoLazyDocument(TSRMLS_C);
 
   mongo_init_MongoLog(TSRMLS_C);
   mongo_init_MongoPool(TSRMLS_C);
 
+  php_mongo_init_index_keys();
+
   /*
    * MongoMaxKey and MongoMinKey are completely non-interactive: they have no
    * method, fields, or constants.
@@ -193,9 +249,9 @@ PHP_MINIT_FUNCTION(mongo) {
   memcpy(&mongo_default_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
   mongo_default_handlers.clone_obj = NULL;
 
-  // add compare_objects for MongoId
+  // add compare_objects and a lazy $id for MongoId
   memcpy(&mongo_id_handlers, &mongo_default_handlers, sizeof(zend_object_handlers));
-  mongo_id_handlers.compare_objects = php_mongo_compare_ids;
+  php_mongo_id_handlers(&mongo_id_handlers);
 
   // start random number generator
   srand(time(0));
@@ -203,8 +259,7 @@ PHP_MINIT_FUNCTION(mongo) {
 #ifdef WIN32
   cursor_mutex = CreateMutex(NULL, FALSE, NULL);
   pool_mutex = CreateMutex(NULL, FALSE, NULL);
-  io_mutex = CreateMutex(NULL, FALSE, NULL);
-  if (cursor_mutex == NULL || pool_mutex == NULL || io_mutex == NULL) {
+  if (cursor_mutex == NULL || pool_mutex == NULL) {
     php_error_docref(NULL TSRMLS_CC, E_WARNING, "Windows couldn't create a mutex: %s", GetLastError());
     return FAILURE;
   }
@@ -243,6 +298,8 @@ static void mongo_init_globals(zend_mongo_globals *mongo_globals TSRMLS_DC)
   mongo_globals->chunk_size = DEFAULT_CHUNK_SIZE;
   mongo_globals->cmd_char = "$";
   mongo_globals->utf8 = 1;
+  mongo_globals->native_long = 0;
+  mongo_globals->allow_empty_keys = 0;
 
   mongo_globals->inc = 0;
   mongo_globals->response_num = 0;
@@ -251,6 +308,22 @@ static void mongo_init_globals(zend_mongo_globals *mongo_globals TSRMLS_DC)
   mongo_globals->max_send_size = 64 * 1024 * 1024;
   mongo_globals->pool_size = -1;
 
+  mongo_globals->send_buffer_max = 4 * 1024 * 1024;
+  mongo_globals->zero_copy_threshold = 64 * 1024;
+  mongo_globals->type_map = "";
+  mongo_globals->types = 0;
+  mongo_globals->send_buf.start = 0;
+  mongo_globals->send_buf_depth = 0;
+  mongo_globals->send_buf_reused = 0;
+  mongo_globals->send_buf_allocated = 0;
+
+  mongo_globals->shapes = 0;
+  mongo_globals->shape_depth = 0;
+
+  mongo_globals->template_count = 0;
+
+  php_mongo_bind_encoder(mongo_globals);
+
   hostname = host_start;
   // from the gnu manual:
   //     gethostname stores the beginning of the host name in name even if the
@@ -315,7 +388,7 @@ PHP_MSHUTDOWN_FUNCTION(mongo) {
 
 #if WIN32
   // 0 is failure
-  if (CloseHandle(cursor_mutex) == 0 || CloseHandle(pool_mutex) == 0 || CloseHandle(io_mutex) == 0) {
+  if (CloseHandle(cursor_mutex) == 0 || CloseHandle(pool_mutex) == 0) {
     php_error_docref(NULL TSRMLS_CC, E_WARNING, "Windows couldn't destroy a mutex: %s", GetLastError());
     return FAILURE;
   }
@@ -334,6 +407,16 @@ PHP_RINIT_FUNCTION(mongo) {
 /* }}} */
 
 
+/* {{{ PHP_RSHUTDOWN_FUNCTION
+ */
+PHP_RSHUTDOWN_FUNCTION(mongo) {
+  php_mongo_buf_shutdown(TSRMLS_C);
+  php_mongo_shapes_shutdown(TSRMLS_C);
+  return SUCCESS;
+}
+/* }}} */
+
+
 /* {{{ PHP_MINFO_FUNCTION
  */
 PHP_MINFO_FUNCTION(mongo) {
@@ -25,6 +25,7 @@
 #define PHP_CONNECTION_RES_NAME "mongo connection"
 #define PHP_SERVER_RES_NAME "mongo server info"
 #define PHP_CURSOR_LIST_RES_NAME "cursor list"
+#define PHP_TEMPLATE_RES_NAME "mongo query template"
 
 #ifdef WIN32
 #  ifndef int64_t
@@ -101,6 +102,13 @@
 # define POP_EO_PARAM() (void)zend_ptr_stack_pop(&EG(argument_stack))
 #endif
 
+// array_init_size() was added in 5.3
+#if ZEND_MODULE_API_NO >= 20090626
+# define MONGO_ARRAY_INIT_SIZE(arg, size) array_init_size(arg, size)
+#else
+# define MONGO_ARRAY_INIT_SIZE(arg, size) array_init(arg)
+#endif
+
 #if ZEND_MODULE_API_NO > 20060613
 #define MONGO_E_DEPRECATED E_DEPRECATED
 #else
@@ -210,6 +218,9 @@ typedef struct _mongo_server {
   struct _mongo_server *next;
   // list of handed-out sockets for this address
   struct _mongo_server *next_in_pool;
+
+  // requests sent ahead whose replies haven't been claimed
+  struct _mongo_pending *pending;
 } mongo_server;
 
 typedef struct _mongo_server_set {
@@ -256,10 +267,22 @@ typedef struct {
   int op;
 } mongo_msg_header;
 
+// bytes that belong in a buffer but are sent from where they are
+typedef struct {
+  // offset in the buffer the bytes go at
+  int offset;
+  char *data;
+  int len;
+} mongo_buf_ref;
+
 typedef struct {
   char *start;
   char *pos;
   char *end;
+  // strings of ref_min bytes or more are referenced, not copied (0: never)
+  int ref_min;
+  mongo_buf_ref *refs;
+  int ref_count;
 } buffer;
 
 #define CREATE_MSG_HEADER(rid, rto, opcode)     \
@@ -350,7 +373,7 @@ typedef struct {
 
 #define PHP_MONGO_SERIALIZE_KEY(type)                           \
   php_mongo_set_type(buf, type);                                \
-  php_mongo_serialize_key(buf, name, name_len, prep TSRMLS_CC); \
+  MonGlo(encoder).serialize_key[prep](buf, name, name_len TSRMLS_CC); \
   if (EG(exception)) {                                          \
     return ZEND_HASH_APPLY_STOP;                                \
   }
@@ -406,6 +429,36 @@ typedef struct {
 
 #define REPLY_HEADER_LEN 36
 
+/*
+ * The documents of a database reply.  Lazy documents point into it, so it is
+ * refcounted: the cursor drops its reference when it gets the next batch and
+ * the reply lives on until the last of its documents is gone.
+ */
+typedef struct {
+  int refcount;
+  char data[1];
+} mongo_reply;
+
+/*
+ * A request sent without waiting for its reply (see MongoCursor::send()).
+ * Replies come back in the order the requests went out, so a cursor reading
+ * its own reply may first have to read some of these: they are parked here,
+ * header and documents, until their cursors ask for them.
+ */
+typedef struct _mongo_pending {
+  int request_id;
+
+  // filled in once the reply has been read
+  mongo_msg_header recv;
+  int flag;
+  int64_t cursor_id;
+  int start;
+  int num;
+  mongo_reply *reply;
+
+  struct _mongo_pending *next;
+} mongo_pending;
+
 typedef struct {
   zend_object std;
 
@@ -437,8 +490,9 @@ typedef struct {
   int at;
   // number results returned
   int num;
-  // results
+  // results, buf.start points into reply
   buffer buf;
+  mongo_reply *reply;
 
   // cursor_id indicates if there are more results to fetch.  If cursor_id is 0,
   // the cursor is "dead."  If cursor_id != 0, server is set to the server that
@@ -450,10 +504,25 @@ typedef struct {
 
   zend_bool started_iterating;
   zend_bool persist;
+  // the query went out with send() and its reply hasn't been read yet
+  zend_bool awaiting_reply;
+  // ask for the next batch before this one is used up, from prefetch()
+  zend_bool prefetch;
+  // that request has gone out and its reply hasn't been read yet
+  zend_bool getmore_sent;
 
   zval *current;
   int retry;
 
+  // return MongoLazyDocuments instead of arrays
+  zend_bool lazy;
+  // fields to decode, from decodeFields()
+  struct _mongo_decode_filter *decode_filter;
+  // field names of the documents decoded so far
+  struct _mongo_key_cache *keys;
+  // MONGO_TYPE_* flags, from mongo.type_map and typeMap()
+  int types;
+
 } mongo_cursor;
 
 /*
@@ -477,9 +546,36 @@ typedef struct _cursor_node {
 
 typedef struct {
   zend_object std;
-  char *id;
+  char id[12];
+  // id has been set, by the constructor or the decoder
+  zend_bool initialized;
+  // the $id property has been filled in, see php_mongo_id_fill_in
+  zend_bool has_hex;
 } mongo_id;
 
+typedef struct {
+  zend_object std;
+  struct _mongo_template *compiled;
+} mongo_query_template;
+
+typedef struct {
+  zend_object std;
+
+  // the document, somewhere in reply->data
+  mongo_reply *reply;
+  char *doc;
+
+  // field name => offset of its type byte in doc, built on the first lookup
+  HashTable *index;
+  // fields decoded so far
+  HashTable *values;
+
+  // offset of the current field's type byte when iterating
+  int at;
+  // MONGO_TYPE_* flags of the cursor it came from
+  int types;
+} mongo_lazy_document;
+
 
 typedef struct {
   zend_object std;
@@ -509,12 +605,15 @@ typedef struct {
 #define CREATE_BUF(buf, size)                   \
   buf.start = (char*)emalloc(size);             \
   buf.pos = buf.start;                          \
-  buf.end = buf.start + size;
+  buf.end = buf.start + size;                   \
+  buf.ref_min = buf.ref_count = 0;              \
+  buf.refs = 0;
 
 
 PHP_MINIT_FUNCTION(mongo);
 PHP_MSHUTDOWN_FUNCTION(mongo);
 PHP_RINIT_FUNCTION(mongo);
+PHP_RSHUTDOWN_FUNCTION(mongo);
 PHP_MINFO_FUNCTION(mongo);
 
 /*
@@ -522,6 +621,8 @@ PHP_MINFO_FUNCTION(mongo);
  */
 PHP_FUNCTION(bson_encode);
 PHP_FUNCTION(bson_decode);
+PHP_FUNCTION(bson_to_json);
+PHP_FUNCTION(json_to_bson);
 
 
 /*
@@ -571,6 +672,27 @@ void mongo_init_MongoDBRef(TSRMLS_D);
 void mongo_init_MongoTimestamp(TSRMLS_D);
 void mongo_init_MongoInt32(TSRMLS_D);
 void mongo_init_MongoInt64(TSRMLS_D);
+void mongo_init_MongoRawBSON(TSRMLS_D);
+void mongo_init_MongoQueryTemplate(TSRMLS_D);
+void mongo_init_MongoLazyDocument(TSRMLS_D);
+
+/*
+ * The parts of the encoder that depend on mongo.native_long, mongo.utf8,
+ * mongo.cmd and mongo.allow_empty_keys.  php_mongo_bind_encoder picks the
+ * variants whenever one of them is set, so the per-field code doesn't check
+ * the settings.
+ */
+typedef struct {
+  // indexed by prep
+  void (*serialize_key[2])(buffer*, char*, int TSRMLS_DC);
+  // the type PHP ints are stored as and how they're written
+  char long_type;
+  void (*serialize_long)(buffer*, long);
+  // returns 1 if a string can be stored
+  int (*check_string)(const char*, int);
+  // the command character, if it isn't '$'
+  char cmd_char;
+} mongo_encoder;
 
 ZEND_BEGIN_MODULE_GLOBALS(mongo)
 // php.ini options
@@ -603,6 +725,33 @@ int pool_size;
 
 	long ping_interval;
 	long is_master_interval;
+
+// biggest send buffer kept between operations (mongo.send_buffer_max)
+long send_buffer_max;
+// strings and binary data this big are sent without being copied into the
+// send buffer (mongo.zero_copy_threshold)
+long zero_copy_threshold;
+// how cursors decode dates, longs and binary data (mongo.type_map), and that
+// parsed into MONGO_TYPE_* flags
+char *type_map;
+int types;
+// the request's send buffer, see php_mongo_buf_get
+buffer send_buf;
+int send_buf_depth;
+long send_buf_reused;
+long send_buf_allocated;
+// strings this big are left out of php_mongo_bson_size (0: none), see
+// document_size
+int size_ref_min;
+
+// class entry => mongo_shape, for the current request
+HashTable *shapes;
+int shape_depth;
+
+// query templates in the persistent list, see php_mongo_template_get
+int template_count;
+
+mongo_encoder encoder;
     
 #ifdef  HAVE_MONGO_SESSION
     char    *session_url;
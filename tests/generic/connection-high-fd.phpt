@@ -0,0 +1,54 @@
+--TEST--
+Connection: sockets with descriptors above FD_SETSIZE
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+<?php require_once dirname(__FILE__) . '/skipif_mongos.inc'; ?>
+<?php
+if (!function_exists('posix_getrlimit')) {
+    die("skip posix extension needed");
+}
+$limits = posix_getrlimit();
+if ($limits['soft openfiles'] != 'unlimited' && $limits['soft openfiles'] < 1200) {
+    die("skip needs 1200 file descriptors, try ulimit -n");
+}
+?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+// use up the descriptors below 1024 before connecting
+$files = array();
+for ($i = 0; $i < 1100; $i++) {
+    $files[] = fopen(__FILE__, 'r');
+}
+
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'high_fd');
+$coll->drop();
+
+for ($i = 0; $i < 100; $i++) {
+    $coll->insert(array('_id' => $i, 'x' => str_repeat('x', 10000)), array('safe' => true));
+}
+
+$count = 0;
+foreach ($coll->find()->batchSize(10)->timeout(5000) as $doc) {
+    $count++;
+}
+var_dump($count);
+
+try {
+    $mongo->selectDB('admin')->command(array('sleep' => true, 'secs' => 1), array('timeout' => 100));
+    echo "no timeout\n";
+} catch (MongoCursorTimeoutException $e) {
+    echo "timed out\n";
+}
+sleep(1);
+var_dump($coll->findOne(array('_id' => 50), array('_id' => 1)));
+?>
+--EXPECT--
+int(100)
+timed out
+array(1) {
+  ["_id"]=>
+  int(50)
+}
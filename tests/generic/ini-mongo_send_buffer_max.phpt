@@ -0,0 +1,49 @@
+--TEST--
+"mongo.send_buffer_max" INI option and send buffer reuse
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'send_buffer_max');
+$coll->drop();
+
+function send_buffer() {
+    return MongoPool::sendBufferInfo();
+}
+
+$before = send_buffer();
+for ($i = 0; $i < 10; $i++) {
+    $coll->insert(array('x' => str_repeat('x', 10000)));
+}
+$after = send_buffer();
+var_dump($after['reused'] - $before['reused'] >= 9);
+var_dump($after['allocated'] - $before['allocated'] <= 1);
+var_dump($after['size'] > 10000);
+
+ini_set('mongo.send_buffer_max', 0);
+$before = send_buffer();
+for ($i = 0; $i < 5; $i++) {
+    $coll->insert(array('x' => $i));
+}
+$after = send_buffer();
+var_dump($after['allocated'] - $before['allocated'] >= 4);
+var_dump($after['size']);
+var_dump($coll->count());
+
+// the connection pool info is only keyed by server
+$keyed = true;
+foreach (MongoPool::info() as $host => $info) {
+    $keyed = $keyed && isset($info['in use']);
+}
+var_dump($keyed);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(0)
+int(15)
+bool(true)
@@ -0,0 +1,64 @@
+--TEST--
+"mongo.zero_copy_threshold" INI option
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'zero_copy_threshold');
+$coll->drop();
+
+$text = str_repeat("0123456789", 20000);
+$bin = new MongoBinData(str_repeat("\0\1\2\3", 50000));
+
+foreach (array(0, 1024, 1000000) as $threshold) {
+    ini_set('mongo.zero_copy_threshold', $threshold);
+
+    $coll->insert(array('_id' => $threshold, 'text' => $text, 'bin' => $bin, 'small' => "x"), array('safe' => true));
+    $coll->batchInsert(array(
+        array('_id' => "a$threshold", 'list' => array($text, "y", $text)),
+        array('_id' => "b$threshold", 'nested' => array('bin' => $bin, 'text' => $text)),
+    ));
+    $coll->update(array('_id' => $threshold), array('$set' => array('text2' => $text)), array('safe' => true));
+
+    $doc = $coll->findOne(array('_id' => $threshold, 'text' => $text));
+    var_dump($doc['text'] === $text, $doc['bin']->bin === $bin->bin, $doc['text2'] === $text, $doc['small']);
+
+    $doc = $coll->findOne(array('_id' => "a$threshold"));
+    var_dump($doc['list'] === array($text, "y", $text));
+    $doc = $coll->findOne(array('_id' => "b$threshold"));
+    var_dump($doc['nested']['text'] === $text);
+}
+var_dump($coll->count());
+
+// referenced strings don't make the send buffer grow
+ini_set('mongo.send_buffer_max', 0);
+$coll->findOne();
+ini_set('mongo.send_buffer_max', 1000000);
+ini_set('mongo.zero_copy_threshold', 1024);
+$coll->insert(array('_id' => 'big', 'text' => $text, 'bin' => $bin), array('safe' => true));
+$info = MongoPool::sendBufferInfo();
+var_dump($info['size'] > 0 && $info['size'] < 100000);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+string(1) "x"
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+string(1) "x"
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+string(1) "x"
+bool(true)
+bool(true)
+int(9)
+bool(true)
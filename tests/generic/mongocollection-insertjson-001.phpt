@@ -0,0 +1,42 @@
+--TEST--
+MongoCollection::insertJSON() inserts a document given as JSON
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'insertjson');
+$coll->drop();
+
+var_dump($coll->insertJSON('{"_id": 1, "name": "one", "tags": ["a", "b"], "meta": {"views": 10}}'));
+$result = $coll->insertJSON('{"_id": {"$oid": "4f06e55e44670ab92b000000"}, "when": {"$date": 1325853296789}}', array('safe' => true));
+var_dump($result['ok']);
+
+echo json_encode($coll->findOne(array('_id' => 1))), "\n";
+echo json_encode($coll->findOne(array('_id' => new MongoId('4f06e55e44670ab92b000000')))), "\n";
+
+// an _id is added if there isn't one
+$coll->insertJSON('{"name": "three"}');
+$doc = $coll->findOne(array('name' => 'three'));
+var_dump($doc['_id'] instanceof MongoId);
+
+foreach (array('{"a.b": 1}', '{}', '{"a": [1,}') as $json) {
+    try {
+        $coll->insertJSON($json);
+    } catch (MongoException $e) {
+        echo $e->getCode(), " ", $e->getMessage(), "\n";
+    }
+}
+var_dump($coll->count());
+?>
+--EXPECT--
+bool(true)
+float(1)
+{"_id":1,"name":"one","tags":["a","b"],"meta":{"views":10}}
+{"_id":{"$id":"4f06e55e44670ab92b000000"},"when":{"sec":1325853296,"usec":789000}}
+bool(true)
+2 '.' not allowed in key: a.b
+4 no elements in doc
+27 invalid JSON: unexpected character at offset 9
+int(3)
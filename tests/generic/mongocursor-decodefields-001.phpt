@@ -0,0 +1,39 @@
+--TEST--
+MongoCursor::decodeFields() only decodes the fields asked for
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'decodefields');
+$coll->drop();
+
+$coll->insert(array('_id' => 1, 'name' => "one", 'body' => "long text",
+                    'meta' => array('author' => "me", 'tags' => array('a', 'b'), 'views' => 10),
+                    'count' => 5));
+
+function fetch($coll, $fields) {
+    echo json_encode($coll->find()->decodeFields($fields)->getNext()), "\n";
+}
+
+fetch($coll, array('name' => 1, 'meta.author' => 1));
+fetch($coll, array('name', 'meta.tags.1'));
+fetch($coll, array('body' => 0, 'meta.tags' => 0));
+// a whole field covers the fields below it
+fetch($coll, array('meta.views' => 1, 'meta' => 1, 'count.x' => 1));
+fetch($coll, array());
+
+try {
+    $coll->find()->decodeFields(array('name' => 1, 'body' => 0));
+} catch (MongoException $e) {
+    echo $e->getCode(), " ", $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+{"name":"one","meta":{"author":"me"}}
+{"name":"one","meta":{"tags":{"1":"b"}}}
+{"_id":1,"name":"one","meta":{"author":"me","views":10},"count":5}
+{"meta":{"author":"me","tags":["a","b"],"views":10}}
+{"_id":1,"name":"one","body":"long text","meta":{"author":"me","tags":["a","b"],"views":10},"count":5}
+23 fields can either all be included or all be excluded
@@ -0,0 +1,49 @@
+--TEST--
+MongoCursor: documents with an err field are documents, not errors, wherever the batch starts
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'err_field');
+$coll->drop();
+
+for ($i = 0; $i < 10; $i++) {
+    $coll->insert(array('_id' => $i, 'err' => "x"), array('safe' => true));
+}
+
+// batches of 3 put err documents both first and further on in a batch
+foreach (array(3, 100) as $size) {
+    try {
+        $count = 0;
+        foreach ($coll->find()->sort(array('_id' => 1))->batchSize($size) as $doc) {
+            $count++;
+        }
+        echo "foreach: $count\n";
+        echo "toArray: ", count($coll->find()->sort(array('_id' => 1))->batchSize($size)->toArray()), "\n";
+        echo "toJSON: ", count(json_decode($coll->find()->sort(array('_id' => 1))->batchSize($size)->toJSON())), "\n";
+    } catch (MongoCursorException $e) {
+        echo "batch size $size: ", $e->getMessage(), "\n";
+    }
+}
+
+// real query failures still throw
+foreach (array('getNext', 'toJSON') as $method) {
+    try {
+        $coll->find(array('x' => array('$bogus' => 1)))->$method();
+        echo "no exception\n";
+    } catch (MongoCursorException $e) {
+        echo "$method: exception\n";
+    }
+}
+?>
+--EXPECT--
+foreach: 10
+toArray: 10
+toJSON: 10
+foreach: 10
+toArray: 10
+toJSON: 10
+getNext: exception
+toJSON: exception
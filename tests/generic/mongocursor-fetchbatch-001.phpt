@@ -0,0 +1,49 @@
+--TEST--
+MongoCursor::fetchBatch() and toArray() decode whole batches at once
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'fetchbatch');
+$coll->drop();
+
+for ($i = 0; $i < 7; $i++) {
+    $coll->insert(array('_id' => $i, 'x' => $i * 10));
+}
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(3);
+while ($batch = $cursor->fetchBatch()) {
+    echo json_encode($batch), "\n";
+}
+var_dump($cursor->fetchBatch());
+
+$docs = $coll->find()->sort(array('_id' => 1))->batchSize(2)->limit(5)->toArray();
+echo json_encode($docs), "\n";
+
+// picks up after documents already read
+$cursor = $coll->find()->sort(array('_id' => 1))->decodeFields(array('x'));
+$cursor->getNext();
+echo json_encode($cursor->toArray()), "\n";
+
+$docs = $coll->find()->lazy()->toArray();
+var_dump(count($docs), get_class($docs[0]));
+
+try {
+    $coll->find(array('x' => array('$bogus' => 1)))->toArray();
+} catch (MongoCursorException $e) {
+    echo get_class($e), "\n";
+}
+?>
+--EXPECT--
+[{"_id":0,"x":0},{"_id":1,"x":10},{"_id":2,"x":20}]
+[{"_id":3,"x":30},{"_id":4,"x":40},{"_id":5,"x":50}]
+[{"_id":6,"x":60}]
+array(0) {
+}
+[{"_id":0,"x":0},{"_id":1,"x":10},{"_id":2,"x":20},{"_id":3,"x":30},{"_id":4,"x":40}]
+[{"x":10},{"x":20},{"x":30},{"x":40},{"x":50},{"x":60}]
+int(7)
+string(17) "MongoLazyDocument"
+MongoCursorException
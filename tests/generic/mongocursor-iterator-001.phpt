@@ -0,0 +1,62 @@
+--TEST--
+foreach over a MongoCursor, and over subclasses that override Iterator methods
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'iterator');
+$coll->drop();
+
+for ($i = 0; $i < 5; $i++) {
+    $coll->insert(array('_id' => "id$i", 'x' => $i));
+}
+$coll->insert(array('x' => 5));
+
+$cursor = $coll->find()->sort(array('x' => 1))->batchSize(2)->limit(5);
+foreach ($cursor as $key => $doc) {
+    echo $key, " ", $doc['x'], "\n";
+}
+// rewinds and runs the query again
+foreach ($cursor as $key => $doc) {
+    echo $key, " ";
+}
+echo "\n";
+
+$doc = null;
+foreach ($coll->find(array('x' => 5)) as $key => $doc) {
+    var_dump($key == (string)$doc['_id']);
+}
+
+class DoubledCursor extends MongoCursor {
+    function current() {
+        $doc = parent::current();
+        return $doc['x'] * 2;
+    }
+}
+
+$cursor = new DoubledCursor($mongo, dbname() . '.iterator', array('x' => array('$lt' => 3)));
+foreach ($cursor->sort(array('x' => 1)) as $key => $value) {
+    echo $key, " ", $value, "\n";
+}
+
+try {
+    foreach ($coll->find(array('x' => array('$bogus' => 1))) as $doc) {
+    }
+} catch (MongoCursorException $e) {
+    echo get_class($e), "\n";
+}
+?>
+--EXPECT--
+id0 0
+id1 1
+id2 2
+id3 3
+id4 4
+id0 id1 id2 id3 id4 
+bool(true)
+id0 0
+id1 2
+id2 4
+MongoCursorException
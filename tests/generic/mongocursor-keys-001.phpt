@@ -0,0 +1,44 @@
+--TEST--
+MongoCursor decodes field names the same way across documents of different shapes
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'keys');
+$coll->drop();
+
+$docs = array(
+    array('_id' => 1, 'a' => 1, 'list' => array(1, 2, 3), 'sub' => array('x' => 1)),
+    array('_id' => 2, 'a' => 2, 'list' => array(4, 5, 6), 'sub' => array('x' => 2)),
+    array('_id' => 3, 'b' => 3, 'list' => array(7), 'sub' => array('y' => 3, '10' => 4, '010' => 5, '-1' => 6)),
+    array('_id' => 4, 'a' => 4, 'list' => array(8, 9, 10, 11), 'sub' => array('x' => 4)),
+);
+foreach ($docs as $doc) {
+    $coll->insert($doc);
+}
+
+foreach ($coll->find()->sort(array('_id' => 1)) as $doc) {
+    $expected = $docs[$doc['_id'] - 1];
+    var_dump($doc === $expected);
+}
+
+$doc = $coll->findOne(array('_id' => 3));
+var_dump(array_map('gettype', array_keys($doc['sub'])));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(4) {
+  [0]=>
+  string(6) "string"
+  [1]=>
+  string(7) "integer"
+  [2]=>
+  string(6) "string"
+  [3]=>
+  string(7) "integer"
+}
@@ -0,0 +1,41 @@
+--TEST--
+MongoCursor decodes embedded documents with more fields than the key cache starts with
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'keys');
+$coll->drop();
+
+function fields($prefix, $count) {
+    $doc = array();
+    for ($i = 0; $i < $count; $i++) {
+        $doc["$prefix$i"] = $i;
+    }
+    return $doc;
+}
+
+// the fields after 'sub' are cached while its value is decoded
+$docs = array();
+for ($i = 0; $i < 6; $i++) {
+    $doc = array('_id' => $i, 'sub' => fields($i < 3 ? 'a' : 'b', 40), '7' => 'seven', 'z' => 'last');
+    if ($i == 4) {
+        $doc['sub'] = array('list' => range(0, 99), 'deeper' => array('sub' => fields('c', 20)));
+    }
+    $docs[] = $doc;
+    $coll->insert($doc);
+}
+
+foreach ($coll->find()->sort(array('_id' => 1))->batchSize(3) as $doc) {
+    var_dump($doc === $docs[$doc['_id']]);
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,63 @@
+--TEST--
+MongoCursor::lazy() returns documents that decode fields as they are read
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'lazy');
+$coll->drop();
+
+for ($i = 0; $i < 5; $i++) {
+    $coll->insert(array('_id' => $i, 'name' => "doc $i", 'tags' => array('a', 'b'), 'sub' => array('x' => $i)));
+}
+
+// small batches, so documents outlive the reply they came from
+$kept = array();
+foreach ($coll->find()->sort(array('_id' => 1))->batchSize(2)->lazy() as $key => $doc) {
+    $kept[$key] = $doc;
+}
+var_dump(count($kept), get_class($kept[0]));
+
+$doc = $kept[3];
+var_dump($doc['name'], $doc['sub']['x'], $doc['tags']);
+var_dump(isset($doc['name']), isset($doc['nothing']), $doc['nothing']);
+
+foreach ($kept[1] as $field => $value) {
+    echo $field, " ", json_encode($value), "\n";
+}
+
+var_dump($kept[4]->toArray() == $coll->findOne(array('_id' => 4)));
+
+try {
+    $doc['name'] = "changed";
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+
+// lazy(false) goes back to arrays
+$doc = $coll->find()->lazy()->lazy(false)->getNext();
+var_dump(is_array($doc));
+?>
+--EXPECT--
+int(5)
+string(17) "MongoLazyDocument"
+string(5) "doc 3"
+int(3)
+array(2) {
+  [0]=>
+  string(1) "a"
+  [1]=>
+  string(1) "b"
+}
+bool(true)
+bool(false)
+NULL
+_id 1
+name "doc 1"
+tags ["a","b"]
+sub {"x":1}
+bool(true)
+22
+bool(true)
@@ -0,0 +1,70 @@
+--TEST--
+MongoCursor::prefetch() gets the same results a batch ahead
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'prefetch');
+$coll->drop();
+
+for ($i = 0; $i < 100; $i++) {
+    $coll->insert(array('_id' => $i), array('safe' => true));
+}
+
+function ids($cursor) {
+    $ids = array();
+    foreach ($cursor as $doc) {
+        $ids[] = $doc['_id'];
+    }
+    return $ids;
+}
+
+$expected = range(0, 99);
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch();
+var_dump(ids($cursor) === $expected);
+
+// other queries in the middle of a batch read past the prefetched reply
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch();
+$ids = array();
+foreach ($cursor as $doc) {
+    $ids[] = $doc['_id'];
+    if ($doc['_id'] % 10 == 7) {
+        $other = $coll->findOne(array('_id' => $doc['_id']));
+        if ($other['_id'] !== $doc['_id']) {
+            echo "wrong reply\n";
+        }
+    }
+}
+var_dump($ids === $expected);
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->limit(25)->prefetch();
+var_dump(ids($cursor) === range(0, 24));
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch();
+var_dump(count($cursor->toArray()));
+
+// starting over with a getmore outstanding
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch();
+for ($i = 0; $i < 6; $i++) {
+    $cursor->getNext();
+}
+$cursor->reset();
+var_dump(ids($cursor) === $expected);
+var_dump($coll->findOne(array('_id' => 50)));
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch()->prefetch(false);
+var_dump(ids($cursor) === $expected);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+int(100)
+bool(true)
+array(1) {
+  ["_id"]=>
+  int(50)
+}
+bool(true)
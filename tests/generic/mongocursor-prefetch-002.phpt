@@ -0,0 +1,40 @@
+--TEST--
+MongoCursor: cursors freed with a reply outstanding don't get in the way of later queries
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'prefetch');
+$coll->drop();
+
+for ($i = 0; $i < 100; $i++) {
+    $coll->insert(array('_id' => $i), array('safe' => true));
+}
+
+for ($round = 0; $round < 20; $round++) {
+    // a getmore sent ahead
+    $cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10)->prefetch();
+    for ($i = 0; $i < 6; $i++) {
+        $cursor->getNext();
+    }
+    unset($cursor);
+
+    // a query sent ahead
+    $cursor = $coll->find(array('_id' => $round))->send();
+    unset($cursor);
+
+    $doc = $coll->findOne(array('_id' => $round + 50));
+    if ($doc['_id'] !== $round + 50) {
+        echo "round $round: wrong reply\n";
+    }
+}
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(10);
+var_dump(count(iterator_to_array($cursor)));
+var_dump($coll->count());
+?>
+--EXPECT--
+int(100)
+int(100)
@@ -0,0 +1,73 @@
+--TEST--
+MongoCursor::send() sends queries ahead and their replies go to the right cursors
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'send');
+$coll->drop();
+
+for ($i = 0; $i < 10; $i++) {
+    $coll->insert(array('_id' => $i, 'x' => $i * 10), array('safe' => true));
+}
+
+$cursors = array();
+for ($i = 0; $i < 10; $i++) {
+    $cursors[$i] = $coll->find(array('_id' => $i))->limit(-1)->send();
+}
+var_dump($cursors[0]->dead());
+
+// read them back to front, so the other replies have to be parked
+for ($i = 9; $i >= 0; $i--) {
+    $doc = $cursors[$i]->getNext();
+    echo $doc['_id'], " => ", $doc['x'], "\n";
+}
+
+// a sent query that is reset is sent again when it's used
+$a = $coll->find(array('_id' => array('$lt' => 3)))->sort(array('_id' => 1))->send();
+$b = $coll->find(array('_id' => 5))->send();
+$a->reset();
+foreach ($b as $doc) {
+    echo $doc['_id'], "\n";
+}
+foreach ($a as $doc) {
+    echo $doc['_id'], "\n";
+}
+
+// a query with many batches, and a single one sent behind it
+$many = $coll->find()->sort(array('_id' => 1))->batchSize(2)->send();
+$one = $coll->find(array('_id' => 9))->send();
+echo count(iterator_to_array($many)), "\n";
+var_dump($one->getNext() == array('_id' => 9, 'x' => 90));
+
+try {
+    $one->send();
+} catch (MongoCursorException $e) {
+    echo $e->getMessage(), "\n";
+}
+
+// queries that don't use send() are unaffected
+var_dump($coll->findOne(array('_id' => 4)) == array('_id' => 4, 'x' => 40));
+?>
+--EXPECT--
+bool(false)
+9 => 90
+8 => 80
+7 => 70
+6 => 60
+5 => 50
+4 => 40
+3 => 30
+2 => 20
+1 => 10
+0 => 0
+5
+0
+1
+2
+10
+bool(true)
+cannot modify cursor after beginning iteration.
+bool(true)
@@ -0,0 +1,59 @@
+--TEST--
+MongoCursor::toJSON() and writeJSON() write the results as a JSON array
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'tojson');
+$coll->drop();
+
+for ($i = 0; $i < 250; $i++) {
+    $coll->insert(array('_id' => $i, 'name' => "doc $i", 'tags' => array('a', 'b')));
+}
+
+$cursor = $coll->find()->sort(array('_id' => 1))->batchSize(50);
+var_dump($cursor->toJSON() === json_encode(iterator_to_array($coll->find()->sort(array('_id' => 1)), false)));
+
+echo $coll->find(array('_id' => array('$lt' => 2)))->sort(array('_id' => 1))->toJSON(), "\n";
+echo $coll->find(array('_id' => -1))->toJSON(), "\n";
+
+// what's left of the cursor
+$cursor = $coll->find()->sort(array('_id' => 1))->limit(3);
+$cursor->getNext();
+echo $cursor->toJSON(), "\n";
+
+$stream = fopen('php://memory', 'w+');
+var_dump($coll->find()->sort(array('_id' => 1))->writeJSON($stream));
+rewind($stream);
+$docs = json_decode(stream_get_contents($stream), true);
+var_dump(count($docs), $docs[249]);
+
+try {
+    $coll->find(array('x' => array('$bogus' => 1)))->toJSON();
+} catch (MongoCursorException $e) {
+    echo get_class($e), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+[{"_id":0,"name":"doc 0","tags":["a","b"]},{"_id":1,"name":"doc 1","tags":["a","b"]}]
+[]
+[{"_id":1,"name":"doc 1","tags":["a","b"]},{"_id":2,"name":"doc 2","tags":["a","b"]}]
+int(250)
+int(250)
+array(3) {
+  ["_id"]=>
+  int(249)
+  ["name"]=>
+  string(7) "doc 249"
+  ["tags"]=>
+  array(2) {
+    [0]=>
+    string(1) "a"
+    [1]=>
+    string(1) "b"
+  }
+}
+MongoCursorException
@@ -0,0 +1,50 @@
+--TEST--
+MongoCursor::typeMap() and mongo.type_map decode dates, longs and binary data to scalars
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+<?php if (8 !== PHP_INT_SIZE) { die('skip Only for 64-bit platform'); } ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'typemap');
+$coll->drop();
+
+ini_set('mongo.native_long', true);
+$coll->insert(array('_id' => 1, 'date' => new MongoDate(1234567890, 123000),
+                    'long' => new MongoInt64("9223372036854775807"), 'bin' => new MongoBinData("abc")));
+ini_set('mongo.native_long', false);
+
+$doc = $coll->find()->getNext();
+echo get_class($doc['date']), " ", gettype($doc['long']), " ", get_class($doc['bin']), "\n";
+
+$doc = $coll->find()->typeMap(array('date' => 'int', 'long' => 'string', 'binary' => 'string'))->getNext();
+var_dump($doc['date'], $doc['long'], $doc['bin']);
+
+$doc = $coll->find()->typeMap(array('long' => 'int'))->lazy()->getNext();
+var_dump($doc['long']);
+
+ini_set('mongo.type_map', 'date:int, binary:string');
+$cursor = $coll->find();
+ini_set('mongo.type_map', '');
+$doc = $cursor->typeMap(array('binary' => 'default'))->getNext();
+echo gettype($doc['date']), " ", get_class($doc['bin']), "\n";
+
+var_dump(ini_set('mongo.type_map', 'date:string'), ini_get('mongo.type_map'));
+
+try {
+    $coll->find()->typeMap(array('binary' => 'int'));
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+?>
+--EXPECT--
+MongoDate double MongoBinData
+int(1234567890123)
+string(19) "9223372036854775807"
+string(3) "abc"
+int(9223372036854775807)
+integer MongoBinData
+bool(false)
+string(0) ""
+24
@@ -0,0 +1,54 @@
+--TEST--
+MongoRawBSON as a document, query, update and fields
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$coll = $mongo->selectCollection(dbname(), 'rawbson');
+$coll->drop();
+
+// an _id is added when there isn't one
+$raw = new MongoRawBSON(bson_encode(array('x' => 1, 'y' => "one")));
+$coll->insert($raw);
+$doc = bson_decode((string)$raw);
+var_dump($doc['_id'] instanceof MongoId, $doc['x']);
+
+$coll->insert(new MongoRawBSON(bson_encode(array('_id' => 2, 'x' => 2, 'y' => "two"))));
+$coll->batchInsert(array(
+    new MongoRawBSON(bson_encode(array('_id' => 3, 'x' => 3))),
+    array('_id' => 4, 'x' => 4),
+));
+var_dump($coll->count());
+
+$query = new MongoRawBSON(bson_encode(array('x' => array('$gte' => 2))));
+$fields = new MongoRawBSON(bson_encode(array('_id' => 0, 'x' => 1)));
+foreach ($coll->find($query, $fields)->sort(array('x' => 1)) as $doc) {
+    echo json_encode($doc), "\n";
+}
+
+$coll->update(new MongoRawBSON(bson_encode(array('_id' => 2))),
+              new MongoRawBSON(bson_encode(array('$set' => array('y' => "TWO")))));
+$doc = $coll->findOne(array('_id' => 2));
+var_dump($doc['y']);
+
+$coll->remove(new MongoRawBSON(bson_encode(array('x' => array('$lt' => 3)))));
+var_dump($coll->count());
+
+try {
+    $coll->insert(new MongoRawBSON("\x05\0\0\0\0"));
+} catch (MongoException $e) {
+    echo $e->getCode(), " ", $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+int(1)
+int(4)
+{"x":2}
+{"x":3}
+{"x":4}
+string(3) "TWO"
+int(2)
+4 no elements in doc
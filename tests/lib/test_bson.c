@@ -0,0 +1,252 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <php.h>
+#include <php_ini.h>
+
+#include <zend_exceptions.h>
+
+#include "php_mongo.h"
+#include "test_bson.h"
+#include "../bson.h"
+
+ZEND_EXTERN_MODULE_GLOBALS(mongo);
+
+/*
+ * The byte-at-a-time validator the driver used before, kept as the reference
+ * php_mongo_is_utf8 has to agree with.
+ */
+static int reference_is_utf8(const char *s, int len) {
+  int i;
+
+  for (i=0; i<len; i++) {
+    if (i+3 < len &&
+        (s[i] & 248) == 240 &&
+        (s[i+1] & 192) == 128 &&
+        (s[i+2] & 192) == 128 &&
+        (s[i+3] & 192) == 128) {
+      i += 3;
+    }
+    else if (i+2 < len &&
+             (s[i] & 240) == 224 &&
+             (s[i+1] & 192) == 128 &&
+             (s[i+2] & 192) == 128) {
+      i += 2;
+    }
+    else if (i+1 < len &&
+             (s[i] & 224) == 192 &&
+             (s[i+1] & 192) == 128) {
+      i += 1;
+    }
+    else if ((s[i] & 128) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// one byte from each class the validator cares about
+static const unsigned char interesting[] = {
+  0x00, 0x41, 0x7F, 0x80, 0xBF, 0xC0, 0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF7, 0xF8, 0xFC, 0xFF
+};
+#define NUM_INTERESTING (sizeof(interesting)/sizeof(interesting[0]))
+
+int test_bson(TSRMLS_D) {
+  printf("running bson tests: ");
+  test_php_mongo_is_utf8_short();
+  test_php_mongo_is_utf8_offsets();
+  test_php_mongo_is_utf8_random();
+  test_php_mongo_serialize_key(TSRMLS_C);
+  printf("\n");
+  return 0;
+}
+
+/*
+ * Every string of up to three bytes, and every four-byte string made of
+ * interesting bytes.
+ */
+int test_php_mongo_is_utf8_short() {
+  char s[4];
+  unsigned int i, a, b, c, d;
+
+  for (i = 0; i < (1 << 24); i++) {
+    s[0] = i & 0xFF;
+    s[1] = (i >> 8) & 0xFF;
+    s[2] = (i >> 16) & 0xFF;
+
+    if (i < (1 << 8)) {
+      assert(php_mongo_is_utf8(s, 1) == reference_is_utf8(s, 1));
+    }
+    if (i < (1 << 16)) {
+      assert(php_mongo_is_utf8(s, 2) == reference_is_utf8(s, 2));
+    }
+    assert(php_mongo_is_utf8(s, 3) == reference_is_utf8(s, 3));
+  }
+
+  for (a = 0; a < NUM_INTERESTING; a++) {
+    for (b = 0; b < NUM_INTERESTING; b++) {
+      for (c = 0; c < NUM_INTERESTING; c++) {
+        for (d = 0; d < NUM_INTERESTING; d++) {
+          s[0] = interesting[a];
+          s[1] = interesting[b];
+          s[2] = interesting[c];
+          s[3] = interesting[d];
+          assert(php_mongo_is_utf8(s, 4) == reference_is_utf8(s, 4));
+        }
+      }
+    }
+  }
+
+  printf(".");
+  return 0;
+}
+
+/*
+ * Puts every two-byte combination of interesting bytes at every offset of an
+ * ASCII buffer, so sequences straddle the 16-byte/word blocks in every
+ * possible way and the tail handling gets exercised.
+ */
+int test_php_mongo_is_utf8_offsets() {
+  char s[70];
+  unsigned int a, b, len, offset;
+
+  for (len = 2; len <= sizeof(s); len++) {
+    for (offset = 0; offset + 2 <= len; offset++) {
+      for (a = 0; a < NUM_INTERESTING; a++) {
+        for (b = 0; b < NUM_INTERESTING; b++) {
+          memset(s, 'x', sizeof(s));
+          s[offset] = interesting[a];
+          s[offset+1] = interesting[b];
+          assert(php_mongo_is_utf8(s, len) == reference_is_utf8(s, len));
+        }
+      }
+    }
+  }
+
+  printf(".");
+  return 0;
+}
+
+/*
+ * Long strings of mostly-valid text with random damage.
+ */
+int test_php_mongo_is_utf8_random() {
+  static const char *pieces[] = { "a", "plain ascii text ", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80" };
+  char s[1024];
+  int round;
+
+  srand(42);
+
+  for (round = 0; round < 200000; round++) {
+    int len = 0, damage;
+
+    while (len < (int)sizeof(s) - 20) {
+      const char *piece = pieces[rand() % 5];
+      int piece_len = strlen(piece);
+
+      if (rand() % 8 == 0) {
+        break;
+      }
+      memcpy(s+len, piece, piece_len);
+      len += piece_len;
+    }
+
+    for (damage = rand() % 3; damage > 0 && len > 0; damage--) {
+      s[rand() % len] = interesting[rand() % NUM_INTERESTING];
+    }
+
+    assert(php_mongo_is_utf8(s, len) == reference_is_utf8(s, len));
+  }
+
+  printf(".");
+  return 0;
+}
+
+/*
+ * Serializes key into a fresh buffer and checks what was written (or that it
+ * was rejected, if expected is NULL).
+ */
+static void check_key(char *key, int key_len, int prep, char *expected TSRMLS_DC) {
+  buffer buf;
+
+  CREATE_BUF(buf, 8);
+  php_mongo_serialize_key(&buf, key, key_len, prep TSRMLS_CC);
+
+  if (expected) {
+    assert(!EG(exception));
+    assert(buf.pos - buf.start == (int)strlen(expected) + 1);
+    assert(memcmp(buf.start, expected, strlen(expected) + 1) == 0);
+  }
+  else {
+    assert(EG(exception));
+    assert(buf.pos == buf.start);
+    zend_clear_exception(TSRMLS_C);
+  }
+
+  efree(buf.start);
+}
+
+/*
+ * Keys of every length around the word size, with a '.', a \0 or the command
+ * character at every position.
+ */
+int test_php_mongo_serialize_key(TSRMLS_D) {
+  char key[40], expected[40];
+  int len, pos;
+
+  check_key("", 0, 0, NULL TSRMLS_CC);
+  check_key("$set", 4, 0, "$set" TSRMLS_CC);
+  check_key("a.b", 3, 0, "a.b" TSRMLS_CC);
+  check_key("a.b", 3, 1, NULL TSRMLS_CC);
+
+  for (len = 1; len < (int)sizeof(key); len++) {
+    memset(key, 'k', len);
+    key[len] = '\0';
+    check_key(key, len, 1, key TSRMLS_CC);
+
+    for (pos = 0; pos < len; pos++) {
+      memset(key, 'k', len);
+
+      key[pos] = '.';
+      check_key(key, len, 0, key TSRMLS_CC);
+      check_key(key, len, 1, NULL TSRMLS_CC);
+
+      // everything after a \0 is dropped, '.'s included
+      key[pos] = '\0';
+      key[len-1] = pos < len-1 ? '.' : '\0';
+      check_key(key, len, 1, pos ? key : NULL TSRMLS_CC);
+
+      // the command character only turns into a $ at the start of a key
+      memset(key, 'k', len);
+      key[pos] = '#';
+      memcpy(expected, key, len + 1);
+      if (pos == 0) {
+        expected[0] = '$';
+      }
+      // through the ini, so the encoder is rebound
+      zend_alter_ini_entry("mongo.cmd", sizeof("mongo.cmd"), "#", 1, PHP_INI_USER, PHP_INI_STAGE_RUNTIME);
+      check_key(key, len, 0, expected TSRMLS_CC);
+      zend_alter_ini_entry("mongo.cmd", sizeof("mongo.cmd"), "$", 1, PHP_INI_USER, PHP_INI_STAGE_RUNTIME);
+    }
+  }
+
+  printf(".");
+  return 0;
+}
@@ -0,0 +1,27 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef TEST_BSON
+#define TEST_BSON
+
+int test_bson(TSRMLS_D);
+
+int test_php_mongo_is_utf8_short();
+int test_php_mongo_is_utf8_offsets();
+int test_php_mongo_is_utf8_random();
+int test_php_mongo_serialize_key(TSRMLS_D);
+
+#endif
@@ -0,0 +1,35 @@
+--TEST--
+bson_decode() turns BSON arrays with keys 0, 1, 2, ... into lists and keeps any other keys
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$list = range(0, 10500);
+$doc = bson_decode(bson_encode(array('list' => $list, 'nested' => array(array(1, 2), array('a' => array(3))))));
+var_dump($doc['list'] === $list, json_encode($doc['nested']));
+
+// a BSON array, type 4, with the given keys and int values; keys that aren't
+// 0, 1, 2, ... in order are kept as they are
+function bson_array($keys) {
+    $elements = "";
+    foreach ($keys as $i => $key) {
+        $elements .= "\x10" . $key . "\0" . pack('V', $i);
+    }
+    $array = pack('V', strlen($elements) + 5) . $elements . "\0";
+    $elements = "\x04" . "a\0" . $array;
+    return pack('V', strlen($elements) + 5) . $elements . "\0";
+}
+
+foreach (array(array(), array('0', '1', '2'), array('0', '2'), array('1', '0'), array('0', 'x')) as $keys) {
+    $doc = bson_decode(bson_array($keys));
+    echo json_encode($doc['a']), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+"[[1,2],{\"a\":[3]}]"
+[]
+[0,1,2]
+{"0":0,"2":1}
+{"1":0,"0":1}
+{"0":0,"x":1}
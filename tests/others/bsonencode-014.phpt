@@ -0,0 +1,42 @@
+--TEST--
+bson_encode() large documents are sized correctly
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$doc = array(
+    'str'   => str_repeat('x', 300000),
+    'list'  => range(0, 9999),
+    'neg'   => array(-5 => 'a', 12 => 'b'),
+    'obj'   => (object)array('a' => 1.5, 'b' => true, 'c' => null),
+    'id'    => new MongoId('4f8d1b7f2cae6b5c3a000001'),
+    'date'  => new MongoDate(1234567890, 123000),
+    'regex' => new MongoRegex('/foo/i'),
+    'bin'   => new MongoBinData(str_repeat('y', 500000), 2),
+    'code'  => new MongoCode('return x;', array('x' => 1)),
+    'ts'    => new MongoTimestamp(1, 2),
+    'min'   => new MongoMinKey,
+    'max'   => new MongoMaxKey,
+);
+
+$bson = bson_encode($doc);
+$len = unpack('V', substr($bson, 0, 4));
+var_dump($len[1] === strlen($bson));
+
+$back = bson_decode($bson);
+var_dump(strlen($back['str']), count($back['list']), $back['list'][9999]);
+var_dump($back['neg'], strlen($back['bin']->bin), (string)$back['id']);
+?>
+--EXPECT--
+bool(true)
+int(300000)
+int(10000)
+int(9999)
+array(2) {
+  [-5]=>
+  string(1) "a"
+  [12]=>
+  string(1) "b"
+}
+int(500000)
+string(24) "4f8d1b7f2cae6b5c3a000001"
@@ -0,0 +1,47 @@
+--TEST--
+bson_encode() rejects invalid UTF-8 wherever it is in the string
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$valid = array(
+    "",
+    str_repeat("a", 100),
+    str_repeat("a", 31) . "\xC3\xA9" . str_repeat("b", 31),
+    str_repeat("\xE2\x82\xAC", 20),
+    str_repeat("x", 15) . "\xF0\x9F\x98\x80",
+);
+$invalid = array(
+    "\x80",
+    str_repeat("a", 16) . "\xFF",
+    str_repeat("a", 15) . "\xC3",
+    str_repeat("a", 40) . "\xE2\x82" . str_repeat("a", 40),
+    str_repeat("a", 33) . "\xF8\x80\x80\x80",
+    "\xC3\xA9\xA9",
+);
+
+foreach ($valid as $s) {
+    $doc = bson_decode(bson_encode(array('s' => $s)));
+    var_dump($doc['s'] === $s);
+}
+foreach ($invalid as $s) {
+    try {
+        bson_encode(array('s' => $s));
+        echo "no exception\n";
+    } catch (MongoException $e) {
+        var_dump($e->getCode());
+    }
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(12)
+int(12)
+int(12)
+int(12)
+int(12)
+int(12)
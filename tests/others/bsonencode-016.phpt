@@ -0,0 +1,54 @@
+--TEST--
+bson_encode() lists and arrays that only look like lists
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+function type_of($value) {
+    // type byte of the only field, right after the document length
+    $bson = bson_encode(array('v' => $value));
+    return ord($bson[4]);
+}
+
+$lists = array(
+    'ints'    => range(0, 12000),
+    'doubles' => array_map('floatval', range(0, 99)),
+    'strings' => array_map('strval', range(0, 99)),
+    'mixed'   => array(1, 2.5, "three", null, true, array(4), new MongoDate(5)),
+    'empty'   => array(),
+);
+foreach ($lists as $name => $list) {
+    $doc = bson_decode(bson_encode(array('v' => $list)));
+    echo $name, ": ", type_of($list), " ", var_export($doc['v'] == $list, true), "\n";
+}
+
+$unset = range(0, 4);
+unset($unset[4]);
+$hashes = array(
+    'reversed' => array(1 => 'a', 0 => 'b'),
+    'string'   => array(0 => 'a', 'x' => 'b'),
+    'gap'      => array(0 => 'a', 2 => 'b'),
+    'unset'    => $unset,
+);
+foreach ($hashes as $name => $hash) {
+    $doc = bson_decode(bson_encode(array('v' => $hash)));
+    echo $name, ": ", type_of($hash), " ", json_encode(array_keys($doc['v'])), "\n";
+}
+
+try {
+    bson_encode(array('v' => array("ok", "\xFF")));
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+?>
+--EXPECT--
+ints: 4 true
+doubles: 4 true
+strings: 4 true
+mixed: 4 true
+empty: 4 true
+reversed: 3 [1,0]
+string: 3 [0,"x"]
+gap: 3 [0,2]
+unset: 4 [0,1,2,3]
+12
@@ -0,0 +1,75 @@
+--TEST--
+bson_encode() objects of classes with declared properties
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+class Point {
+    public $x = 1;
+    public $y = 2.5;
+    public $label = "origin";
+    public $visible = true;
+    public $note = null;
+    public $tags = array("a", "b");
+    public $child;
+}
+
+class Point3D extends Point {
+    public $z = 3;
+}
+
+class Secret {
+    public $a = 1;
+    protected $b = 2;
+}
+
+// get_object_vars() builds the property hash, so the second encoding goes
+// through it instead of the declared properties
+function build_hashes($o) {
+    foreach (get_object_vars($o) as $v) {
+        if (is_object($v)) {
+            build_hashes($v);
+        }
+    }
+}
+
+function same($value) {
+    $first = bson_encode(array('v' => $value));
+    build_hashes($value);
+    return $first === bson_encode(array('v' => $value)) ? "same" : "different";
+}
+
+$p = new Point;
+echo same($p), "\n";
+
+$p = new Point;
+$p->child = new Point3D;
+unset($p->child->y);
+echo same($p), "\n";
+
+$doc = bson_decode(bson_encode(array('v' => $p)));
+echo json_encode($doc), "\n";
+
+$p = new Point;
+$p->extra = "dynamic";
+echo same($p), "\n";
+
+ini_set('mongo.cmd', 'l');
+echo json_encode(bson_decode(bson_encode(array('v' => new Point)))), "\n";
+ini_set('mongo.cmd', '$');
+echo json_encode(bson_decode(bson_encode(array('v' => new Point)))), "\n";
+
+try {
+    bson_encode(array('v' => new Secret));
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+?>
+--EXPECT--
+same
+same
+{"v":{"x":1,"y":2.5,"label":"origin","visible":true,"note":null,"tags":["a","b"],"child":{"z":3,"x":1,"label":"origin","visible":true,"note":null,"tags":["a","b"],"child":null}}}
+same
+{"v":{"x":1,"y":2.5,"$abel":"origin","visible":true,"note":null,"tags":["a","b"],"child":null}}
+{"v":{"x":1,"y":2.5,"label":"origin","visible":true,"note":null,"tags":["a","b"],"child":null}}
+1
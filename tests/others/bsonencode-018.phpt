@@ -0,0 +1,70 @@
+--TEST--
+bson_encode() follows runtime changes to the encoder's ini settings
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+function type_of($value) {
+    $bson = bson_encode(array('v' => $value));
+    return ord($bson[4]);
+}
+
+function encode_error($doc) {
+    try {
+        bson_encode($doc);
+        return "ok";
+    } catch (MongoException $e) {
+        return $e->getCode();
+    }
+}
+
+// for lists, hashes and objects alike
+$values = array('list' => array(1), 'hash' => array('x' => 1), 'object' => (object)array('x' => 1));
+
+ini_set('mongo.native_long', 1);
+foreach ($values as $name => $v) {
+    // type of the first field
+    $bson = bson_encode($v);
+    var_dump(ord($bson[4]) == (PHP_INT_SIZE == 8 ? 18 : 16));
+}
+ini_set('mongo.native_long', 0);
+var_dump(type_of(1));
+
+ini_set('mongo.utf8', 0);
+var_dump(encode_error(array('v' => "\xFF")), encode_error(array("\xFF")));
+ini_set('mongo.utf8', 1);
+var_dump(encode_error(array('v' => "\xFF")), encode_error(array("\xFF")));
+
+ini_set('mongo.allow_empty_keys', 1);
+var_dump(encode_error(array('' => 1)));
+ini_set('mongo.allow_empty_keys', 0);
+var_dump(encode_error(array('' => 1)));
+
+ini_set('mongo.cmd', ':');
+var_dump(array_keys(bson_decode(bson_encode(array(':set' => 1, '$inc' => 2)))));
+ini_set('mongo.cmd', '$');
+var_dump(array_keys(bson_decode(bson_encode(array(':set' => 1, '$inc' => 2)))));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+int(16)
+string(2) "ok"
+string(2) "ok"
+int(12)
+int(12)
+string(2) "ok"
+int(1)
+array(2) {
+  [0]=>
+  string(4) "$set"
+  [1]=>
+  string(4) "$inc"
+}
+array(2) {
+  [0]=>
+  string(4) ":set"
+  [1]=>
+  string(4) "$inc"
+}
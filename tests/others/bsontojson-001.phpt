@@ -0,0 +1,51 @@
+--TEST--
+bson_to_json() writes the same JSON as json_encode() of the decoded document
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$doc = array(
+    'int' => 1, 'float' => 1.5, 'bool' => true, 'null' => null,
+    'string' => "a \"quoted\" /path/\n\xc3\xa9\xf0\x9f\x98\x80",
+    'list' => array(1, 2, array('x' => 3)), 'hash' => array('b' => 'c'),
+    'id' => new MongoId('4f06e55e44670ab92b000000'),
+    'date' => new MongoDate(1325853296, 789000),
+    'regex' => new MongoRegex('/^a/i'),
+    'code' => new MongoCode('return x;', array('x' => 1)),
+    'ts' => new MongoTimestamp(1325853296, 2),
+);
+$bson = bson_encode($doc);
+var_dump(bson_to_json($bson) === json_encode(bson_decode($bson)));
+
+// an empty document is an object, not []
+echo bson_to_json(bson_encode(array('a' => array('b' => new stdClass)))), "\n";
+
+$bson = bson_encode(array(
+    '_id' => new MongoId('4f06e55e44670ab92b000000'),
+    'date' => new MongoDate(1325853296, 789000),
+    'bin' => new MongoBinData("abc", MongoBinData::BYTE_ARRAY),
+    'long' => new MongoInt64("9007199254740993"),
+));
+echo bson_to_json($bson), "\n";
+echo bson_to_json($bson, array('id' => 'string', 'date' => 'iso', 'binary' => 'extended', 'long' => 'string')), "\n";
+echo bson_to_json($bson, array('date' => 'int')), "\n";
+
+try {
+    bson_to_json($bson, array('date' => 'string'));
+} catch (MongoException $e) {
+    echo $e->getCode(), " ", $e->getMessage(), "\n";
+}
+try {
+    bson_to_json(substr($bson, 0, -1));
+} catch (MongoException $e) {
+    echo $e->getCode(), " ", $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+{"a":{"b":{}}}
+{"_id":{"$id":"4f06e55e44670ab92b000000"},"date":{"sec":1325853296,"usec":789000},"bin":"YWJj","long":9007199254740993}
+{"_id":"4f06e55e44670ab92b000000","date":"2012-01-06T12:34:56.789Z","bin":{"$binary":"YWJj","$type":"02"},"long":"9007199254740993"}
+{"_id":{"$id":"4f06e55e44670ab92b000000"},"date":1325853296789,"bin":"YWJj","long":9007199254740993}
+25 invalid JSON option "date"
+20 invalid BSON document
@@ -0,0 +1,55 @@
+--TEST--
+json_to_bson() gives the same BSON as bson_encode(json_decode())
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$json = '{"int": 1, "float": -2.5e3, "big": 123456789012345678901234, "bool": true, "null": null,
+          "string": "a \"quoted\" \/path\/\né😀", "list": [1, [], {"x": "y"}]}';
+var_dump(json_to_bson($json) === bson_encode(json_decode($json, true)));
+
+$doc = bson_decode(json_to_bson('{"_id": {"$oid": "4f06e55e44670ab92b000000"}, "date": {"$date": 1325853296789},
+                                  "bin": {"$binary": "YWJj", "$type": "00"}, "q": {"$type": 2}}'));
+var_dump($doc['_id'] == new MongoId('4f06e55e44670ab92b000000'));
+var_dump($doc['date']->sec, $doc['date']->usec, $doc['bin']->bin, $doc['bin']->type, $doc['q']);
+
+// numbers of any length
+$json = '{"pi": 3.' . str_repeat("14159265358979323846", 10) . ', "big": -' . str_repeat("9", 100) . 'e-50}';
+var_dump(json_to_bson($json) === bson_encode(json_decode($json, true)));
+
+// an empty object is a document
+echo bson_to_json(json_to_bson('{"a": {}, "b": []}')), "\n";
+
+foreach (array('[1]', '{"a": 1,}', '{"a": 01}', '{"a": "b"} x', '{"a": {"$oid": "xyz"}}', '{"a": "\ud800"}') as $json) {
+    try {
+        json_to_bson($json);
+    } catch (MongoException $e) {
+        echo $e->getCode(), " ", $e->getMessage(), "\n";
+    }
+}
+try {
+    json_to_bson("{\"a\": \"\xff\"}");
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+int(1325853296)
+int(789000)
+string(3) "abc"
+int(0)
+array(1) {
+  ["$type"]=>
+  int(2)
+}
+bool(true)
+{"a":{},"b":[]}
+27 invalid JSON: expected an object at offset 0
+27 invalid JSON: expected a string at offset 8
+27 invalid JSON: invalid number at offset 6
+27 invalid JSON: unexpected data after the object at offset 11
+27 invalid JSON: invalid $oid at offset 21
+27 invalid JSON: invalid \u escape at offset 9
+12
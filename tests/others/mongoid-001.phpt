@@ -0,0 +1,41 @@
+--TEST--
+MongoId's $id is filled in when it is first looked at
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$doc = bson_decode(bson_encode(array('_id' => new MongoId('4f06e55e44670ab92b000000'))));
+$id = $doc['_id'];
+var_dump((string)$id, $id->{'$id'});
+print_r($id);
+echo "\n";
+
+$doc = bson_decode(bson_encode(array('_id' => new MongoId('4F06E55E44670AB92B000001'))));
+echo json_encode($doc), "\n";
+var_dump(isset($doc['_id']->{'$id'}));
+
+$copy = new MongoId($id);
+var_dump($copy == $id, $copy->{'$id'});
+
+// the constructor starts over with the new value
+$copy->__construct('000000000000000000000000');
+var_dump($copy->{'$id'});
+
+$id->{'$id'} = "changed";
+var_dump($id->{'$id'}, (string)$id);
+?>
+--EXPECT--
+string(24) "4f06e55e44670ab92b000000"
+string(24) "4f06e55e44670ab92b000000"
+MongoId Object
+(
+    [$id] => 4f06e55e44670ab92b000000
+)
+
+{"_id":{"$id":"4f06e55e44670ab92b000001"}}
+bool(true)
+bool(true)
+string(24) "4f06e55e44670ab92b000000"
+string(24) "000000000000000000000000"
+string(7) "changed"
+string(24) "4f06e55e44670ab92b000000"
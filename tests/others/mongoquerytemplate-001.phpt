@@ -0,0 +1,58 @@
+--TEST--
+MongoQueryTemplate::bind()
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$template = new MongoQueryTemplate(array(
+    'user_id' => "?",
+    'status' => array('$in' => "?"),
+    'deleted' => false,
+    'tags' => array('$all' => array("a", "?")),
+));
+
+$params = array(
+    array(5, array("new", "open"), "b"),
+    array("a string id", array(), new MongoId("4f0000000000000000000000")),
+    array(null, array(1, 2.5, array('x' => 1)), 1.5),
+);
+foreach ($params as $p) {
+    $raw = $template->bind($p);
+    $expected = bson_encode(array(
+        'user_id' => $p[0],
+        'status' => array('$in' => $p[1]),
+        'deleted' => false,
+        'tags' => array('$all' => array("a", $p[2])),
+    ));
+    var_dump(get_class($raw), (string)$raw === $expected);
+}
+
+// the same shape again, and one without parameters
+$again = new MongoQueryTemplate(array('user_id' => "?", 'status' => array('$in' => "?"), 'deleted' => false, 'tags' => array('$all' => array("a", "?"))));
+var_dump((string)$again->bind($params[0]) === (string)$template->bind($params[0]));
+
+$none = new MongoQueryTemplate(array('x' => 1));
+var_dump((string)$none->bind(array()) === bson_encode(array('x' => 1)));
+
+try {
+    $template->bind(array(1, 2));
+} catch (MongoException $e) {
+    echo $e->getCode(), " ", $e->getMessage(), "\n";
+}
+try {
+    $template->bind(array(1, 2, "\xFF"));
+} catch (MongoException $e) {
+    echo $e->getCode(), "\n";
+}
+?>
+--EXPECT--
+string(12) "MongoRawBSON"
+bool(true)
+string(12) "MongoRawBSON"
+bool(true)
+string(12) "MongoRawBSON"
+bool(true)
+bool(true)
+bool(true)
+21 expected 3 parameters, got 2
+12
@@ -0,0 +1,49 @@
+--TEST--
+MongoQueryTemplate finds compiled shapes without mixing up similar ones
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$shapes = array(
+    array('a' => 1, 'b' => "?"),
+    array('a' => "1", 'b' => "?"),
+    array('a' => 1.0, 'b' => "?"),
+    array('a' => true, 'b' => "?"),
+    array('a' => null, 'b' => "?"),
+    array('b' => "?", 'a' => 1),
+    array('a' => array(1, 2), 'b' => "?"),
+    array('a' => array('x' => 1, 'y' => 2), 'b' => "?"),
+    array('a' => array('y' => 2, 'x' => 1), 'b' => "?"),
+    array(5 => 1, 'b' => "?"),
+    array(-5 => 1, 'b' => "?"),
+    array('a' => new MongoId("4f0000000000000000000000"), 'b' => "?"),
+);
+
+// twice, so the second round comes from the cache
+for ($round = 0; $round < 2; $round++) {
+    foreach ($shapes as $i => $shape) {
+        $template = new MongoQueryTemplate($shape);
+        $expected = $shape;
+        $expected['b'] = "x";
+        if ((string)$template->bind(array("x")) !== bson_encode($expected)) {
+            echo "round $round, shape $i: wrong document\n";
+        }
+    }
+}
+
+// settings that change how the shape is encoded aren't mixed up either
+ini_set('mongo.cmd', ':');
+$template = new MongoQueryTemplate(array(':in' => "?"));
+var_dump((string)$template->bind(array(1)) === bson_encode(array('$in' => 1)));
+$template = new MongoQueryTemplate(array('$in' => "?"));
+var_dump((string)$template->bind(array(1)) === bson_encode(array('$in' => 1)));
+ini_set('mongo.cmd', '$');
+$template = new MongoQueryTemplate(array(':in' => "?"));
+var_dump((string)$template->bind(array(1)) === bson_encode(array(':in' => 1)));
+echo "done\n";
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+done
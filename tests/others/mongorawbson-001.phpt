@@ -0,0 +1,52 @@
+--TEST--
+MongoRawBSON
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$bson = bson_encode(array('a' => 1, 'b' => array('c' => "d", 'e' => array(1, 2.5))));
+$raw = new MongoRawBSON($bson);
+var_dump((string)$raw === $bson);
+var_dump(bson_encode($raw) === $bson);
+
+// embedded in another document
+$doc = bson_decode(bson_encode(array('x' => 1, 'raw' => $raw, 'list' => array($raw))));
+var_dump($doc['raw'] == bson_decode($bson));
+var_dump($doc['list'][0] == bson_decode($bson));
+
+$raw = new MongoRawBSON("\x05\0\0\0\0");
+var_dump(bson_decode(bson_encode(array('empty' => $raw))));
+
+$invalid = array(
+    'empty string' => "",
+    'truncated'    => substr($bson, 0, -1),
+    'trailing'     => $bson . "\0",
+    'bad length'   => "\x06\0\0\0\0",
+    'bad type'     => "\x0c\0\0\0\x63a\0\1\0\0\0\0",
+    'bad string'   => "\x0e\0\0\0\x02a\0\x09\0\0\0x\0\0",
+);
+foreach ($invalid as $name => $bytes) {
+    try {
+        new MongoRawBSON($bytes);
+        echo $name, ": no exception\n";
+    } catch (MongoException $e) {
+        echo $name, ": ", $e->getCode(), " ", $e->getMessage(), "\n";
+    }
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(1) {
+  ["empty"]=>
+  array(0) {
+  }
+}
+empty string: 20 invalid BSON document
+truncated: 20 invalid BSON document
+trailing: 20 invalid BSON document
+bad length: 20 invalid BSON document
+bad type: 20 invalid BSON document
+bad string: 20 invalid BSON document
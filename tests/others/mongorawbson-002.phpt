@@ -0,0 +1,48 @@
+--TEST--
+MongoRawBSON bytes replaced after construction are checked before they're used
+--SKIPIF--
+<?php require dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+function encode($name, $raw) {
+    foreach (array($raw, array('x' => $raw), array('list' => array($raw))) as $doc) {
+        try {
+            bson_encode($doc);
+            echo $name, ": no exception\n";
+        } catch (MongoException $e) {
+            echo $name, ": ", $e->getCode(), " ", $e->getMessage(), "\n";
+        }
+    }
+}
+
+$property = new ReflectionProperty('MongoRawBSON', 'bson');
+$property->setAccessible(true);
+
+$raw = new MongoRawBSON(bson_encode(array('a' => 1)));
+$property->setValue($raw, array('a' => 1));
+encode('array', $raw);
+var_dump((string)$raw);
+
+$property->setValue($raw, "\x0c\0\0\0\x10a\0\1\0\0\0");
+encode('no trailing nul', $raw);
+
+$property->setValue($raw, "\xff\0\0\0\x10a\0\1\0\0\0\0");
+encode('bad length', $raw);
+
+$raw = unserialize('O:12:"MongoRawBSON":1:{s:7:"' . "\0*\0" . 'bson";i:42;}');
+encode('unserialized', $raw);
+?>
+--EXPECT--
+array: 20 invalid BSON document
+array: 20 invalid BSON document
+array: 20 invalid BSON document
+string(0) ""
+no trailing nul: 20 invalid BSON document
+no trailing nul: 20 invalid BSON document
+no trailing nul: 20 invalid BSON document
+bad length: 20 invalid BSON document
+bad length: 20 invalid BSON document
+bad length: 20 invalid BSON document
+unserialized: 20 invalid BSON document
+unserialized: 20 invalid BSON document
+unserialized: 20 invalid BSON document
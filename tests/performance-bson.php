@@ -0,0 +1,82 @@
+<?php
+/*
+ * Encode/decode throughput for the BSON serializer, no server needed.
+ *
+ *   php -d extension=mongo.so tests/performance-bson.php [seconds]
+ *
+ * Run it against two builds of the extension to compare them; each line is
+ * documents (and MB) per second for a given document shape.  The encoder is
+ * bound to the mongo.utf8/mongo.native_long/mongo.allow_empty_keys/mongo.cmd
+ * settings, so the same build can be compared against itself with e.g.
+ *
+ *   php -d extension=mongo.so -d mongo.utf8=0 -d mongo.native_long=1 tests/performance-bson.php
+ */
+
+$seconds = isset($argv[1]) ? (float)$argv[1] : 2.0;
+
+function micro_time()
+{
+  list($usec, $sec) = explode(" ", microtime());
+  return (float)$usec + (float)$sec;
+}
+
+function doc_with_fields($fields, $value)
+{
+  $doc = array();
+  for ($i = 0; $i < $fields; $i++) {
+    $doc["field$i"] = $value;
+  }
+  return $doc;
+}
+
+function nested($depth, $fields)
+{
+  $doc = doc_with_fields($fields, "some text value");
+  if ($depth > 0) {
+    $doc["child"] = nested($depth - 1, $fields);
+    $doc["list"] = array(nested($depth - 1, $fields), nested($depth - 1, $fields));
+  }
+  return $doc;
+}
+
+$shapes = array(
+  "small (10 fields)"       => doc_with_fields(10, 12345),
+  "mixed (100 fields)"      => array_merge(doc_with_fields(50, 12345), array_combine(
+                                 array_map(function($i) { return "name$i"; }, range(0, 49)),
+                                 array_fill(0, 50, "short text"))),
+  "many keys (1000 fields)" => doc_with_fields(1000, "x"),
+  "int list (10k)"          => array("values" => range(0, 9999)),
+  "double list (10k)"       => array("values" => array_map('floatval', range(0, 9999))),
+  "string list (10k)"       => array("tags" => array_map(function($i) { return "tag$i"; }, range(0, 9999))),
+  "text (200KB)"            => doc_with_fields(50, str_repeat("lorem ipsum ", 340)),
+  "text (800KB)"            => doc_with_fields(200, str_repeat("lorem ipsum ", 340)),
+  "utf-8 text (200KB)"      => doc_with_fields(50, str_repeat("l\xC3\xB6r\xE2\x82\xACm ", 340)),
+  "nested"                  => nested(4, 20),
+  "objects"                 => array("ids" => array_map(function($i) { return new MongoId(); }, range(1, 1000)),
+                                     "dates" => array_map(function($i) { return new MongoDate($i); }, range(1, 1000))),
+);
+
+foreach ($shapes as $name => $doc) {
+  $bson = bson_encode($doc);
+  $size = strlen($bson);
+
+  $n = 0;
+  $start = micro_time();
+  do {
+    for ($i = 0; $i < 10; $i++) {
+      bson_encode($doc);
+    }
+    $n += 10;
+  } while (($elapsed = micro_time() - $start) < $seconds);
+  printf("encode %-24s %10.0f docs/s %8.1f MB/s\n", $name, $n / $elapsed, $n * $size / $elapsed / 1048576);
+
+  $n = 0;
+  $start = micro_time();
+  do {
+    for ($i = 0; $i < 10; $i++) {
+      bson_decode($bson);
+    }
+    $n += 10;
+  } while (($elapsed = micro_time() - $start) < $seconds);
+  printf("decode %-24s %10.0f docs/s %8.1f MB/s\n", $name, $n / $elapsed, $n * $size / $elapsed / 1048576);
+}
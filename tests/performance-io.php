@@ -0,0 +1,91 @@
+<?php
+/*
+ * Socket throughput for big messages, against a mongod on localhost.
+ *
+ *   php -d extension=mongo.so tests/performance-io.php [seconds] [descriptors]
+ *
+ * Each line is round trips (and MB) per second for inserting or reading back
+ * documents of a given size.  Run it against two builds of the extension to
+ * compare them, and under strace to count the system calls each one makes:
+ *
+ *   strace -c -f -e trace=read,recv,recvfrom,send,sendto,writev,poll,select \
+ *     php -d extension=mongo.so tests/performance-io.php 1
+ *
+ * If descriptors is given, that many files are opened first, so the sockets
+ * get descriptors above FD_SETSIZE (raise ulimit -n to match).
+ *
+ * A single document can't be 16MB (that's the server's limit, overhead
+ * included), so 16MB messages are batch inserts of two 8MB documents and
+ * getmore replies for 1MB documents, which the server fills up to its reply
+ * size limit (16MB).
+ */
+
+$seconds = isset($argv[1]) ? (float)$argv[1] : 2.0;
+$files = array();
+for ($i = 0; $i < (isset($argv[2]) ? (int)$argv[2] : 0); $i++) {
+  $files[] = fopen(__FILE__, 'r');
+}
+
+$m = new Mongo();
+$c = $m->selectDB("test")->selectCollection("performance_io");
+
+function micro_time()
+{
+  list($usec, $sec) = explode(" ", microtime());
+  return (float)$usec + (float)$sec;
+}
+
+foreach (array("1KB" => 1024, "64KB" => 65536, "1MB" => 1048576, "8MB" => 8388608) as $name => $size) {
+  $doc = array("_id" => 0, "data" => new MongoBinData(str_repeat("x", $size)));
+  $c->drop();
+
+  $n = 0;
+  $start = micro_time();
+  do {
+    $doc["_id"] = $n++;
+    $c->insert($doc, array("safe" => true));
+  } while (($elapsed = micro_time() - $start) < $seconds);
+  printf("insert  %-6s %8.0f/s %8.1f MB/s\n", $name, $n / $elapsed, $n * $size / $elapsed / 1048576);
+
+  $count = $n;
+  $n = 0;
+  $start = micro_time();
+  do {
+    $c->findOne(array("_id" => $n++ % $count));
+  } while (($elapsed = micro_time() - $start) < $seconds);
+  printf("findOne %-6s %8.0f/s %8.1f MB/s\n", $name, $n / $elapsed, $n * $size / $elapsed / 1048576);
+}
+
+// 16MB messages
+$size = 8388608;
+$docs = array(array("data" => new MongoBinData(str_repeat("x", $size))),
+              array("data" => new MongoBinData(str_repeat("y", $size))));
+$c->drop();
+
+$n = 0;
+$start = micro_time();
+do {
+  unset($docs[0]["_id"], $docs[1]["_id"]);
+  $c->batchInsert($docs, array("safe" => true));
+  $n++;
+} while (($elapsed = micro_time() - $start) < $seconds);
+printf("batchInsert 2x8MB %8.0f/s %8.1f MB/s\n", $n / $elapsed, $n * 2 * $size / $elapsed / 1048576);
+
+$size = 1048576;
+$c->drop();
+for ($i = 0; $i < 32; $i++) {
+  $c->insert(array("_id" => $i, "data" => new MongoBinData(str_repeat("x", $size))), array("safe" => true));
+}
+
+$n = $docs = 0;
+$start = micro_time();
+do {
+  // the first reply stops at 1MB, the getmore brings the rest
+  foreach ($c->find()->batchSize(32) as $doc) {
+    $docs++;
+  }
+  $n++;
+} while (($elapsed = micro_time() - $start) < $seconds);
+printf("find    32x1MB %8.0f/s %8.1f MB/s\n", $n / $elapsed, $docs * $size / $elapsed / 1048576);
+
+$c->drop();
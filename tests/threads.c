@@ -0,0 +1,115 @@
+/**
+ *  Copyright 2009-2010 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Queries per second from several threads at once, each running its own
+ * request in a ZTS build of the embed SAPI, against a mongod on localhost:
+ *
+ *   make threads
+ *   ./threads /path/to/php.ini [threads] [seconds]
+ *
+ * php.ini has to load the extension (extension=mongo.so).  Compare the
+ * numbers for 1 thread and for more between two builds of the extension to
+ * see how much the threads wait for each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <php.h>
+#include <sapi/embed/php_embed.h>
+
+#ifndef ZTS
+# error "threads needs a ZTS build of PHP"
+#endif
+
+#define MAX_THREADS 64
+
+static char *script =
+  "$m = new Mongo();"
+  "$c = $m->selectDB('test')->selectCollection('threads');"
+  "$n = 0;"
+  "$end = microtime(true) + %d;"
+  "while (microtime(true) < $end) {"
+  "  $c->findOne(array('_id' => $n % 100));"
+  "  $n++;"
+  "}";
+
+static int seconds = 5;
+
+static void* run(void *arg) {
+  long *count = (long*)arg;
+  char *code;
+  zval **n;
+  void ***tsrm_ls = (void***)ts_resource(0);
+
+  if (php_request_startup(TSRMLS_C) == FAILURE) {
+    return 0;
+  }
+
+  spprintf(&code, 0, script, seconds);
+  zend_eval_string(code, NULL, "threads" TSRMLS_CC);
+  efree(code);
+
+  if (zend_hash_find(&EG(symbol_table), "n", sizeof("n"), (void**)&n) == SUCCESS) {
+    *count = Z_LVAL_PP(n);
+  }
+
+  php_request_shutdown(NULL);
+  ts_free_thread();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[MAX_THREADS];
+  long counts[MAX_THREADS], total = 0;
+  int num = 4, i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s php.ini [threads] [seconds]\n", argv[0]);
+    return 1;
+  }
+  php_embed_module.php_ini_path_override = argv[1];
+  if (argc > 2) {
+    num = atoi(argv[2]);
+    num = num < 1 ? 1 : num > MAX_THREADS ? MAX_THREADS : num;
+  }
+  if (argc > 3) {
+    seconds = atoi(argv[3]);
+  }
+
+  PHP_EMBED_START_BLOCK(0, 0);
+
+  zend_eval_string("$c = new Mongo(); $c = $c->selectDB('test')->selectCollection('threads');"
+                   "$c->drop();"
+                   "for ($i = 0; $i < 100; $i++) { $c->insert(array('_id' => $i, 'x' => str_repeat('x', 1000)), array('safe' => true)); }",
+                   NULL, "threads" TSRMLS_CC);
+
+  for (i = 0; i < num; i++) {
+    counts[i] = 0;
+    pthread_create(&threads[i], NULL, run, &counts[i]);
+  }
+  for (i = 0; i < num; i++) {
+    pthread_join(threads[i], NULL);
+    total += counts[i];
+  }
+
+  printf("%d threads: %.0f queries/s\n", num, (double)total / seconds);
+
+  PHP_EMBED_END_BLOCK();
+
+  return 0;
+}
@@ -21,6 +21,7 @@
 #include "unit.h"
 #include "lib/test_mongo.h"
 #include "lib/test_pool.h"
+#include "lib/test_bson.h"
 
 int main() {
   printf("Running tests...\n");
@@ -29,6 +30,7 @@ int main() {
 
   test_mongo();
   test_mongo_util_pool(TSRMLS_C);
+  test_bson(TSRMLS_C);
   
   PHP_EMBED_END_BLOCK();
   
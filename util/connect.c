@@ -28,6 +28,7 @@
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/un.h>
 #endif
 
@@ -37,6 +38,7 @@
 #include "connect.h"
 #include "server.h"
 #include "log.h"
+#include "io.h"
 
 extern zend_class_entry *mongo_ce_Mongo;
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
@@ -101,12 +103,6 @@ int mongo_util_connect(mongo_server *server, int timeout, zval *errmsg TSRMLS_DC
     }
     return FAILURE;
   }
-  if (server->socket > FD_SETSIZE) {
-    char *full_error;
-    spprintf(&full_error, 0, "You have too many open sockets (%d) to fit in the FD_SETSIZE (%d). The extension can't work around that.", server->socket, FD_SETSIZE);
-    ZVAL_STRING(errmsg, full_error, 0);
-    return FAILURE;
-  }
 #endif
 
   // timeout: set in ms or default of 20
@@ -146,6 +142,7 @@ int mongo_util_connect(mongo_server *server, int timeout, zval *errmsg TSRMLS_DC
       return FAILURE;
     }
 
+#ifdef WIN32
     while (1) {
       fd_set rset, wset, eset;
 
@@ -179,6 +176,22 @@ int mongo_util_connect(mongo_server *server, int timeout, zval *errmsg TSRMLS_DC
       }
     }
 
+#else
+    {
+      int revents = mongo_io_wait(server->socket, POLLIN|POLLOUT|POLLPRI, tval.tv_sec * 1000 + tval.tv_usec / 1000, 0);
+
+      // timed out, or our descriptor has an error
+      if (revents <= 0 || (revents & (POLLPRI|POLLNVAL))) {
+        if (errmsg) {
+          ZVAL_STRING(errmsg, revents == 0 ? "connection timed out" : strerror(errno), 1);
+        }
+        mongo_util_disconnect(server TSRMLS_CC);
+        return FAILURE;
+      }
+      // otherwise it's connected or failed, getpeername will tell
+    }
+#endif
+
     size = sn;
 
     connected = getpeername(server->socket, sa, &size);
@@ -353,7 +366,14 @@ int mongo_util_connect__sockaddr(struct sockaddr *sa, int family, char *host, in
 int mongo_util_disconnect(mongo_server *server TSRMLS_DC) {
   pid_t pid;
 
-  if (!server || !server->socket) {
+  if (!server) {
+    return 0;
+  }
+
+  // replies still owed on this socket won't be read now
+  php_mongo_forget_replies(server TSRMLS_CC);
+
+  if (!server->socket) {
     return 0;
   }
 
@@ -16,7 +16,10 @@
  */
 
 #ifndef WIN32
-#include <pthread.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #endif
 
 #include <php.h>
@@ -31,16 +34,31 @@
 #include "rs.h"
 #include "link.h"
 
-#if WIN32
-HANDLE io_mutex;
-#else
-static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
-
-static int get_cursor_header(int sock, mongo_cursor *cursor TSRMLS_DC);
+static int get_reply_header(int sock, mongo_server *server, int timeout, mongo_pending *header TSRMLS_DC);
 static int get_cursor_body(int sock, mongo_cursor *cursor TSRMLS_DC);
+static int get_pending_body(int sock, mongo_pending *pending TSRMLS_DC);
+static void set_cursor_reply(mongo_cursor *cursor, mongo_pending *header);
+static mongo_pending* find_pending(mongo_server *server, int request_id, int remove);
+static void discard_pending(mongo_server *server, mongo_pending *pending TSRMLS_DC);
 static mongo_cursor* make_persistent_cursor(mongo_cursor *cursor);
 static void make_unpersistent_cursor(mongo_cursor *pcursor, mongo_cursor *cursor);
+static int say_scattered(int sock, buffer *buf, zval *errmsg TSRMLS_DC);
+
+// reads of a known length wait for all of it, so they take one call
+#if defined(MSG_WAITALL) && !defined(WIN32)
+#define RECV_FLAGS (FLAGS|MSG_WAITALL)
+#else
+#define RECV_FLAGS FLAGS
+#endif
+
+#ifdef WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#elif !defined(IOV_MAX)
+#define IOV_MAX 16
+#endif
 
 /**
  * Blocks until socket is ready.  Returns FAILURE and throws an exception if
@@ -54,42 +72,81 @@ extern zend_class_entry *mongo_ce_CursorTOException;
 
 /*
  * throws exception on FAILURE
+ *
+ * There's no lock around this: a socket belongs to the one mongo_server that
+ * took it from the pool (mongo_util_pool__stack_pop unlinks it under the pool
+ * lock, and only mongo_util_pool_done puts it back), and a mongo_server is only
+ * used by the thread whose request created it (persistent ones are kept in
+ * EG(persistent_list), which is per thread with ZTS), so no other thread can
+ * be reading from it.  tests/threads.c measures this with several threads.
  */
 int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC) {
-  int retval = 0;
-
-  LOCK(io);
+  int sock;
+  mongo_server *server = cursor->server;
+  mongo_pending header, *pending;
 
-  retval = php_mongo__get_reply(cursor, errmsg TSRMLS_CC);
+  mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "hearing something");
+  sock = server->socket;
+
+  // another cursor may have read it already
+  if ((pending = find_pending(server, cursor->send.request_id, 1)) != 0) {
+    if (pending->reply) {
+      set_cursor_reply(cursor, pending);
+      efree(pending);
+      ZVAL_NULL(errmsg);
+      return SUCCESS;
+    }
+    efree(pending);
+  }
 
-  UNLOCK(io);
+  // read replies to the requests sent ahead of ours until ours comes
+  while (1) {
+    if (get_reply_header(sock, server, cursor->timeout, &header TSRMLS_CC) == FAILURE) {
+      return FAILURE;
+    }
 
-  return retval;
-}
+    if (header.recv.response_to == cursor->send.request_id) {
+      break;
+    }
 
-int php_mongo__get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC) {
-  int sock;
+    mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "reading reply to %d while waiting for %d", header.recv.response_to, cursor->send.request_id);
+
+    if ((pending = find_pending(server, header.recv.response_to, 0)) != 0 && !pending->reply) {
+      pending->recv = header.recv;
+      pending->flag = header.flag;
+      pending->cursor_id = header.cursor_id;
+      pending->start = header.start;
+      pending->num = header.num;
+      if (get_pending_body(sock, pending TSRMLS_CC) == FAILURE) {
+        mongo_cursor_throw(server, 12 TSRMLS_CC, "error getting database response");
+        return FAILURE;
+      }
+    }
+    // nobody is waiting for this one (it timed out or was reset)
+    else {
+      if (get_pending_body(sock, &header TSRMLS_CC) == FAILURE) {
+        mongo_cursor_throw(server, 12 TSRMLS_CC, "error getting database response");
+        return FAILURE;
+      }
+      discard_pending(server, &header TSRMLS_CC);
+    }
 
-  mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "hearing something");
-  sock = cursor->server->socket;
+    // replies come in order, so if this one is newer, ours isn't coming
+    if (header.recv.response_to > cursor->send.request_id) {
+      mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "request/cursor mismatch: %d vs %d", cursor->send.request_id, header.recv.response_to);
 
-  if (get_cursor_header(sock, cursor TSRMLS_CC) == FAILURE) {
-    return FAILURE;
+      mongo_cursor_throw(server, 9 TSRMLS_CC, "request/cursor mismatch: %d vs %d", cursor->send.request_id, header.recv.response_to);
+      return FAILURE;
+    }
   }
 
-  // check that this is actually the response we want
-  if (cursor->send.request_id != cursor->recv.response_to) {
-    mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "request/cursor mismatch: %d vs %d", cursor->send.request_id, cursor->recv.response_to);
-
-    mongo_cursor_throw(cursor->server, 9 TSRMLS_CC, "request/cursor mismatch: %d vs %d", cursor->send.request_id, cursor->recv.response_to);
-    return FAILURE;
-  }
+  set_cursor_reply(cursor, &header);
 
   if (FAILURE == get_cursor_body(sock, cursor TSRMLS_CC)) {
 #ifdef WIN32
-    mongo_cursor_throw(cursor->server, 12 TSRMLS_CC, "WSA error getting database response: %d", WSAGetLastError());
+    mongo_cursor_throw(server, 12 TSRMLS_CC, "WSA error getting database response: %d", WSAGetLastError());
 #else
-    mongo_cursor_throw(cursor->server, 12 TSRMLS_CC, "error getting database response: %d", strerror(errno));
+    mongo_cursor_throw(server, 12 TSRMLS_CC, "error getting database response: %d", strerror(errno));
 #endif
     return FAILURE;
   }
@@ -100,6 +157,153 @@ int php_mongo__get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC) {
   return SUCCESS;
 }
 
+void php_mongo_expect_reply(mongo_server *server, int request_id) {
+  mongo_pending *pending = (mongo_pending*)ecalloc(1, sizeof(mongo_pending));
+
+  pending->request_id = request_id;
+  pending->next = server->pending;
+  server->pending = pending;
+}
+
+void php_mongo_forget_reply(mongo_server *server, int request_id TSRMLS_DC) {
+  mongo_pending *pending;
+
+  if ((pending = find_pending(server, request_id, 1)) != 0) {
+    discard_pending(server, pending TSRMLS_CC);
+    efree(pending);
+  }
+}
+
+void php_mongo_forget_replies(mongo_server *server TSRMLS_DC) {
+  mongo_pending *next;
+
+  while (server->pending) {
+    next = server->pending->next;
+    if (server->pending->reply) {
+      mongo_util_reply_release(server->pending->reply);
+    }
+    efree(server->pending);
+    server->pending = next;
+  }
+}
+
+/*
+ * Returns the pending request with the given id, taking it off the server's
+ * list if remove is set.
+ */
+static mongo_pending* find_pending(mongo_server *server, int request_id, int remove) {
+  mongo_pending **link = &server->pending, *pending;
+
+  while ((pending = *link) != 0) {
+    if (pending->request_id == request_id) {
+      if (remove) {
+        *link = pending->next;
+      }
+      return pending;
+    }
+    link = &pending->next;
+  }
+
+  return 0;
+}
+
+/*
+ * Frees a reply that no cursor will read, killing the database cursor it
+ * opened, if any.
+ */
+static void discard_pending(mongo_server *server, mongo_pending *pending TSRMLS_DC) {
+  if (pending->reply) {
+    mongo_util_reply_release(pending->reply);
+    pending->reply = 0;
+  }
+
+  if (pending->cursor_id != 0 && server->connected) {
+    char quickbuf[128];
+    buffer buf;
+    zval temp;
+
+    buf.pos = quickbuf;
+    buf.start = buf.pos;
+    buf.end = buf.start + 128;
+    buf.ref_min = buf.ref_count = 0;
+    buf.refs = 0;
+
+    php_mongo_write_kill_cursors(&buf, pending->cursor_id TSRMLS_CC);
+
+    Z_TYPE(temp) = IS_NULL;
+    _mongo_say(server->socket, &buf, &temp TSRMLS_CC);
+    if (Z_TYPE(temp) == IS_STRING) {
+      efree(Z_STRVAL(temp));
+    }
+  }
+}
+
+#ifndef WIN32
+int mongo_io_wait(int sock, short events, int timeout, int *left) {
+  struct pollfd pfd;
+  struct timeval start, now;
+  int wait = timeout;
+
+  gettimeofday(&start, 0);
+
+  while (1) {
+    int status;
+
+    pfd.fd = sock;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    if (left) {
+      *left = wait;
+    }
+
+    status = poll(&pfd, 1, wait);
+    if (status > 0) {
+      return pfd.revents;
+    }
+    if (status == 0 || errno != EINTR) {
+      return status;
+    }
+
+    // interrupted, wait for whatever is left
+    gettimeofday(&now, 0);
+    wait = timeout - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+    if (wait < 0) {
+      wait = 0;
+    }
+  }
+}
+
+/*
+ * poll() doesn't care how high the descriptor is, unlike select(), which can't
+ * go past FD_SETSIZE.
+ */
+static int do_timeout(mongo_server *server, int to TSRMLS_DC) {
+  int left, revents;
+
+  revents = mongo_io_wait(server->socket, POLLIN|POLLPRI, to, &left);
+
+  if (revents == -1) {
+    mongo_cursor_throw(server, 13 TSRMLS_CC, strerror(errno));
+    return FAILURE;
+  }
+
+  if (revents == 0) {
+    zend_throw_exception_ex(mongo_ce_CursorTOException, 0 TSRMLS_CC,
+                            "cursor timed out (timeout: %d, time left: %d:%d, status: %d)",
+                            to, left / 1000, (left % 1000) * 1000, 0);
+    return FAILURE;
+  }
+
+  if (revents & (POLLPRI|POLLNVAL)) {
+    mongo_cursor_throw(server, 17 TSRMLS_CC, "Exceptional condition on socket");
+    return FAILURE;
+  }
+
+  // readable, or closed or failed, which recv will report
+  return SUCCESS;
+}
+#else
 static int do_timeout(mongo_server *server, int to TSRMLS_DC) {
   struct timeval timeout;
   int sock = server->socket;
@@ -148,86 +352,126 @@ static int do_timeout(mongo_server *server, int to TSRMLS_DC) {
 
   return SUCCESS;
 }
+#endif
 
 /*
- * This method reads the message header for a database response
+ * This method reads the message header for a database response into header,
+ * whichever request it answers.
  * It returns failure or success and throws an exception on failure.
  */
-static int get_cursor_header(int sock, mongo_cursor *cursor TSRMLS_DC) {
+static int get_reply_header(int sock, mongo_server *server, int timeout, mongo_pending *header TSRMLS_DC) {
   int status = 0;
-  int num_returned = 0;
   char buf[REPLY_HEADER_LEN];
 
   // set a timeout
-  if (cursor->timeout && cursor->timeout > 0 &&
-      do_timeout(cursor->server, cursor->timeout TSRMLS_CC) == FAILURE) {
+  if (timeout && timeout > 0 &&
+      do_timeout(server, timeout TSRMLS_CC) == FAILURE) {
     return FAILURE;
   }
 
-  status = recv(sock, buf, REPLY_HEADER_LEN, FLAGS);
+  status = mongo_hear(sock, buf, REPLY_HEADER_LEN TSRMLS_CC);
   // socket has been closed, retry
   if (status == 0) {
     return FAILURE;
   }
-  else if (status < INT_32*4) {
-    mongo_cursor_throw(cursor->server, 4 TSRMLS_CC, "couldn't get response header");
+  else if (status < REPLY_HEADER_LEN) {
+    mongo_cursor_throw(server, 4 TSRMLS_CC, "couldn't get response header");
     return FAILURE;
   }
 
   // switch the byte order, if necessary
-  cursor->recv.length = MONGO_32(*(int*)buf);
+  header->recv.length = MONGO_32(*(int*)buf);
 
   // make sure we're not getting crazy data
-  if (cursor->recv.length == 0) {
-    mongo_cursor_throw(cursor->server, 5 TSRMLS_CC, "no db response");
+  if (header->recv.length == 0) {
+    mongo_cursor_throw(server, 5 TSRMLS_CC, "no db response");
     return FAILURE;
   }
-  else if (cursor->recv.length < REPLY_HEADER_SIZE) {
-    mongo_cursor_throw(cursor->server, 6 TSRMLS_CC,
+  else if (header->recv.length < REPLY_HEADER_SIZE) {
+    mongo_cursor_throw(server, 6 TSRMLS_CC,
                        "bad response length: %d, did the db assert?",
-                       cursor->recv.length);
+                       header->recv.length);
     return FAILURE;
   }
 
-  cursor->recv.request_id  = MONGO_32(*(int*)(buf+INT_32));
-  cursor->recv.response_to = MONGO_32(*(int*)(buf+INT_32*2));
-  cursor->recv.op          = MONGO_32(*(int*)(buf+INT_32*3));
-  cursor->flag             = MONGO_32(*(int*)(buf+INT_32*4));
-  cursor->cursor_id        = MONGO_64(*(int64_t*)(buf+INT_32*5));
-  cursor->start            = MONGO_32(*(int*)(buf+INT_32*5+INT_64));
-  num_returned             = MONGO_32(*(int*)(buf+INT_32*6+INT_64));
-
-  if (cursor->recv.response_to > MonGlo(response_num)) {
-    MonGlo(response_num) = cursor->recv.response_to;
+  header->recv.request_id  = MONGO_32(*(int*)(buf+INT_32));
+  header->recv.response_to = MONGO_32(*(int*)(buf+INT_32*2));
+  header->recv.op          = MONGO_32(*(int*)(buf+INT_32*3));
+  header->flag             = MONGO_32(*(int*)(buf+INT_32*4));
+  header->cursor_id        = MONGO_64(*(int64_t*)(buf+INT_32*5));
+  header->start            = MONGO_32(*(int*)(buf+INT_32*5+INT_64));
+  header->num              = MONGO_32(*(int*)(buf+INT_32*6+INT_64));
+  header->reply            = 0;
+
+  if (header->recv.response_to > MonGlo(response_num)) {
+    MonGlo(response_num) = header->recv.response_to;
   }
 
-  // cursor->num is the total of the elements we've retrieved (elements already
-  // iterated through + elements in db response but not yet iterated through)
-  cursor->num += num_returned;
-
   // create buf
-  cursor->recv.length -= REPLY_HEADER_LEN;
+  header->recv.length -= REPLY_HEADER_LEN;
 
   return SUCCESS;
 }
 
+/*
+ * Copies the reply header fields into the cursor, along with the documents if
+ * they've already been read.
+ */
+static void set_cursor_reply(mongo_cursor *cursor, mongo_pending *header) {
+  cursor->recv = header->recv;
+  cursor->flag = header->flag;
+  cursor->cursor_id = header->cursor_id;
+  cursor->start = header->start;
+
+  // cursor->num is the total of the elements we've retrieved (elements already
+  // iterated through + elements in db response but not yet iterated through)
+  cursor->num += header->num;
+
+  if (header->reply) {
+    if (cursor->reply) {
+      mongo_util_reply_release(cursor->reply);
+    }
+    cursor->reply = header->reply;
+    cursor->buf.start = cursor->reply->data;
+    cursor->buf.end = cursor->buf.start + cursor->recv.length;
+    cursor->buf.pos = cursor->buf.start;
+  }
+}
+
 static int get_cursor_body(int sock, mongo_cursor *cursor TSRMLS_DC) {
-  if (cursor->buf.start) {
-    efree(cursor->buf.start);
+  // lazy documents from the last batch may still be using it
+  if (cursor->reply) {
+    mongo_util_reply_release(cursor->reply);
   }
 
-  cursor->buf.start = (char*)emalloc(cursor->recv.length);
+  cursor->reply = mongo_util_reply_new(cursor->recv.length);
+  cursor->buf.start = cursor->reply->data;
   cursor->buf.end = cursor->buf.start + cursor->recv.length;
   cursor->buf.pos = cursor->buf.start;
 
   // finish populating cursor
-  return mongo_hear(sock, cursor->buf.pos, cursor->recv.length TSRMLS_CC);
+  if (mongo_hear(sock, cursor->buf.pos, cursor->recv.length TSRMLS_CC) != cursor->recv.length) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+static int get_pending_body(int sock, mongo_pending *pending TSRMLS_DC) {
+  pending->reply = mongo_util_reply_new(pending->recv.length);
+
+  if (mongo_hear(sock, pending->reply->data, pending->recv.length TSRMLS_CC) != pending->recv.length) {
+    mongo_util_reply_release(pending->reply);
+    pending->reply = 0;
+    return FAILURE;
+  }
+  return SUCCESS;
 }
 
 /*
  * Low-level send function.
  *
- * Goes through the buffer sending 4K byte batches.
+ * Sends the whole buffer, header and body, with as few calls as the kernel
+ * allows (usually one).
  * On failure, sets errmsg to errno string.
  * On success, returns number of bytes sent.
  * Does not attempt to reconnect nor throw any exceptions.
@@ -239,20 +483,96 @@ int _mongo_say(int sock, buffer *buf, zval *errmsg TSRMLS_DC) {
 
   mongo_log(MONGO_LOG_IO, MONGO_LOG_FINE TSRMLS_CC, "saying something");
 
+  if (buf->ref_count) {
+    return say_scattered(sock, buf, errmsg TSRMLS_CC);
+  }
+
   total = buf->pos - buf->start;
 
   while (sent < total && status > 0) {
-    int len = 4096 < (total - sent) ? 4096 : total - sent;
+    status = send(sock, (const char*)buf->start + sent, total - sent, FLAGS);
 
-    status = send(sock, (const char*)buf->start + sent, len, FLAGS);
+    if (status == FAILURE) {
+#ifndef WIN32
+      if (errno == EINTR) {
+        status = 1;
+        continue;
+      }
+#endif
+      ZVAL_STRING(errmsg, strerror(errno), 1);
+      return FAILURE;
+    }
+    sent += status;
+  }
+
+  return sent;
+}
+
+/*
+ * Sends a buffer with references to strings that weren't copied into it (see
+ * php_mongo_buf_get): the buffer's bytes and the strings go out in order,
+ * with writev where there is one.
+ */
+static int say_scattered(int sock, buffer *buf, zval *errmsg TSRMLS_DC) {
+  int i, count = 0, copied = 0, sent = 0, total = php_mongo_buf_len(buf, buf->start);
+  struct iovec *iov = (struct iovec*)safe_emalloc(buf->ref_count * 2 + 1, sizeof(struct iovec), 0), *next;
+
+  for (i = 0; i < buf->ref_count; i++) {
+    mongo_buf_ref *ref = &buf->refs[i];
+
+    if (ref->offset > copied) {
+      iov[count].iov_base = buf->start + copied;
+      iov[count].iov_len = ref->offset - copied;
+      count++;
+      copied = ref->offset;
+    }
+    iov[count].iov_base = ref->data;
+    iov[count].iov_len = ref->len;
+    count++;
+  }
+  if (buf->start + copied < buf->pos) {
+    iov[count].iov_base = buf->start + copied;
+    iov[count].iov_len = buf->pos - (buf->start + copied);
+    count++;
+  }
+
+  next = iov;
+  while (sent < total && count > 0) {
+#ifdef WIN32
+    int status = send(sock, (const char*)next->iov_base, next->iov_len, FLAGS);
+#else
+    int status = writev(sock, next, count < IOV_MAX ? count : IOV_MAX);
+#endif
 
     if (status == FAILURE) {
+#ifndef WIN32
+      // interrupted before anything was sent, go again
+      if (errno == EINTR) {
+        continue;
+      }
+#endif
       ZVAL_STRING(errmsg, strerror(errno), 1);
+      efree(iov);
       return FAILURE;
     }
+    if (status == 0) {
+      break;
+    }
     sent += status;
+
+    // skip over whatever was sent
+    while (count > 0 && status >= (int)next->iov_len) {
+      status -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char*)next->iov_base + status;
+      next->iov_len -= status;
+    }
   }
 
+  efree(iov);
   return sent;
 }
 
@@ -273,14 +593,27 @@ int mongo_say(mongo_server *server, buffer *buf, zval *errmsg TSRMLS_DC) {
 int mongo_hear(int sock, void *dest, int total_len TSRMLS_DC) {
   int num = 1, received = 0;
 
-  // this can return FAILED if there is just no more data from db
+  // this can return FAILED if there is just no more data from db.  With
+  // MSG_WAITALL (not on windows), recv only comes back early if the
+  // connection closes or a signal arrives.
   while(received < total_len && num > 0) {
+#ifdef WIN32
     int len = 4096 < (total_len - received) ? 4096 : total_len - received;
 
     // windows gives a WSAEFAULT if you try to get more bytes
-    num = recv(sock, (char*)dest, len, FLAGS);
+    num = recv(sock, (char*)dest, len, RECV_FLAGS);
+#else
+    num = recv(sock, (char*)dest, total_len - received, RECV_FLAGS);
+#endif
 
     if (num < 0) {
+#ifndef WIN32
+      // winsock errors don't go through errno
+      if (errno == EINTR) {
+        num = 1;
+        continue;
+      }
+#endif
       return FAILURE;
     }
 
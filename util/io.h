@@ -29,6 +29,33 @@ int _mongo_say(int sock, buffer *buf, zval *errmsg TSRMLS_DC);
  */
 int mongo_hear(int sock, void*, int TSRMLS_DC);
 int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC);
-int php_mongo__get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC);
+
+/**
+ * Notes that the reply to request_id will be read later, so a cursor reading
+ * its own reply on server parks it instead of taking it for a stray.
+ */
+void php_mongo_expect_reply(mongo_server *server, int request_id);
+
+/**
+ * Drops the reply to request_id, if it was expected, killing the database
+ * cursor it opened if it has already arrived.
+ */
+void php_mongo_forget_reply(mongo_server *server, int request_id TSRMLS_DC);
+
+/**
+ * Drops every expected reply, for when server's socket is closed or given
+ * back to the pool.
+ */
+void php_mongo_forget_replies(mongo_server *server TSRMLS_DC);
+
+#ifndef WIN32
+/**
+ * Waits up to timeout ms for one of events (POLLIN, POLLOUT, ...) on sock,
+ * going back to waiting if a signal interrupts it.  Returns the events that
+ * happened, 0 on timeout, or -1 with errno set.  If left isn't NULL, it's set
+ * to the time the last wait was given.
+ */
+int mongo_io_wait(int sock, short events, int timeout, int *left);
+#endif
 
 #endif
@@ -0,0 +1,1275 @@
+// json.c
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <php.h>
+#include <zend_exceptions.h>
+#include <ext/standard/base64.h>
+
+#include "../php_mongo.h"
+#include "../bson.h"
+#include "../mongo_types.h"
+#include "json.h"
+
+extern zend_class_entry *mongo_ce_Exception;
+
+// nesting of documents php_mongo_bson_to_json will follow
+#define MONGO_JSON_MAX_DEPTH 100
+
+static char* json_document(smart_str *json, char *buf, char *end, int list, int flags, int depth TSRMLS_DC);
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const struct {
+  char *option;
+  char *value;
+  int set;
+  int clear;
+} json_options[] = {
+  { "id", "object", 0, MONGO_JSON_ID_AS_STRING },
+  { "id", "string", MONGO_JSON_ID_AS_STRING, 0 },
+  { "date", "object", 0, MONGO_JSON_DATE_AS_INT|MONGO_JSON_DATE_AS_ISO },
+  { "date", "int", MONGO_JSON_DATE_AS_INT, MONGO_JSON_DATE_AS_ISO },
+  { "date", "iso", MONGO_JSON_DATE_AS_ISO, MONGO_JSON_DATE_AS_INT },
+  { "binary", "base64", 0, MONGO_JSON_BIN_EXTENDED },
+  { "binary", "extended", MONGO_JSON_BIN_EXTENDED, 0 },
+  { "long", "number", 0, MONGO_JSON_LONG_AS_STRING },
+  { "long", "string", MONGO_JSON_LONG_AS_STRING, 0 },
+  { 0, 0, 0, 0 }
+};
+
+int php_mongo_json_flags(HashTable *options, int *flags TSRMLS_DC) {
+  HashPosition pos;
+  zval **value;
+
+  for (zend_hash_internal_pointer_reset_ex(options, &pos);
+       zend_hash_get_current_data_ex(options, (void**)&value, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(options, &pos)) {
+    char *key;
+    uint key_len;
+    ulong index;
+    int i;
+
+    if (zend_hash_get_current_key_ex(options, &key, &key_len, &index, NO_DUP, &pos) != HASH_KEY_IS_STRING) {
+      key = "";
+    }
+
+    for (i = 0; json_options[i].option; i++) {
+      if (strcmp(key, json_options[i].option) == 0 && Z_TYPE_PP(value) == IS_STRING &&
+          strcmp(Z_STRVAL_PP(value), json_options[i].value) == 0) {
+        break;
+      }
+    }
+
+    if (!json_options[i].option) {
+      zend_throw_exception_ex(mongo_ce_Exception, 25 TSRMLS_CC, "invalid JSON option \"%s\"", key);
+      return FAILURE;
+    }
+
+    *flags = (*flags & ~json_options[i].clear) | json_options[i].set;
+  }
+
+  return SUCCESS;
+}
+
+static void json_escape(smart_str *json, unsigned int c) {
+  smart_str_appendl(json, "\\u", 2);
+  smart_str_appendc(json, hex_digits[(c >> 12) & 0xf]);
+  smart_str_appendc(json, hex_digits[(c >> 8) & 0xf]);
+  smart_str_appendc(json, hex_digits[(c >> 4) & 0xf]);
+  smart_str_appendc(json, hex_digits[c & 0xf]);
+}
+
+/*
+ * Writes a UTF-8 string the way json_encode() does: quotes, backslashes,
+ * slashes and control characters are escaped, and so is everything outside
+ * ASCII, as UTF-16.  Malformed sequences become U+FFFD.
+ */
+static void json_string(smart_str *json, char *str, int len) {
+  unsigned char *s = (unsigned char*)str, *end = s + len, *plain = s;
+
+  smart_str_appendc(json, '"');
+
+  while (s < end) {
+    unsigned int c = *s;
+
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\' && c != '/') {
+      s++;
+      continue;
+    }
+
+    // copy the run of characters that don't need escaping in one go
+    smart_str_appendl(json, (char*)plain, s - plain);
+    s++;
+
+    if (c >= 0x80) {
+      int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : -1, i;
+      unsigned int min = extra == 3 ? 0x10000 : extra == 2 ? 0x800 : 0x80;
+
+      if (extra < 0 || extra > end - s) {
+        c = 0xfffd;
+      }
+      else {
+        c &= 0x3f >> extra;
+        for (i = 0; i < extra && (s[i] & 0xc0) == 0x80; i++) {
+          c = (c << 6) | (s[i] & 0x3f);
+        }
+
+        if (i < extra || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+          c = 0xfffd;
+        }
+        else {
+          s += extra;
+        }
+      }
+
+      if (c >= 0x10000) {
+        c -= 0x10000;
+        json_escape(json, 0xd800 | (c >> 10));
+        json_escape(json, 0xdc00 | (c & 0x3ff));
+      }
+      else {
+        json_escape(json, c);
+      }
+    }
+    else {
+      switch (c) {
+      case '"':
+        smart_str_appendl(json, "\\\"", 2);
+        break;
+      case '\\':
+        smart_str_appendl(json, "\\\\", 2);
+        break;
+      case '/':
+        smart_str_appendl(json, "\\/", 2);
+        break;
+      case '\b':
+        smart_str_appendl(json, "\\b", 2);
+        break;
+      case '\f':
+        smart_str_appendl(json, "\\f", 2);
+        break;
+      case '\n':
+        smart_str_appendl(json, "\\n", 2);
+        break;
+      case '\r':
+        smart_str_appendl(json, "\\r", 2);
+        break;
+      case '\t':
+        smart_str_appendl(json, "\\t", 2);
+        break;
+      default:
+        json_escape(json, c);
+      }
+    }
+
+    plain = s;
+  }
+
+  smart_str_appendl(json, (char*)plain, s - plain);
+  smart_str_appendc(json, '"');
+}
+
+static void json_long(smart_str *json, int64_t l, int quote) {
+  char digits[32];
+  int len;
+
+#ifdef WIN32
+  len = _snprintf(digits, sizeof(digits), "%I64d", l);
+#else
+  len = snprintf(digits, sizeof(digits), "%lld", (long long int)l);
+#endif
+
+  if (quote) {
+    smart_str_appendc(json, '"');
+  }
+  smart_str_appendl(json, digits, len);
+  if (quote) {
+    smart_str_appendc(json, '"');
+  }
+}
+
+static void json_id(smart_str *json, unsigned char *id, int flags) {
+  int i;
+
+  if (!(flags & MONGO_JSON_ID_AS_STRING)) {
+    smart_str_appendl(json, "{\"$id\":", 7);
+  }
+
+  smart_str_appendc(json, '"');
+  for (i = 0; i < OID_SIZE; i++) {
+    smart_str_appendc(json, hex_digits[id[i] >> 4]);
+    smart_str_appendc(json, hex_digits[id[i] & 0xf]);
+  }
+  smart_str_appendc(json, '"');
+
+  if (!(flags & MONGO_JSON_ID_AS_STRING)) {
+    smart_str_appendc(json, '}');
+  }
+}
+
+static void json_date(smart_str *json, int64_t d, int flags) {
+  if (flags & MONGO_JSON_DATE_AS_INT) {
+    json_long(json, d, 0);
+  }
+  else if (flags & MONGO_JSON_DATE_AS_ISO) {
+    // rounded down, for dates before 1970
+    int64_t sec = d >= 0 ? d / 1000 : -((999 - d) / 1000);
+    time_t t = (time_t)sec;
+    struct tm tm;
+    char iso[32];
+    int len;
+
+    php_gmtime_r(&t, &tm);
+    len = snprintf(iso, sizeof(iso), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                   (int)(d - sec * 1000));
+
+    smart_str_appendc(json, '"');
+    smart_str_appendl(json, iso, len);
+    smart_str_appendc(json, '"');
+  }
+  else {
+    // the same numbers as a decoded MongoDate
+    smart_str_appendl(json, "{\"sec\":", 7);
+    smart_str_append_long(json, (long)(d / 1000));
+    smart_str_appendl(json, ",\"usec\":", 8);
+    smart_str_append_long(json, (long)((d * 1000) % 1000000));
+    smart_str_appendc(json, '}');
+  }
+}
+
+static void json_binary(smart_str *json, char *data, int flags) {
+  unsigned char *encoded, subtype;
+  int len, encoded_len;
+
+  memcpy(&len, data, INT_32);
+  len = MONGO_32(len);
+  subtype = data[INT_32];
+  data += INT_32 + BYTE_8;
+
+  // the old binary subtype repeats the length, see decode_value
+  if (subtype == 2 && len >= INT_32) {
+    int len2;
+
+    memcpy(&len2, data, INT_32);
+    if (MONGO_32(len2) == len - INT_32) {
+      len -= INT_32;
+      data += INT_32;
+    }
+  }
+
+  encoded = php_base64_encode((unsigned char*)data, len, &encoded_len);
+
+  if (flags & MONGO_JSON_BIN_EXTENDED) {
+    smart_str_appendl(json, "{\"$binary\":", 11);
+    json_string(json, (char*)encoded, encoded_len);
+    smart_str_appendl(json, ",\"$type\":\"", 10);
+    smart_str_appendc(json, hex_digits[subtype >> 4]);
+    smart_str_appendc(json, hex_digits[subtype & 0xf]);
+    smart_str_appendl(json, "\"}", 2);
+  }
+  else {
+    json_string(json, (char*)encoded, encoded_len);
+  }
+
+  efree(encoded);
+}
+
+/*
+ * Writes a value of the given type, which php_mongo_bson_value_size has found
+ * to be size bytes long.
+ */
+static int json_value(smart_str *json, char type, char *data, int size, int flags, int depth TSRMLS_DC) {
+  int32_t i;
+  int64_t l;
+
+  switch (type) {
+  case BSON_DOUBLE: {
+    double d;
+
+    memcpy(&l, data, DOUBLE_64);
+    l = MONGO_64(l);
+    memcpy(&d, &l, DOUBLE_64);
+
+    if (zend_isinf(d) || zend_isnan(d)) {
+      zend_error(E_WARNING, "double %.9g does not conform to the JSON spec, encoded as 0", d);
+      smart_str_appendc(json, '0');
+    }
+    else {
+      char *str;
+      int len = spprintf(&str, 0, "%.*k", (int)EG(precision), d);
+
+      smart_str_appendl(json, str, len);
+      efree(str);
+    }
+    break;
+  }
+  case BSON_STRING:
+  case BSON_SYMBOL:
+    json_string(json, data + INT_32, size - INT_32 - BYTE_8);
+    break;
+  case BSON_OBJECT:
+  case BSON_ARRAY:
+    if (json_document(json, data, data + size, type == BSON_ARRAY, flags, depth + 1 TSRMLS_CC) == 0) {
+      return FAILURE;
+    }
+    break;
+  case BSON_BINARY:
+    json_binary(json, data, flags);
+    break;
+  case BSON_UNDEF:
+  case BSON_NULL:
+    smart_str_appendl(json, "null", 4);
+    break;
+  case BSON_OID:
+    json_id(json, (unsigned char*)data, flags);
+    break;
+  case BSON_BOOL:
+    if (*data) {
+      smart_str_appendl(json, "true", 4);
+    }
+    else {
+      smart_str_appendl(json, "false", 5);
+    }
+    break;
+  case BSON_DATE:
+    memcpy(&l, data, INT_64);
+    json_date(json, MONGO_64(l), flags);
+    break;
+  case BSON_REGEX: {
+    int regex_len = strlen(data);
+
+    smart_str_appendl(json, "{\"regex\":", 9);
+    json_string(json, data, regex_len);
+    smart_str_appendl(json, ",\"flags\":", 9);
+    json_string(json, data + regex_len + 1, size - regex_len - 2);
+    smart_str_appendc(json, '}');
+    break;
+  }
+  case BSON_DBREF: {
+    memcpy(&i, data, INT_32);
+    i = MONGO_32(i);
+
+    smart_str_appendl(json, "{\"$ref\":", 8);
+    json_string(json, data + INT_32, i - 1);
+    smart_str_appendl(json, ",\"$id\":", 7);
+    json_id(json, (unsigned char*)data + INT_32 + i, flags);
+    smart_str_appendc(json, '}');
+    break;
+  }
+  case BSON_CODE__D:
+    smart_str_appendl(json, "{\"code\":", 8);
+    json_string(json, data + INT_32, size - INT_32 - BYTE_8);
+    smart_str_appendl(json, ",\"scope\":{}}", 12);
+    break;
+  case BSON_CODE: {
+    // total length, code, scope
+    memcpy(&i, data + INT_32, INT_32);
+    i = MONGO_32(i);
+
+    smart_str_appendl(json, "{\"code\":", 8);
+    json_string(json, data + INT_32 + INT_32, i - 1);
+    smart_str_appendl(json, ",\"scope\":", 9);
+    if (json_document(json, data + INT_32 + INT_32 + i, data + size, 0, flags, depth + 1 TSRMLS_CC) == 0) {
+      return FAILURE;
+    }
+    smart_str_appendc(json, '}');
+    break;
+  }
+  case BSON_INT:
+    memcpy(&i, data, INT_32);
+    smart_str_append_long(json, MONGO_32(i));
+    break;
+  case BSON_TIMESTAMP: {
+    int32_t sec;
+
+    // increment, then seconds
+    memcpy(&i, data, INT_32);
+    memcpy(&sec, data + INT_32, INT_32);
+
+    smart_str_appendl(json, "{\"sec\":", 7);
+    smart_str_append_long(json, MONGO_32(sec));
+    smart_str_appendl(json, ",\"inc\":", 7);
+    smart_str_append_long(json, MONGO_32(i));
+    smart_str_appendc(json, '}');
+    break;
+  }
+  case BSON_LONG:
+    memcpy(&l, data, INT_64);
+    json_long(json, MONGO_64(l), flags & MONGO_JSON_LONG_AS_STRING);
+    break;
+  case BSON_MINKEY:
+  case BSON_MAXKEY:
+    smart_str_appendl(json, "{}", 2);
+    break;
+  }
+
+  return SUCCESS;
+}
+
+/*
+ * Writes the document at buf as a JSON object, or as a JSON array if list is
+ * set (the keys of BSON arrays aren't looked at).  Every value is checked to
+ * fit in the document, so this is safe to use on BSON from anywhere.
+ */
+static char* json_document(smart_str *json, char *buf, char *end, int list, int flags, int depth TSRMLS_DC) {
+  char *pos = buf + INT_32, *doc_end;
+  int len = 0, first = 1;
+
+  if (end - buf >= INT_32) {
+    memcpy(&len, buf, INT_32);
+    len = MONGO_32(len);
+  }
+
+  if (depth > MONGO_JSON_MAX_DEPTH || len < INT_32 + BYTE_8 || len > end - buf || buf[len - 1] != '\0') {
+    zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+    return 0;
+  }
+  doc_end = buf + len - 1;
+
+  smart_str_appendc(json, list ? '[' : '{');
+
+  while (pos < doc_end) {
+    char type = *pos++, *name = pos, *name_end = (char*)memchr(pos, '\0', doc_end - pos);
+    int size;
+
+    if (!name_end || (size = php_mongo_bson_value_size(type, name_end + 1, doc_end)) < 0) {
+      zend_throw_exception(mongo_ce_Exception, "invalid BSON document", 20 TSRMLS_CC);
+      return 0;
+    }
+
+    if (!first) {
+      smart_str_appendc(json, ',');
+    }
+    first = 0;
+
+    if (!list) {
+      json_string(json, name, name_end - name);
+      smart_str_appendc(json, ':');
+    }
+
+    if (json_value(json, type, name_end + 1, size, flags, depth TSRMLS_CC) == FAILURE) {
+      return 0;
+    }
+
+    pos = name_end + 1 + size;
+  }
+
+  smart_str_appendc(json, list ? ']' : '}');
+  return buf + len;
+}
+
+char* php_mongo_bson_to_json(smart_str *json, char *buf, char *end, int flags TSRMLS_DC) {
+  return json_document(json, buf, end, 0, flags, 0 TSRMLS_CC);
+}
+
+int php_mongo_bson_is_error(char *buf, char *end) {
+  char *pos = buf + INT_32, *doc_end;
+  int len = 0;
+
+  if (end - buf >= INT_32) {
+    memcpy(&len, buf, INT_32);
+    len = MONGO_32(len);
+  }
+  if (len < INT_32 + BYTE_8 || len > end - buf) {
+    return 0;
+  }
+  doc_end = buf + len - 1;
+
+  while (pos < doc_end) {
+    char type = *pos++, *name = pos, *name_end = (char*)memchr(pos, '\0', doc_end - pos);
+    int size;
+
+    if (!name_end || (size = php_mongo_bson_value_size(type, name_end + 1, doc_end)) < 0) {
+      return 0;
+    }
+
+    if (strcmp(name, "$err") == 0 || (type == BSON_STRING && strcmp(name, "err") == 0)) {
+      return 1;
+    }
+
+    pos = name_end + 1 + size;
+  }
+
+  return 0;
+}
+
+/*
+ * JSON to BSON.  The parser writes each value into the send buffer as it
+ * reads it; there's no intermediate zval tree.  The type byte of an element is
+ * filled in once its value has been read.
+ */
+typedef struct {
+  char *start;
+  char *pos;
+  char *end;
+  // decoded keys and extended JSON strings
+  buffer scratch;
+} json_parser;
+
+static int json_parse_value(json_parser *p, buffer *buf, int depth TSRMLS_DC);
+static int json_parse_document(json_parser *p, buffer *buf, int depth, int prep, int *has_id TSRMLS_DC);
+
+static void json_error(json_parser *p, char *what TSRMLS_DC) {
+  if (!EG(exception)) {
+    zend_throw_exception_ex(mongo_ce_Exception, 27 TSRMLS_CC, "invalid JSON: %s at offset %d", what, (int)(p->pos - p->start));
+  }
+}
+
+static void json_skip_space(json_parser *p) {
+  while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r')) {
+    p->pos++;
+  }
+}
+
+static int json_hex_digit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+    return (c | 0x20) - 'a' + 10;
+  }
+  return -1;
+}
+
+// the four hex digits of a \u escape
+static int json_hex(char *s) {
+  int i, c = 0;
+
+  for (i = 0; i < 4; i++) {
+    int digit = json_hex_digit(s[i]);
+
+    if (digit < 0) {
+      return -1;
+    }
+    c = (c << 4) | digit;
+  }
+  return c;
+}
+
+static void json_put_utf8(buffer *buf, unsigned int c) {
+  char utf8[4];
+  int len;
+
+  if (c < 0x80) {
+    utf8[0] = c;
+    len = 1;
+  }
+  else if (c < 0x800) {
+    utf8[0] = 0xc0 | (c >> 6);
+    utf8[1] = 0x80 | (c & 0x3f);
+    len = 2;
+  }
+  else if (c < 0x10000) {
+    utf8[0] = 0xe0 | (c >> 12);
+    utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+    utf8[2] = 0x80 | (c & 0x3f);
+    len = 3;
+  }
+  else {
+    utf8[0] = 0xf0 | (c >> 18);
+    utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+    utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+    utf8[3] = 0x80 | (c & 0x3f);
+    len = 4;
+  }
+
+  php_mongo_serialize_bytes(buf, utf8, len);
+}
+
+/*
+ * Appends the unescaped contents of the string at p->pos to buf, without a
+ * trailing \0.  Returns the number of bytes written, or -1.
+ */
+static int json_parse_string(json_parser *p, buffer *buf TSRMLS_DC) {
+  int start = buf->pos - buf->start;
+  char *plain;
+
+  // skip the opening quote
+  plain = ++p->pos;
+
+  while (p->pos < p->end) {
+    unsigned char c = *p->pos;
+
+    if (c != '"' && c != '\\' && c >= 0x20) {
+      p->pos++;
+      continue;
+    }
+
+    php_mongo_serialize_bytes(buf, plain, p->pos - plain);
+
+    if (c == '"') {
+      p->pos++;
+      return buf->pos - buf->start - start;
+    }
+    if (c < 0x20) {
+      json_error(p, "control character in string" TSRMLS_CC);
+      return -1;
+    }
+
+    // an escape
+    if (++p->pos >= p->end) {
+      break;
+    }
+
+    switch (*p->pos++) {
+    case '"':
+      php_mongo_serialize_byte(buf, '"');
+      break;
+    case '\\':
+      php_mongo_serialize_byte(buf, '\\');
+      break;
+    case '/':
+      php_mongo_serialize_byte(buf, '/');
+      break;
+    case 'b':
+      php_mongo_serialize_byte(buf, '\b');
+      break;
+    case 'f':
+      php_mongo_serialize_byte(buf, '\f');
+      break;
+    case 'n':
+      php_mongo_serialize_byte(buf, '\n');
+      break;
+    case 'r':
+      php_mongo_serialize_byte(buf, '\r');
+      break;
+    case 't':
+      php_mongo_serialize_byte(buf, '\t');
+      break;
+    case 'u': {
+      int c1 = p->end - p->pos >= 4 ? json_hex(p->pos) : -1, c2 = -1;
+
+      // characters outside the BMP are written as surrogate pairs
+      if (c1 >= 0xd800 && c1 <= 0xdbff && p->end - p->pos >= 10 && p->pos[4] == '\\' && p->pos[5] == 'u') {
+        c2 = json_hex(p->pos + 6);
+      }
+
+      if (c1 >= 0xd800 && c1 <= 0xdbff && c2 >= 0xdc00 && c2 <= 0xdfff) {
+        json_put_utf8(buf, 0x10000 + ((c1 - 0xd800) << 10) + (c2 - 0xdc00));
+        p->pos += 10;
+      }
+      else if (c1 >= 0 && (c1 < 0xd800 || c1 > 0xdfff)) {
+        json_put_utf8(buf, c1);
+        p->pos += 4;
+      }
+      else {
+        json_error(p, "invalid \\u escape" TSRMLS_CC);
+        return -1;
+      }
+      break;
+    }
+    default:
+      p->pos--;
+      json_error(p, "invalid escape" TSRMLS_CC);
+      return -1;
+    }
+
+    plain = p->pos;
+  }
+
+  json_error(p, "unterminated string" TSRMLS_CC);
+  return -1;
+}
+
+/*
+ * Reads a number.  Integers that fit in a PHP int are returned in *l, with 1,
+ * anything else in *d, with 0, the same split json_decode() makes.
+ */
+static int json_parse_number(json_parser *p, long *l, double *d TSRMLS_DC) {
+  char *start = p->pos, digits[64], *copy = digits;
+  int integer = 1, overflow = 0, negative = 0, len;
+  unsigned long u = 0;
+
+  if (p->pos < p->end && *p->pos == '-') {
+    negative = 1;
+    p->pos++;
+  }
+  if (p->pos >= p->end || *p->pos < '0' || *p->pos > '9') {
+    json_error(p, "unexpected character" TSRMLS_CC);
+    return -1;
+  }
+
+  // no leading zeros
+  if (*p->pos == '0' && p->pos + 1 < p->end && p->pos[1] >= '0' && p->pos[1] <= '9') {
+    json_error(p, "invalid number" TSRMLS_CC);
+    return -1;
+  }
+
+  while (p->pos < p->end && *p->pos >= '0' && *p->pos <= '9') {
+    unsigned long next = u * 10 + (*p->pos - '0');
+
+    if (next / 10 != u) {
+      overflow = 1;
+    }
+    u = next;
+    p->pos++;
+  }
+
+  if (p->pos < p->end && *p->pos == '.') {
+    integer = 0;
+    p->pos++;
+    if (p->pos >= p->end || *p->pos < '0' || *p->pos > '9') {
+      json_error(p, "invalid number" TSRMLS_CC);
+      return -1;
+    }
+    while (p->pos < p->end && *p->pos >= '0' && *p->pos <= '9') {
+      p->pos++;
+    }
+  }
+
+  if (p->pos < p->end && (*p->pos == 'e' || *p->pos == 'E')) {
+    integer = 0;
+    p->pos++;
+    if (p->pos < p->end && (*p->pos == '+' || *p->pos == '-')) {
+      p->pos++;
+    }
+    if (p->pos >= p->end || *p->pos < '0' || *p->pos > '9') {
+      json_error(p, "invalid number" TSRMLS_CC);
+      return -1;
+    }
+    while (p->pos < p->end && *p->pos >= '0' && *p->pos <= '9') {
+      p->pos++;
+    }
+  }
+
+  if (integer && !overflow && (negative ? u <= (unsigned long)LONG_MAX + 1 : u <= LONG_MAX)) {
+    *l = negative ? (long)(0 - u) : (long)u;
+    return 1;
+  }
+
+  // the input doesn't have to be \0-terminated, so copy it, on the heap if
+  // it's long (e.g., lots of decimals)
+  len = p->pos - start;
+  if (len >= (int)sizeof(digits)) {
+    copy = (char*)emalloc(len + 1);
+  }
+  memcpy(copy, start, len);
+  copy[len] = '\0';
+
+  *d = zend_strtod(copy, NULL);
+  if (copy != digits) {
+    efree(copy);
+  }
+  return 0;
+}
+
+static int json_literal(json_parser *p, char *literal, int len TSRMLS_DC) {
+  if (p->end - p->pos < len || memcmp(p->pos, literal, len) != 0) {
+    json_error(p, "unexpected character" TSRMLS_CC);
+    return FAILURE;
+  }
+  p->pos += len;
+  return SUCCESS;
+}
+
+/*
+ * Returns whether the object at p->pos starts with one of the extended JSON
+ * keys: {"$oid": ...}, {"$date": ...} or {"$binary": ..., "$type": ...}.
+ */
+static int json_is_extended(json_parser *p) {
+  char *pos = p->pos + 1;
+
+  while (pos < p->end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+    pos++;
+  }
+
+#define JSON_KEY_IS(key) (p->end - pos >= (int)sizeof(key) + 1 && memcmp(pos, "\"" key "\"", sizeof(key) + 1) == 0)
+  if (JSON_KEY_IS("$oid") || JSON_KEY_IS("$date") || JSON_KEY_IS("$binary")) {
+    return 1;
+  }
+  // {"$type": 2} is a query operator, {"$type": "00", "$binary": ...} isn't
+  if (JSON_KEY_IS("$type")) {
+    pos += sizeof("$type") + 1;
+    while (pos < p->end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r' || *pos == ':')) {
+      pos++;
+    }
+    return pos < p->end && *pos == '"';
+  }
+  return 0;
+#undef JSON_KEY_IS
+}
+
+/*
+ * Writes an extended JSON object as the BSON type it stands for and returns
+ * the type.
+ */
+static int json_parse_extended(json_parser *p, buffer *buf TSRMLS_DC) {
+  int oid = -1, oid_len = 0, bin = -1, bin_len = 0, type = -1, type_len = 0, has_date = 0;
+  long l = 0;
+  double d = 0;
+  int64_t date = 0;
+
+  p->scratch.pos = p->scratch.start;
+  p->pos++;
+
+  for (;;) {
+    int key_start = p->scratch.pos - p->scratch.start, key_len, value_len, *offset, *len;
+    char *key;
+
+    json_skip_space(p);
+    if (p->pos >= p->end || *p->pos != '"') {
+      json_error(p, "expected a string" TSRMLS_CC);
+      return 0;
+    }
+
+    if ((key_len = json_parse_string(p, &p->scratch TSRMLS_CC)) < 0) {
+      return 0;
+    }
+    // the key is only needed until its value is read
+    key = p->scratch.start + key_start;
+    p->scratch.pos = key;
+
+    json_skip_space(p);
+    if (p->pos >= p->end || *p->pos != ':') {
+      json_error(p, "expected ':'" TSRMLS_CC);
+      return 0;
+    }
+    p->pos++;
+    json_skip_space(p);
+
+    if (key_len == 5 && memcmp(key, "$date", 5) == 0) {
+      int integer;
+
+      if (has_date || (integer = json_parse_number(p, &l, &d TSRMLS_CC)) < 0) {
+        json_error(p, "invalid $date" TSRMLS_CC);
+        return 0;
+      }
+      date = integer ? (int64_t)l : (int64_t)d;
+      has_date = 1;
+    }
+    else {
+      if (key_len == 4 && memcmp(key, "$oid", 4) == 0) {
+        offset = &oid;
+        len = &oid_len;
+      }
+      else if (key_len == 7 && memcmp(key, "$binary", 7) == 0) {
+        offset = &bin;
+        len = &bin_len;
+      }
+      else if (key_len == 5 && memcmp(key, "$type", 5) == 0) {
+        offset = &type;
+        len = &type_len;
+      }
+      else {
+        json_error(p, "unknown extended JSON key" TSRMLS_CC);
+        return 0;
+      }
+
+      if (*offset >= 0 || p->pos >= p->end || *p->pos != '"') {
+        json_error(p, "invalid extended JSON value" TSRMLS_CC);
+        return 0;
+      }
+
+      *offset = p->scratch.pos - p->scratch.start;
+      if ((value_len = json_parse_string(p, &p->scratch TSRMLS_CC)) < 0) {
+        return 0;
+      }
+      *len = value_len;
+    }
+
+    json_skip_space(p);
+    if (p->pos < p->end && *p->pos == ',') {
+      p->pos++;
+    }
+    else if (p->pos < p->end && *p->pos == '}') {
+      p->pos++;
+      break;
+    }
+    else {
+      json_error(p, "expected ',' or '}'" TSRMLS_CC);
+      return 0;
+    }
+  }
+
+  if (oid >= 0 && bin < 0 && type < 0 && !has_date) {
+    char id[OID_SIZE], *hex = p->scratch.start + oid;
+    int i;
+
+    for (i = 0; i < OID_SIZE && oid_len == OID_SIZE * 2; i++) {
+      int high = json_hex_digit(hex[i * 2]), low = json_hex_digit(hex[i * 2 + 1]);
+
+      if (high < 0 || low < 0) {
+        break;
+      }
+      id[i] = (high << 4) | low;
+    }
+    if (i < OID_SIZE) {
+      json_error(p, "invalid $oid" TSRMLS_CC);
+      return 0;
+    }
+
+    php_mongo_serialize_bytes(buf, id, OID_SIZE);
+    return BSON_OID;
+  }
+
+  if (has_date && oid < 0 && bin < 0 && type < 0) {
+    php_mongo_serialize_long(buf, date);
+    return BSON_DATE;
+  }
+
+  if (bin >= 0 && type >= 0 && oid < 0 && !has_date) {
+    char *hex = p->scratch.start + type;
+    unsigned char *data;
+    int data_len, subtype = -1;
+
+    if (type_len == 1) {
+      subtype = json_hex_digit(hex[0]);
+    }
+    else if (type_len == 2 && json_hex_digit(hex[0]) >= 0 && json_hex_digit(hex[1]) >= 0) {
+      subtype = (json_hex_digit(hex[0]) << 4) | json_hex_digit(hex[1]);
+    }
+
+    if (subtype < 0 || (data = php_base64_decode((unsigned char*)p->scratch.start + bin, bin_len, &data_len)) == 0) {
+      json_error(p, "invalid $binary" TSRMLS_CC);
+      return 0;
+    }
+
+    // the old binary subtype is written with an extra length, like MongoBinData
+    if (subtype == 2) {
+      php_mongo_serialize_int(buf, data_len + INT_32);
+      php_mongo_serialize_byte(buf, 2);
+      php_mongo_serialize_int(buf, data_len);
+    }
+    else {
+      php_mongo_serialize_int(buf, data_len);
+      php_mongo_serialize_byte(buf, (char)subtype);
+    }
+    php_mongo_serialize_bytes(buf, (char*)data, data_len);
+
+    efree(data);
+    return BSON_BINARY;
+  }
+
+  json_error(p, "invalid extended JSON" TSRMLS_CC);
+  return 0;
+}
+
+/*
+ * Writes the array at p->pos as a BSON array, keyed "0", "1", ...
+ */
+static int json_parse_array(json_parser *p, buffer *buf, int depth TSRMLS_DC) {
+  int start = buf->pos - buf->start, i = 0;
+
+  if (depth > MONGO_JSON_MAX_DEPTH) {
+    json_error(p, "nested too deep" TSRMLS_CC);
+    return FAILURE;
+  }
+
+  p->pos++;
+  php_mongo_serialize_int(buf, 0);
+
+  json_skip_space(p);
+  if (p->pos < p->end && *p->pos == ']') {
+    p->pos++;
+  }
+  else {
+    for (;;) {
+      int type_pos = buf->pos - buf->start, type, key_len;
+      char key[24];
+
+      key_len = snprintf(key, sizeof(key), "%d", i++);
+      php_mongo_set_type(buf, 0);
+      php_mongo_serialize_key(buf, key, key_len, NO_PREP TSRMLS_CC);
+      if (EG(exception)) {
+        return FAILURE;
+      }
+
+      json_skip_space(p);
+      if ((type = json_parse_value(p, buf, depth TSRMLS_CC)) == 0) {
+        return FAILURE;
+      }
+      buf->start[type_pos] = (char)type;
+
+      json_skip_space(p);
+      if (p->pos < p->end && *p->pos == ',') {
+        p->pos++;
+      }
+      else if (p->pos < p->end && *p->pos == ']') {
+        p->pos++;
+        break;
+      }
+      else {
+        json_error(p, "expected ',' or ']'" TSRMLS_CC);
+        return FAILURE;
+      }
+    }
+  }
+
+  php_mongo_serialize_null(buf);
+  return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+}
+
+/*
+ * Writes the value at p->pos and returns its BSON type, or 0 on failure.
+ */
+static int json_parse_value(json_parser *p, buffer *buf, int depth TSRMLS_DC) {
+  if (p->pos >= p->end) {
+    json_error(p, "unexpected end" TSRMLS_CC);
+    return 0;
+  }
+
+  switch (*p->pos) {
+  case '{':
+    if (json_is_extended(p)) {
+      return json_parse_extended(p, buf TSRMLS_CC);
+    }
+    return json_parse_document(p, buf, depth + 1, NO_PREP, 0 TSRMLS_CC) == FAILURE ? 0 : BSON_OBJECT;
+  case '[':
+    return json_parse_array(p, buf, depth + 1 TSRMLS_CC) == FAILURE ? 0 : BSON_ARRAY;
+  case '"': {
+    int start = buf->pos - buf->start, len;
+    char *str;
+
+    // length, string, \0
+    php_mongo_serialize_int(buf, 0);
+    if ((len = json_parse_string(p, buf TSRMLS_CC)) < 0) {
+      return 0;
+    }
+    php_mongo_serialize_null(buf);
+
+    str = buf->start + start + INT_32;
+    if (!MonGlo(encoder).check_string(str, len)) {
+      zend_throw_exception_ex(mongo_ce_Exception, 12 TSRMLS_CC, "non-utf8 string: %s", str);
+      return 0;
+    }
+
+    len = MONGO_32(len + 1);
+    memcpy(buf->start + start, &len, INT_32);
+    return BSON_STRING;
+  }
+  case 't':
+    if (json_literal(p, "true", 4 TSRMLS_CC) == FAILURE) {
+      return 0;
+    }
+    php_mongo_serialize_bool(buf, 1);
+    return BSON_BOOL;
+  case 'f':
+    if (json_literal(p, "false", 5 TSRMLS_CC) == FAILURE) {
+      return 0;
+    }
+    php_mongo_serialize_bool(buf, 0);
+    return BSON_BOOL;
+  case 'n':
+    return json_literal(p, "null", 4 TSRMLS_CC) == FAILURE ? 0 : BSON_NULL;
+  default: {
+    long l;
+    double d;
+
+    switch (json_parse_number(p, &l, &d TSRMLS_CC)) {
+    case 1:
+      // the same type a PHP int gets, see mongo.native_long
+      MonGlo(encoder).serialize_long(buf, l);
+      return MonGlo(encoder).long_type;
+    case 0:
+      php_mongo_serialize_double(buf, d);
+      return BSON_DOUBLE;
+    }
+    return 0;
+  }
+  }
+}
+
+/*
+ * Writes the object at p->pos as a BSON document and returns the number of
+ * fields.  Keys are checked and rewritten the same way array keys are (prep
+ * for documents being inserted).
+ */
+static int json_parse_document(json_parser *p, buffer *buf, int depth, int prep, int *has_id TSRMLS_DC) {
+  int start = buf->pos - buf->start, fields = 0;
+
+  if (depth > MONGO_JSON_MAX_DEPTH) {
+    json_error(p, "nested too deep" TSRMLS_CC);
+    return FAILURE;
+  }
+
+  p->pos++;
+  php_mongo_serialize_int(buf, 0);
+
+  json_skip_space(p);
+  if (p->pos < p->end && *p->pos == '}') {
+    p->pos++;
+  }
+  else {
+    for (;;) {
+      int type_pos = buf->pos - buf->start, type, key_len;
+
+      if (p->pos >= p->end || *p->pos != '"') {
+        json_error(p, "expected a string" TSRMLS_CC);
+        return FAILURE;
+      }
+
+      p->scratch.pos = p->scratch.start;
+      if ((key_len = json_parse_string(p, &p->scratch TSRMLS_CC)) < 0) {
+        return FAILURE;
+      }
+      php_mongo_serialize_null(&p->scratch);
+
+      php_mongo_set_type(buf, 0);
+      php_mongo_serialize_key(buf, p->scratch.start, key_len, prep TSRMLS_CC);
+      if (EG(exception)) {
+        return FAILURE;
+      }
+      if (has_id && strcmp(p->scratch.start, "_id") == 0) {
+        *has_id = 1;
+      }
+
+      json_skip_space(p);
+      if (p->pos >= p->end || *p->pos != ':') {
+        json_error(p, "expected ':'" TSRMLS_CC);
+        return FAILURE;
+      }
+      p->pos++;
+      json_skip_space(p);
+
+      if ((type = json_parse_value(p, buf, depth TSRMLS_CC)) == 0) {
+        return FAILURE;
+      }
+      buf->start[type_pos] = (char)type;
+      fields++;
+
+      json_skip_space(p);
+      if (p->pos < p->end && *p->pos == ',') {
+        p->pos++;
+        json_skip_space(p);
+      }
+      else if (p->pos < p->end && *p->pos == '}') {
+        p->pos++;
+        break;
+      }
+      else {
+        json_error(p, "expected ',' or '}'" TSRMLS_CC);
+        return FAILURE;
+      }
+    }
+  }
+
+  php_mongo_serialize_null(buf);
+  if (php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC) == FAILURE) {
+    return FAILURE;
+  }
+  return fields;
+}
+
+int php_mongo_json_to_bson(buffer *buf, char *json, int len, int prep TSRMLS_DC) {
+  json_parser p;
+  int start = buf->pos - buf->start, fields, has_id = 0;
+
+  p.start = p.pos = json;
+  p.end = json + len;
+  CREATE_BUF(p.scratch, 64);
+
+  json_skip_space(&p);
+  if (p.pos >= p.end || *p.pos != '{') {
+    json_error(&p, "expected an object" TSRMLS_CC);
+    fields = FAILURE;
+  }
+  else if ((fields = json_parse_document(&p, buf, 0, prep, &has_id TSRMLS_CC)) != FAILURE) {
+    json_skip_space(&p);
+    if (p.pos < p.end) {
+      json_error(&p, "unexpected data after the object" TSRMLS_CC);
+      fields = FAILURE;
+    }
+  }
+
+  efree(p.scratch.start);
+
+  // an empty document is left empty, for the "no elements" check
+  if (fields == FAILURE || fields == 0 || !prep || has_id) {
+    return fields;
+  }
+
+  // give it an _id, first, as prep_obj_for_db would
+  {
+    int extra = BYTE_8 + sizeof("_id") + OID_SIZE, doc_len = buf->pos - buf->start - start;
+    char *doc;
+
+    if (BUF_REMAINING <= extra) {
+      resize_buf(buf, extra);
+    }
+    doc = buf->start + start;
+
+    memmove(doc + INT_32 + extra, doc + INT_32, doc_len - INT_32);
+    doc[INT_32] = BSON_OID;
+    memcpy(doc + INT_32 + BYTE_8, "_id", sizeof("_id"));
+    generate_id(doc + INT_32 + BYTE_8 + sizeof("_id") TSRMLS_CC);
+    buf->pos += extra;
+
+    if (php_mongo_serialize_size(doc, buf TSRMLS_CC) == FAILURE) {
+      return FAILURE;
+    }
+  }
+
+  return fields + 1;
+}
+
+/* {{{ bson_to_json(string bson [, array options])
+ *
+ * Turns a BSON document into JSON without decoding it into PHP values first.
+ * See php_mongo_json_flags for the options.
+ */
+PHP_FUNCTION(bson_to_json) {
+  char *str;
+  int str_len, flags = 0;
+  zval *options = 0;
+  smart_str json = {0};
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|a", &str, &str_len, &options) == FAILURE) {
+    return;
+  }
+
+  if (options && php_mongo_json_flags(Z_ARRVAL_P(options), &flags TSRMLS_CC) == FAILURE) {
+    return;
+  }
+
+  if (php_mongo_bson_to_json(&json, str, str + str_len, flags TSRMLS_CC) == 0) {
+    smart_str_free(&json);
+    return;
+  }
+
+  smart_str_0(&json);
+  RETURN_STRINGL(json.c, json.len, 0);
+}
+/* }}} */
+
+/* {{{ json_to_bson(string json)
+ *
+ * Turns a JSON object into BSON without decoding it into PHP values first.
+ * Besides plain JSON, {"$oid": "..."}, {"$date": milliseconds} and
+ * {"$binary": base64, "$type": "00"} are read as ObjectIds, dates and binary
+ * data.
+ */
+PHP_FUNCTION(json_to_bson) {
+  char *json;
+  int json_len;
+  buffer buf;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &json, &json_len) == FAILURE) {
+    return;
+  }
+
+  CREATE_BUF(buf, json_len + INT_32 + BYTE_8);
+
+  if (php_mongo_json_to_bson(&buf, json, json_len, NO_PREP TSRMLS_CC) == FAILURE) {
+    efree(buf.start);
+    return;
+  }
+
+  RETVAL_STRINGL(buf.start, buf.pos - buf.start, 1);
+  efree(buf.start);
+}
+/* }}} */
@@ -0,0 +1,69 @@
+// json.h
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MONGO_JSON_H
+#define MONGO_JSON_H
+
+#include <ext/standard/php_smart_str.h>
+
+/*
+ * How the BSON types JSON doesn't have are written.  With none of these set,
+ * the output is what json_encode() gives for the decoded document: ObjectIds
+ * are {"$id": "..."}, dates {"sec": ..., "usec": ...} and so on, except that
+ * binary data is a base64 string and longs are exact numbers.
+ */
+// "4f06e55e44670ab92b000000"
+#define MONGO_JSON_ID_AS_STRING 1
+// milliseconds since the epoch
+#define MONGO_JSON_DATE_AS_INT 2
+// "2012-01-06T12:34:56.789Z"
+#define MONGO_JSON_DATE_AS_ISO 4
+// {"$binary": base64, "$type": "00"}
+#define MONGO_JSON_BIN_EXTENDED 8
+// "9223372036854775807"
+#define MONGO_JSON_LONG_AS_STRING 16
+
+/**
+ * Reads the options given to bson_to_json() and MongoCursor::toJSON(), "id" =>
+ * "object" or "string", "date" => "object", "int" or "iso", "binary" =>
+ * "base64" or "extended" and "long" => "number" or "string", into flags.
+ * Returns FAILURE, with an exception thrown, for anything else.
+ */
+int php_mongo_json_flags(HashTable *options, int *flags TSRMLS_DC);
+
+/**
+ * Appends the BSON document at buf, which must end before end, to json as a
+ * JSON object, without decoding it into PHP values.  Returns the position
+ * after the document, or 0 with an exception thrown if it is malformed.
+ */
+char* php_mongo_bson_to_json(smart_str *json, char *buf, char *end, int flags TSRMLS_DC);
+
+/**
+ * Returns 1 if the BSON document at buf is an error reply: it has a $err field
+ * or a string err field.
+ */
+int php_mongo_bson_is_error(char *buf, char *end);
+
+/**
+ * Writes the JSON object json, of len bytes, to buf as a BSON document, with
+ * keys checked as they are for arrays.  If prep is set, a document without an
+ * _id is given one.  Returns the number of fields, or FAILURE with an
+ * exception thrown.
+ */
+int php_mongo_json_to_bson(buffer *buf, char *json, int len, int prep TSRMLS_DC);
+
+#endif
@@ -30,6 +30,7 @@
 #include "server.h"
 #include "log.h"
 #include "rs.h"
+#include "io.h"
 
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
 
@@ -112,6 +113,9 @@ int mongo_util_pool_get(mongo_server *server, zval *errmsg TSRMLS_DC) {
 void mongo_util_pool_done(mongo_server *server TSRMLS_DC) {
   stack_monitor *monitor;
 
+  // the next owner of the socket will skip any replies left on it
+  php_mongo_forget_replies(server TSRMLS_CC);
+
   if ((monitor = mongo_util_pool__get_monitor(server TSRMLS_CC)) == 0) {
     // if we couldn't push this, close the connection
     mongo_util_disconnect(server TSRMLS_CC);
@@ -570,6 +574,7 @@ static zend_function_entry MongoPool_methods[] = {
   PHP_ME(MongoPool, info, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC|ZEND_ACC_DEPRECATED)
   PHP_ME(MongoPool, setSize, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC|ZEND_ACC_DEPRECATED)
   PHP_ME(MongoPool, getSize, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC|ZEND_ACC_DEPRECATED)
+  PHP_ME(MongoPool, sendBufferInfo, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
   {NULL, NULL, NULL}
 };
 
@@ -638,6 +643,18 @@ PHP_METHOD(MongoPool, info) {
   // return_value is returned
 }
 
+/*
+ * How often the request's send buffer was reused (see php_mongo_buf_get).
+ */
+PHP_METHOD(MongoPool, sendBufferInfo) {
+  array_init(return_value);
+
+  add_assoc_long(return_value, "reused", MonGlo(send_buf_reused));
+  add_assoc_long(return_value, "allocated", MonGlo(send_buf_allocated));
+  add_assoc_long(return_value, "size", MonGlo(send_buf).start ? MonGlo(send_buf).end - MonGlo(send_buf).start : 0);
+  add_assoc_long(return_value, "max", MonGlo(send_buffer_max));
+}
+
 PHP_METHOD(Mongo, setPoolSize) {
   MONGO_METHOD_BASE(MongoPool, setSize)(1, return_value, NULL, 0, 0 TSRMLS_CC);
 }
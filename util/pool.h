@@ -219,6 +219,7 @@ void mongo_init_MongoPool(TSRMLS_D);
 PHP_METHOD(MongoPool, setSize);
 PHP_METHOD(MongoPool, getSize);
 PHP_METHOD(MongoPool, info);
+PHP_METHOD(MongoPool, sendBufferInfo);
 
 PHP_METHOD(Mongo, setPoolSize);
 PHP_METHOD(Mongo, getPoolSize);